@@ -2,4 +2,9 @@
 
 CFLAGS=$(php-config --includes)
 g++ -std=c++11 -fPIC -shared -g  $CFLAGS -I./3thrd/include/ -L./3thrd/lib/ -lthrift -Wl,-rpath=/home/stock/workspace/php-ext/test/3thrd/lib \
--o ./build/thrift_bridge.so  ./thrift_bridge.c 
\ No newline at end of file
+-o ./build/thrift_bridge.so  ./thrift_bridge.c 
+# 可选：读取 thrift_bridge.metrics_file 输出 Prometheus 文本的命令行工具
+g++ -std=c++11 -O2 -o ./build/thrift_bridge_metrics ./tools/thrift_bridge_metrics.cc
+# 可选：旁车守护进程 (thrift_bridge.sidecar)，TNonblockingServer 需要 libthriftnb 与 libevent
+g++ -std=c++11 -O2 -rdynamic -I./3thrd/include/ -L./3thrd/lib/ -o ./build/thrift_bridge_sidecar ./tools/thrift_bridge_sidecar.cc \
+-lthriftnb -lthrift -levent -ldl -lpthread
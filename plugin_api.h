@@ -2,6 +2,7 @@
 #ifndef PLUGIN_API_H
 #define PLUGIN_API_H
 
+#include <dlfcn.h>
 #include <stddef.h>
 
 // 宏定义插件注册函数的名称
@@ -11,8 +12,98 @@
 struct ProcessorFactoryContext;
 
 // 定义插件注册函数签名：所有插件 .so 必须实现这个函数
+// 热更新 (thrift_bridge.watch_plugins / thrift_bridge_reload()) 时新版本与旧版本同时加载，
+// 新版本的注册函数在已经处理请求的进程中再执行一次；旧版本在进行中的调用结束后卸载，
+// 它创建的处理器先于 dlclose 析构。插件的全局资源 (线程、连接) 应随处理器一起释放。
 typedef void (*RegisterProcessorFunc)(struct ProcessorFactoryContext* context);
 
+// 可选：fork 后在每个工作进程中调用一次 (thrift_bridge.preload=1 时插件在 FPM master
+// 的 MINIT 中加载，随后 fork 出子进程)。插件在这里重建不能跨 fork 使用的资源：
+// 线程、socket/连接池、随机数种子等。未导出此函数的插件不受影响。
+#define PLUGIN_CHILD_INIT_FUNC_NAME "thrift_bridge_plugin_child_init"
+typedef void (*PluginChildInitFunc)(void);
+
+// 插件接口版本。ProcessorFactoryContext 只会在末尾追加字段，
+// 使用新字段前请先用 thrift_bridge_context_api_version(context) 检查版本 (见文件末尾)。
+#define THRIFT_BRIDGE_PLUGIN_API_VERSION 4
+
+// 宿主 (扩展与旁车守护进程) 导出的版本查询函数。版本 1 的宿主没有 api_version 字段，
+// 也不导出这个函数：插件不能直接读 context->api_version，那会越过旧宿主结构体的末尾
+#define THRIFT_BRIDGE_HOST_VERSION_FUNC_NAME "thrift_bridge_host_api_version"
+typedef int (*HostApiVersionFunc)(void);
+
+// 插件导出的处理器类型 (register_func_ex_ptr 的 flavor 参数)
+enum ThriftBridgeProcessorFlavor {
+    // 普通生成代码 (thrift --gen cpp)，协议调用经过虚函数分发
+    THRIFT_BRIDGE_PROCESSOR_VIRTUAL = 0,
+    // 使用 templates 选项生成 (thrift --gen cpp:templates)，并实例化为
+    //   XxxProcessorT< apache::thrift::protocol::TBinaryProtocolT<apache::thrift::transport::TMemoryBuffer> >
+    // 核心库正是用这一具体协议类型驱动处理器，编解码循环可以全程内联
+    THRIFT_BRIDGE_PROCESSOR_BINARY_MEMBUF = 1
+};
+
+// 方法选项 (register_method_flags_ptr 的 flags 参数，可按位组合)
+enum ThriftBridgeMethodFlags {
+    // 方法是参数的纯函数 (不读写外部状态)：打开 thrift_bridge.cache_size 时，
+    // 响应存入各工作进程共享的缓存，ttl_ms 毫秒内相同参数的调用不再执行处理器
+    THRIFT_BRIDGE_METHOD_CACHEABLE = 1
+};
+
+// --- IDL 类型描述 (API 版本 3) ---
+// 插件用静态表描述服务的方法与结构体，核心库据此在 C 层直接完成
+// PHP 数组 <-> Thrift 二进制的编解码 (见 ThriftBridgeClient)。
+// 所有描述必须在插件生命周期内有效 (通常是 static const)。
+
+// 类型编号与 apache::thrift::protocol::TType 一致
+#define THRIFT_BRIDGE_T_BOOL   2
+#define THRIFT_BRIDGE_T_BYTE   3
+#define THRIFT_BRIDGE_T_DOUBLE 4
+#define THRIFT_BRIDGE_T_I16    6
+#define THRIFT_BRIDGE_T_I32    8
+#define THRIFT_BRIDGE_T_I64    10
+#define THRIFT_BRIDGE_T_STRING 11
+#define THRIFT_BRIDGE_T_STRUCT 12
+#define THRIFT_BRIDGE_T_MAP    13
+#define THRIFT_BRIDGE_T_SET    14
+#define THRIFT_BRIDGE_T_LIST   15
+
+struct ThriftBridgeStructSpec;
+
+struct ThriftBridgeTypeSpec {
+    int type;                                          // THRIFT_BRIDGE_T_*
+    const struct ThriftBridgeStructSpec* struct_spec;  // type == STRUCT 时的结构体
+    const struct ThriftBridgeTypeSpec* key;            // type == MAP 时的 key 类型
+    const struct ThriftBridgeTypeSpec* value;          // LIST/SET 的元素类型，MAP 的 value 类型
+};
+
+struct ThriftBridgeFieldSpec {
+    short id;
+    const char* name;
+    struct ThriftBridgeTypeSpec type;
+    int required;
+};
+
+struct ThriftBridgeStructSpec {
+    const char* name;
+    const struct ThriftBridgeFieldSpec* fields;
+    int field_count;
+};
+
+struct ThriftBridgeMethodSpec {
+    const char* name;
+    // 生成代码中的 xxx_args 结构体
+    const struct ThriftBridgeStructSpec* args;
+    // 生成代码中的 xxx_result 结构体：字段 0 为返回值 (void 方法没有)，其余字段为声明的异常；
+    // oneway 方法为 NULL
+    const struct ThriftBridgeStructSpec* result;
+};
+
+struct ThriftBridgeServiceSpec {
+    const char* service_name;
+    const struct ThriftBridgeMethodSpec* methods;
+    int method_count;
+};
+
 // 约定用于演示的简化版 ProcessorFactory 接口 (实际中需要提供 TProcessor 接口)
 struct ProcessorFactoryContext {
     // 注册 TProcessor 的函数指针：
@@ -21,6 +112,30 @@ struct ProcessorFactoryContext {
     void* factory_instance;
     // 实际的注册函数指针，用于注册 TProcessor
     void (*register_func_ptr)(void* factory_instance, const char* service_name, void* t_processor_ptr);
+
+    // --- 以下字段自 API 版本 2 起提供 ---
+    int api_version;
+    // 同 register_func_ptr，额外声明处理器类型 (enum ThriftBridgeProcessorFlavor)
+    void (*register_func_ex_ptr)(void* factory_instance, const char* service_name, void* t_processor_ptr, int flavor);
+
+    // --- 以下字段自 API 版本 3 起提供 ---
+    // 导出服务的 IDL 类型描述，需在对应处理器注册之后调用
+    void (*register_spec_ptr)(void* factory_instance, const struct ThriftBridgeServiceSpec* spec);
+
+    // --- 以下字段自 API 版本 4 起提供 ---
+    // 声明方法选项 (enum ThriftBridgeMethodFlags)，需在对应处理器注册之后调用；
+    // ttl_ms 为 CACHEABLE 的缓存时长
+    void (*register_method_flags_ptr)(void* factory_instance, const char* service_name, const char* method_name,
+                                      unsigned int flags, unsigned int ttl_ms);
 };
 
+#ifndef RTLD_DEFAULT
+#define RTLD_DEFAULT ((void*)0)
+#endif
+
+// 宿主提供的接口版本：宿主导出了版本查询函数才读取 api_version，否则是版本 1
+static inline int thrift_bridge_context_api_version(const struct ProcessorFactoryContext* context) {
+    return dlsym(RTLD_DEFAULT, THRIFT_BRIDGE_HOST_VERSION_FUNC_NAME) != NULL ? context->api_version : 1;
+}
+
 #endif // PLUGIN_API_H
\ No newline at end of file
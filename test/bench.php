@@ -0,0 +1,260 @@
+<?php
+// bench.php
+//
+// PHP -> 插件 调用路径的端到端基准测试。
+// 按 模式 x 协议 x 负载大小 逐组测量 calls/sec 与 p50/p99 延迟，结果可输出为 JSON，
+// 再用 bench_compare.php 与基线比较，判断某次改动是否带来性能回退。
+//
+// 模式:
+//   bridge      生成的 Client + ThriftBridgeTransport，PHP 侧用 TBinaryProtocolAccelerated / TCompactProtocol
+//   bridge-php  同上，但 PHP 侧固定用纯 PHP 的 TBinaryProtocol (不走 thrift_protocol 扩展)
+//   native      ThriftBridgeClient，编解码在 C 层完成 (仅 binary)
+//   socket      生成的 Client + TSocket，连接本机 bench_server (传统的独立服务进程)
+//
+// 用法:
+//   php -c php.ini bench.php [--modes=bridge,native,socket] [--protocols=binary,compact]
+//       [--payloads=tiny,list-100,list-10k,list-200k] [--duration=2] [--warmup=0.2]
+//       [--server=./bench_server] [--port=19090] [--json=out.json|-]
+
+require_once __DIR__ . '/gen-php/DynamicExt/Types.php';
+require_once __DIR__ . '/gen-php/DynamicExt/DynamicServiceA.php';
+require_once __DIR__ . '/vendor/autoload.php';
+
+use Thrift\Protocol\TBinaryProtocol;
+use Thrift\Protocol\TBinaryProtocolAccelerated;
+use Thrift\Protocol\TCompactProtocol;
+use Thrift\Transport\TBufferedTransport;
+use Thrift\Transport\TMemoryBuffer;
+use Thrift\Transport\TSocket;
+use DynamicExt\BatchData;
+use DynamicExt\DynamicServiceAClient;
+use DynamicExt\InputData;
+
+const SERVICE_NAME = 'DynamicServiceA';
+
+$opts = getopt('', ['modes:', 'protocols:', 'payloads:', 'duration:', 'warmup:', 'server:', 'port:', 'json:']);
+$modes     = explode(',', $opts['modes'] ?? 'bridge,bridge-php,native,socket');
+$protocols = explode(',', $opts['protocols'] ?? 'binary,compact');
+$payloads  = explode(',', $opts['payloads'] ?? 'tiny,list-100,list-10k,list-200k');
+$duration  = (float)($opts['duration'] ?? 2.0);
+$warmup    = (float)($opts['warmup'] ?? 0.2);
+$server    = $opts['server'] ?? __DIR__ . '/bench_server';
+$port      = (int)($opts['port'] ?? 19090);
+$jsonOut   = $opts['json'] ?? null;
+
+if (!extension_loaded('thrift_bridge')) {
+    fwrite(STDERR, "Error: PHP extension 'thrift_bridge' is not loaded. Please check your php.ini.\n");
+    exit(2);
+}
+
+// ----------------------------------------------------
+// 负载
+// ----------------------------------------------------
+
+// tiny 走 process_transaction_a (一个小结构体)，list-N 走 echo_batch (N 个元素的列表，请求和响应等大)
+function make_payload(string $name): array
+{
+    if ($name === 'tiny') {
+        $input = ['transaction_id' => 101, 'amount' => 60.00];
+        return ['method' => 'process_transaction_a', 'array' => [$input], 'object' => [new InputData($input)]];
+    }
+    if (!preg_match('/^list-(\d+)(k?)$/', $name, $m)) {
+        throw new InvalidArgumentException("unknown payload: $name");
+    }
+    $n = (int)$m[1] * ($m[2] === 'k' ? 1000 : 1);
+    $items = [];
+    $objects = [];
+    for ($i = 0; $i < $n; $i++) {
+        $item = ['transaction_id' => $i % 32768, 'amount' => $i * 0.5];
+        $items[] = $item;
+        $objects[] = new InputData($item);
+    }
+    return [
+        'method' => 'echo_batch',
+        'array'  => [['items' => $items]],
+        'object' => [new BatchData(['items' => $objects])],
+    ];
+}
+
+function php_protocol(string $protocol, $transport, bool $accelerated = true)
+{
+    switch ($protocol) {
+        case 'binary':
+            return $accelerated ? new TBinaryProtocolAccelerated($transport) : new TBinaryProtocol($transport);
+        case 'compact':
+            return new TCompactProtocol($transport);
+    }
+    throw new InvalidArgumentException("unknown protocol: $protocol");
+}
+
+// 请求在线路上的字节数：把 send_xxx 写进内存缓冲区量出来
+function request_bytes(string $protocol, array $payload): int
+{
+    $buffer = new TMemoryBuffer();
+    $client = new DynamicServiceAClient(php_protocol($protocol, $buffer));
+    call_user_func_array([$client, 'send_' . $payload['method']], $payload['object']);
+    return strlen($buffer->getBuffer());
+}
+
+// ----------------------------------------------------
+// 回环 Socket 服务端
+// ----------------------------------------------------
+
+function start_server(string $server, int $port, string $protocol)
+{
+    if (!is_executable($server)) {
+        throw new RuntimeException("bench_server not found at $server (build it with test/build.sh or pass --server)");
+    }
+    $proc = proc_open([$server, (string)$port, $protocol], [1 => ['pipe', 'w'], 2 => STDERR], $pipes);
+    if (!is_resource($proc)) {
+        throw new RuntimeException("failed to start $server");
+    }
+    $line = fgets($pipes[1]);
+    if ($line === false || strpos($line, 'listening') !== 0) {
+        proc_terminate($proc);
+        throw new RuntimeException("bench_server did not come up: " . var_export($line, true));
+    }
+    return [$proc, $pipes];
+}
+
+function stop_server(array $server): void
+{
+    [$proc, $pipes] = $server;
+    fclose($pipes[1]);
+    proc_terminate($proc);
+    proc_close($proc);
+}
+
+// ----------------------------------------------------
+// 测量
+// ----------------------------------------------------
+
+// 返回一个执行单次调用的闭包；不支持的组合返回 null
+function make_caller(string $mode, string $protocol, array $payload, int $port): ?Closure
+{
+    $method = $payload['method'];
+    switch ($mode) {
+        case 'bridge':
+        case 'bridge-php':
+            $client = new DynamicServiceAClient(php_protocol(
+                $protocol, new ThriftBridgeTransport(SERVICE_NAME, $protocol), $mode === 'bridge'));
+            $args = $payload['object'];
+            return function () use ($client, $method, $args) { return $client->$method(...$args); };
+
+        case 'native':
+            if ($protocol !== 'binary') {
+                return null; // ThriftBridgeClient 内部固定使用 binary
+            }
+            $client = new ThriftBridgeClient(SERVICE_NAME);
+            $args = $payload['array'];
+            return function () use ($client, $method, $args) { return $client->$method(...$args); };
+
+        case 'socket':
+            $socket = new TSocket('127.0.0.1', $port);
+            $socket->setSendTimeout(30000);
+            $socket->setRecvTimeout(30000);
+            $transport = new TBufferedTransport($socket, 65536, 65536);
+            $transport->open();
+            $client = new DynamicServiceAClient(php_protocol($protocol, $transport));
+            $args = $payload['object'];
+            return function () use ($client, $method, $args) { return $client->$method(...$args); };
+    }
+    throw new InvalidArgumentException("unknown mode: $mode");
+}
+
+function percentile(array $sorted, float $p): float
+{
+    $n = count($sorted);
+    if ($n === 0) {
+        return 0.0;
+    }
+    $rank = (int)ceil($p * $n) - 1;
+    return $sorted[max(0, min($n - 1, $rank))];
+}
+
+// 先预热 $warmup 秒，再至少调用 3 次、持续 $duration 秒，逐次记录耗时 (ns)
+function measure(Closure $call, float $duration, float $warmup): array
+{
+    $deadline = hrtime(true) + (int)($warmup * 1e9);
+    do {
+        $call();
+    } while (hrtime(true) < $deadline);
+
+    $samples = [];
+    $start = hrtime(true);
+    $deadline = $start + (int)($duration * 1e9);
+    do {
+        $t0 = hrtime(true);
+        $call();
+        $t1 = hrtime(true);
+        $samples[] = $t1 - $t0;
+    } while ($t1 < $deadline || count($samples) < 3);
+    $elapsed = (hrtime(true) - $start) / 1e9;
+
+    sort($samples);
+    $calls = count($samples);
+    return [
+        'calls'         => $calls,
+        'seconds'       => round($elapsed, 6),
+        'calls_per_sec' => round($calls / $elapsed, 2),
+        'mean_us'       => round(array_sum($samples) / $calls / 1000, 3),
+        'p50_us'        => round(percentile($samples, 0.50) / 1000, 3),
+        'p99_us'        => round(percentile($samples, 0.99) / 1000, 3),
+        'max_us'        => round(end($samples) / 1000, 3),
+    ];
+}
+
+// ----------------------------------------------------
+// 主流程
+// ----------------------------------------------------
+
+$results = [];
+foreach ($protocols as $protocol) {
+    $socketServer = null;
+    if (in_array('socket', $modes, true)) {
+        $socketServer = start_server($server, $port, $protocol);
+    }
+    try {
+        foreach ($payloads as $payloadName) {
+            $payload = make_payload($payloadName);
+            $bytes = request_bytes($protocol, $payload);
+            foreach ($modes as $mode) {
+                $call = make_caller($mode, $protocol, $payload, $port);
+                if ($call === null) {
+                    continue;
+                }
+                $row = ['mode' => $mode, 'protocol' => $protocol, 'payload' => $payloadName, 'request_bytes' => $bytes]
+                     + measure($call, $duration, $warmup);
+                $results[] = $row;
+                fprintf(STDERR, "%-10s %-8s %-10s %10d B %12.1f calls/s  p50 %10.1f us  p99 %10.1f us\n",
+                    $mode, $protocol, $payloadName, $bytes, $row['calls_per_sec'], $row['p50_us'], $row['p99_us']);
+                unset($call);
+            }
+        }
+    } finally {
+        if ($socketServer !== null) {
+            stop_server($socketServer);
+        }
+    }
+}
+
+if ($jsonOut !== null) {
+    $report = [
+        'meta' => [
+            'timestamp'     => date('c'),
+            'host'          => php_uname('n'),
+            'php_version'   => PHP_VERSION,
+            'thrift_bridge' => phpversion('thrift_bridge'),
+            'accelerated'   => extension_loaded('thrift_protocol'),
+            'duration'      => $duration,
+            'warmup'        => $warmup,
+        ],
+        'results' => $results,
+    ];
+    $json = json_encode($report, JSON_PRETTY_PRINT | JSON_UNESCAPED_SLASHES) . "\n";
+    if ($jsonOut === '-') {
+        echo $json;
+    } else {
+        file_put_contents($jsonOut, $json);
+    }
+}
@@ -0,0 +1,65 @@
+<?php
+// bench_compare.php
+//
+// 比较两次 bench.php --json 的结果，按 (mode, protocol, payload) 对齐，
+// calls/sec 下降或 p99 上升超过阈值即视为回退，以非零状态码退出，便于接入 CI。
+//
+// 用法: php bench_compare.php baseline.json current.json [--threshold=0.10]
+
+$threshold = 0.10;
+$files = [];
+foreach (array_slice($argv, 1) as $arg) {
+    if (strpos($arg, '--threshold=') === 0) {
+        $threshold = (float)substr($arg, strlen('--threshold='));
+    } else {
+        $files[] = $arg;
+    }
+}
+if (count($files) !== 2) {
+    fwrite(STDERR, "usage: php bench_compare.php baseline.json current.json [--threshold=0.10]\n");
+    exit(2);
+}
+
+function load_results(string $file): array
+{
+    $report = json_decode((string)file_get_contents($file), true);
+    if (!is_array($report) || !isset($report['results'])) {
+        fwrite(STDERR, "invalid benchmark report: $file\n");
+        exit(2);
+    }
+    $rows = [];
+    foreach ($report['results'] as $row) {
+        $rows[$row['mode'] . '/' . $row['protocol'] . '/' . $row['payload']] = $row;
+    }
+    return $rows;
+}
+
+$baseline = load_results($files[0]);
+$current  = load_results($files[1]);
+
+$regressions = 0;
+printf("%-34s %14s %14s %8s %12s %12s %8s\n", 'case', 'base calls/s', 'cur calls/s', 'delta', 'base p99', 'cur p99', 'delta');
+foreach ($current as $key => $cur) {
+    if (!isset($baseline[$key])) {
+        printf("%-34s %s\n", $key, '(new)');
+        continue;
+    }
+    $base = $baseline[$key];
+    $tput = $base['calls_per_sec'] > 0 ? $cur['calls_per_sec'] / $base['calls_per_sec'] - 1 : 0.0;
+    $p99  = $base['p99_us'] > 0 ? $cur['p99_us'] / $base['p99_us'] - 1 : 0.0;
+    $bad  = $tput < -$threshold || $p99 > $threshold;
+    if ($bad) {
+        $regressions++;
+    }
+    printf("%-34s %14.1f %14.1f %+7.1f%% %12.1f %12.1f %+7.1f%%%s\n", $key,
+        $base['calls_per_sec'], $cur['calls_per_sec'], $tput * 100,
+        $base['p99_us'], $cur['p99_us'], $p99 * 100, $bad ? '  REGRESSION' : '');
+}
+foreach (array_diff_key($baseline, $current) as $key => $_) {
+    printf("%-34s %s\n", $key, '(missing)');
+}
+
+if ($regressions > 0) {
+    printf("\n%d case(s) regressed by more than %.0f%%\n", $regressions, $threshold * 100);
+    exit(1);
+}
@@ -0,0 +1,54 @@
+// test/bench_server.cc
+// 基准测试用的回环 Socket 服务端：与插件共用 DynamicServiceAHandler，
+// 作为 "PHP -> TSocket -> 独立进程" 这条传统调用路径的对照组。
+// 用法: bench_server <port> [binary|compact]
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/protocol/TCompactProtocol.h>
+#include <thrift/server/TSimpleServer.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TServerSocket.h>
+
+#include "./service_a_handler.h"
+
+using namespace Dynamic;
+using namespace apache::thrift;
+using namespace apache::thrift::protocol;
+using namespace apache::thrift::server;
+using namespace apache::thrift::transport;
+using namespace std;
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        cerr << "usage: " << argv[0] << " <port> [binary|compact]" << endl;
+        return 2;
+    }
+    int port = atoi(argv[1]);
+    const char* proto = argc > 2 ? argv[2] : "binary";
+
+    shared_ptr<TProtocolFactory> protocolFactory;
+    if (strcmp(proto, "binary") == 0) {
+        protocolFactory = make_shared<TBinaryProtocolFactory>();
+    } else if (strcmp(proto, "compact") == 0) {
+        protocolFactory = make_shared<TCompactProtocolFactory>();
+    } else {
+        cerr << "unknown protocol: " << proto << endl;
+        return 2;
+    }
+
+    shared_ptr<DynamicServiceAHandler> handler(new DynamicServiceAHandler());
+    TSimpleServer server(make_shared<DynamicServiceAProcessor>(handler),
+                         make_shared<TServerSocket>("127.0.0.1", port),
+                         make_shared<TBufferedTransportFactory>(),
+                         protocolFactory);
+
+    // bench.php 读到这一行后才开始发请求
+    cout << "listening " << port << " " << proto << endl;
+    server.serve();
+    return 0;
+}
@@ -4,4 +4,11 @@ g++ -std=c++11 -fPIC -shared -o ./plugins/libservice_a.so \
 ./gen-cpp/DynamicServiceA.cpp \
 ./gen-cpp/data_types.cpp \
 ./service_a.c \
--I../3thrd/include -L../3thrd/lib/
\ No newline at end of file
+-I../3thrd/include -L../3thrd/lib/
+
+# 基准测试的回环 Socket 服务端 (bench.php 的 socket 模式)
+g++ -std=c++11 -O2 -o ./bench_server \
+./gen-cpp/DynamicServiceA.cpp \
+./gen-cpp/data_types.cpp \
+./bench_server.cc \
+-I../3thrd/include -L../3thrd/lib -lthrift
@@ -11,6 +11,16 @@ struct OutputData {
     2: required string message;
 }
 
+// 基准测试用：条目数决定请求大小 (从几十字节到数 MB)
+struct BatchData {
+    1: required list<InputData> items;
+    // 以下两个字段供 test.php 检查 ThriftBridgeClient 的容器编解码，基准测试不设置
+    2: optional map<string, double> totals;
+    3: optional list<i32> tags;
+}
+
 service DynamicServiceA {
     OutputData process_transaction_a(1: InputData input);
+    // 原样返回，请求与响应大小相同 (见 bench.php)
+    BatchData echo_batch(1: BatchData batch);
 }
\ No newline at end of file
@@ -6,36 +6,140 @@
 
 // Thrift 真实头文件
 #include <thrift/TProcessor.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
 
 #include "../plugin_api.h"
-#include "./gen-cpp/DynamicServiceA.h" // 假设已由 Thrift 编译生成
+#include "./service_a_handler.h"
 
 using namespace Dynamic;
 using namespace apache::thrift;
 using namespace std;
 
-// --- A. 业务 Handler 实现 ---
-class DynamicServiceAHandler : public DynamicServiceAIf {
-public:
-    void process_transaction_a(OutputData& _return, const InputData& input) override {
-        if (input.amount > 100.0) {
-            _return.result_flag = 0; 
-            _return.message = "ServiceA: Transaction denied.";
-        } else {
-            _return.result_flag = 1; 
-            _return.message = "ServiceA: ID " + to_string(input.transaction_id) + " processed.";
-        }
-    }
+// --- B. IDL 类型描述 (供 ThriftBridgeClient 在 C 层编解码) ---
+static const ThriftBridgeFieldSpec input_data_fields[] = {
+    {1, "transaction_id", {THRIFT_BRIDGE_T_I16, NULL, NULL, NULL}, 1},
+    {2, "amount", {THRIFT_BRIDGE_T_DOUBLE, NULL, NULL, NULL}, 1},
+};
+static const ThriftBridgeStructSpec input_data_spec = {"InputData", input_data_fields, 2};
+
+static const ThriftBridgeFieldSpec output_data_fields[] = {
+    {1, "result_flag", {THRIFT_BRIDGE_T_I32, NULL, NULL, NULL}, 1},
+    {2, "message", {THRIFT_BRIDGE_T_STRING, NULL, NULL, NULL}, 1},
+};
+static const ThriftBridgeStructSpec output_data_spec = {"OutputData", output_data_fields, 2};
+
+static const ThriftBridgeFieldSpec process_transaction_a_args_fields[] = {
+    {1, "input", {THRIFT_BRIDGE_T_STRUCT, &input_data_spec, NULL, NULL}, 0},
+};
+static const ThriftBridgeStructSpec process_transaction_a_args_spec = {
+    "DynamicServiceA_process_transaction_a_args", process_transaction_a_args_fields, 1};
+
+static const ThriftBridgeFieldSpec process_transaction_a_result_fields[] = {
+    {0, "success", {THRIFT_BRIDGE_T_STRUCT, &output_data_spec, NULL, NULL}, 0},
+};
+static const ThriftBridgeStructSpec process_transaction_a_result_spec = {
+    "DynamicServiceA_process_transaction_a_result", process_transaction_a_result_fields, 1};
+
+static const ThriftBridgeTypeSpec input_data_type = {THRIFT_BRIDGE_T_STRUCT, &input_data_spec, NULL, NULL};
+static const ThriftBridgeTypeSpec string_type = {THRIFT_BRIDGE_T_STRING, NULL, NULL, NULL};
+static const ThriftBridgeTypeSpec double_type = {THRIFT_BRIDGE_T_DOUBLE, NULL, NULL, NULL};
+static const ThriftBridgeTypeSpec i32_type = {THRIFT_BRIDGE_T_I32, NULL, NULL, NULL};
+static const ThriftBridgeFieldSpec batch_data_fields[] = {
+    {1, "items", {THRIFT_BRIDGE_T_LIST, NULL, NULL, &input_data_type}, 1},
+    {2, "totals", {THRIFT_BRIDGE_T_MAP, NULL, &string_type, &double_type}, 0},
+    {3, "tags", {THRIFT_BRIDGE_T_LIST, NULL, NULL, &i32_type}, 0},
+};
+static const ThriftBridgeStructSpec batch_data_spec = {"BatchData", batch_data_fields, 3};
+
+static const ThriftBridgeFieldSpec echo_batch_args_fields[] = {
+    {1, "batch", {THRIFT_BRIDGE_T_STRUCT, &batch_data_spec, NULL, NULL}, 0},
+};
+static const ThriftBridgeStructSpec echo_batch_args_spec = {
+    "DynamicServiceA_echo_batch_args", echo_batch_args_fields, 1};
+
+static const ThriftBridgeFieldSpec echo_batch_result_fields[] = {
+    {0, "success", {THRIFT_BRIDGE_T_STRUCT, &batch_data_spec, NULL, NULL}, 0},
+};
+static const ThriftBridgeStructSpec echo_batch_result_spec = {
+    "DynamicServiceA_echo_batch_result", echo_batch_result_fields, 1};
+
+static const ThriftBridgeMethodSpec service_a_methods[] = {
+    {"process_transaction_a", &process_transaction_a_args_spec, &process_transaction_a_result_spec},
+    {"echo_batch", &echo_batch_args_spec, &echo_batch_result_spec},
+};
+static const ThriftBridgeServiceSpec service_a_spec = {"DynamicServiceA", service_a_methods, 2};
+
+// 测试用：同一个处理器另以 DynamicServiceAMismatch 注册，其描述把 echo_batch 响应中的
+// BatchData.tags 声明成 list<i64> (实际是 list<i32>)，test.php 用它检查 ThriftBridgeClient
+// 拒绝元素类型与描述不符的容器
+static const ThriftBridgeTypeSpec i64_type = {THRIFT_BRIDGE_T_I64, NULL, NULL, NULL};
+static const ThriftBridgeFieldSpec mismatch_batch_data_fields[] = {
+    {1, "items", {THRIFT_BRIDGE_T_LIST, NULL, NULL, &input_data_type}, 1},
+    {2, "totals", {THRIFT_BRIDGE_T_MAP, NULL, &string_type, &double_type}, 0},
+    {3, "tags", {THRIFT_BRIDGE_T_LIST, NULL, NULL, &i64_type}, 0},
+};
+static const ThriftBridgeStructSpec mismatch_batch_data_spec = {"BatchData", mismatch_batch_data_fields, 3};
+
+static const ThriftBridgeFieldSpec mismatch_echo_batch_result_fields[] = {
+    {0, "success", {THRIFT_BRIDGE_T_STRUCT, &mismatch_batch_data_spec, NULL, NULL}, 0},
+};
+static const ThriftBridgeStructSpec mismatch_echo_batch_result_spec = {
+    "DynamicServiceA_echo_batch_result", mismatch_echo_batch_result_fields, 1};
+
+static const ThriftBridgeMethodSpec mismatch_methods[] = {
+    {"echo_batch", &echo_batch_args_spec, &mismatch_echo_batch_result_spec},
 };
+static const ThriftBridgeServiceSpec mismatch_spec = {"DynamicServiceAMismatch", mismatch_methods, 1};
 
-// --- B. 插件注册入口点实现 ---
+static void register_mismatch_service(ProcessorFactoryContext* context, int api_version,
+                                      const shared_ptr<DynamicServiceAHandler>& handler) {
+    if (api_version >= 3) {
+        context->register_func_ptr(context->factory_instance, "DynamicServiceAMismatch",
+                                   (void*)new DynamicServiceAProcessor(handler));
+        context->register_spec_ptr(context->factory_instance, &mismatch_spec);
+    }
+}
+
+// echo_batch 原样返回参数，是参数的纯函数：打开 thrift_bridge.cache_size 时可以缓存 (API 版本 4 起)
+static void register_method_options(ProcessorFactoryContext* context, int api_version) {
+    if (api_version >= 4) {
+        context->register_method_flags_ptr(context->factory_instance, "DynamicServiceA", "echo_batch",
+                                           THRIFT_BRIDGE_METHOD_CACHEABLE, 5000);
+    }
+}
+
+// --- C. 插件注册入口点实现 ---
 extern "C" {
     void register_thrift_processors(ProcessorFactoryContext* context) {
         cout << "  [ServiceA Plugin] Initializing DynamicServiceA..." << endl;
         
         shared_ptr<DynamicServiceAHandler> handlerA(new DynamicServiceAHandler());
+        // 旧宿主的上下文没有 api_version 字段
+        int api_version = thrift_bridge_context_api_version(context);
+#ifdef THRIFT_BRIDGE_TEMPLATES
+        // 需要 thrift --gen cpp:templates 生成的代码，协议类型与核心库保持一致
+        TProcessor* processorA = new DynamicServiceAProcessorT<
+            protocol::TBinaryProtocolT<transport::TMemoryBuffer> >(handlerA);
+
+        if (api_version >= 2) {
+            context->register_func_ex_ptr(
+                context->factory_instance,
+                "DynamicServiceA",
+                (void*)processorA,
+                THRIFT_BRIDGE_PROCESSOR_BINARY_MEMBUF
+            );
+            if (api_version >= 3) {
+                context->register_spec_ptr(context->factory_instance, &service_a_spec);
+            }
+            register_method_options(context, api_version);
+            register_mismatch_service(context, api_version, handlerA);
+            return;
+        }
+#else
         // TProcessor* 裸指针
         TProcessor* processorA = new DynamicServiceAProcessor(handlerA); 
+#endif
 
         // 注册到核心库的工厂中
         context->register_func_ptr(
@@ -43,5 +147,12 @@ extern "C" {
             "DynamicServiceA", 
             (void*)processorA
         );
+
+        // 导出 IDL 描述，PHP 端即可用 ThriftBridgeClient 直接调用
+        if (api_version >= 3) {
+            context->register_spec_ptr(context->factory_instance, &service_a_spec);
+        }
+        register_method_options(context, api_version);
+        register_mismatch_service(context, api_version, handlerA);
     }
 }
\ No newline at end of file
@@ -0,0 +1,33 @@
+// test/service_a_handler.h
+// DynamicServiceA 的业务实现，插件 (service_a.c) 与基准测试的 Socket 服务端 (bench_server.cc) 共用
+#ifndef SERVICE_A_HANDLER_H
+#define SERVICE_A_HANDLER_H
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "./gen-cpp/DynamicServiceA.h" // 假设已由 Thrift 编译生成
+
+class DynamicServiceAHandler : public Dynamic::DynamicServiceAIf {
+public:
+    void process_transaction_a(Dynamic::OutputData& _return, const Dynamic::InputData& input) override {
+        // 测试用：transaction_id 为负数时先休眠 -transaction_id 毫秒，让调用在热更新期间保持进行中
+        if (input.transaction_id < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(-input.transaction_id));
+        }
+        if (input.amount > 100.0) {
+            _return.result_flag = 0; 
+            _return.message = "ServiceA: Transaction denied.";
+        } else {
+            _return.result_flag = 1; 
+            _return.message = "ServiceA: ID " + std::to_string(input.transaction_id) + " processed.";
+        }
+    }
+
+    void echo_batch(Dynamic::BatchData& _return, const Dynamic::BatchData& batch) override {
+        _return = batch;
+    }
+};
+
+#endif // SERVICE_A_HANDLER_H
@@ -1,5 +1,18 @@
 <?php
 // test.php
+//
+// 用法: php -c php.ini test.php
+// 默认关闭的功能用 -d 打开后再跑一遍，对应的检查才会执行：
+//   php -c php.ini -d thrift_bridge.profile=1 test.php
+//   php -c php.ini -d thrift_bridge.slow_log=/tmp/thrift_bridge.test.log -d thrift_bridge.slow_log_threshold=0 test.php
+//   php -c php.ini -d thrift_bridge.coalesce=DynamicServiceA.process_transaction_a test.php
+//   php -c php.ini -d thrift_bridge.cache_size=1M test.php
+//   php -c php.ini -d thrift_bridge.memoize=DynamicServiceA.process_transaction_a test.php
+// 旁车模式:
+//   ../build/thrift_bridge_sidecar ./plugins /tmp/thrift_bridge.sock &
+//   php -c php.ini -d thrift_bridge.sidecar=/tmp/thrift_bridge.sock test.php
+//   php -c php.ini -d thrift_bridge.sidecar=/tmp/thrift_bridge.sock -d thrift_bridge.sidecar_ring=65536 test.php
+// 只在进程内加载插件时可用的检查在旁车模式 (thrift_bridge.sidecar) 下跳过。
 
 /**
  * 确保 PHP 能够找到 Thrift 运行时库和我们生成的类。
@@ -12,13 +25,76 @@ require_once __DIR__ . '/vendor/autoload.php';
 
 // --- 引入 Thrift 核心组件和生成的类 ---
 use \Thrift\Protocol\TBinaryProtocolAccelerated;
+use \Thrift\Protocol\TBinaryProtocol;
+use \Thrift\Protocol\TCompactProtocol;
+use \Thrift\Transport\TMemoryBuffer;
+use \Thrift\Type\TMessageType;
 use DynamicExt\InputData;
+use DynamicExt\DynamicServiceA_process_transaction_a_args;
+use DynamicExt\DynamicServiceA_process_transaction_a_result;
+use DynamicExt\BatchData;
+use DynamicExt\DynamicServiceA_echo_batch_args;
+use DynamicExt\DynamicServiceA_echo_batch_result;
 
 // 确保我们的 PHP 扩展已加载
 if (!extension_loaded('thrift_bridge')) {
     die("Error: PHP extension 'thrift_bridge' is not loaded. Please check your php.ini.\n");
 }
 
+$sidecar = ini_get('thrift_bridge.sidecar') !== '';
+
+// 每个检查输出一行 "名称: OK/FAIL"，有失败时以 1 退出
+$failures = 0;
+function check($label, $ok) {
+    global $failures;
+    echo $label . ": " . ($ok ? 'OK' : 'FAIL') . "\n";
+    if (!$ok) {
+        $failures++;
+    }
+}
+
+// 按生成代码的方式编码一条调用，seqid 由调用方指定，用来核对响应中的 seqid
+function encode_call($method, $args, $seqid, $type = TMessageType::CALL, $protocolClass = TBinaryProtocol::class) {
+    $buffer = new TMemoryBuffer();
+    $protocol = new $protocolClass($buffer);
+    $protocol->writeMessageBegin($method, $type, $seqid);
+    $args->write($protocol);
+    $protocol->writeMessageEnd();
+    return $buffer->getBuffer();
+}
+
+// 解码响应，返回 [seqid, success]
+function decode_reply($bytes, $resultClass, $protocolClass = TBinaryProtocol::class) {
+    $protocol = new $protocolClass(new TMemoryBuffer($bytes));
+    $name = $type = $seqid = null;
+    $protocol->readMessageBegin($name, $type, $seqid);
+    $result = new $resultClass();
+    $result->read($protocol);
+    $protocol->readMessageEnd();
+    return [$seqid, $result->success];
+}
+
+function transaction_call($id, $amount, $seqid, $protocolClass = TBinaryProtocol::class) {
+    $args = new DynamicServiceA_process_transaction_a_args([
+        'input' => new InputData(['transaction_id' => $id, 'amount' => $amount]),
+    ]);
+    return encode_call('process_transaction_a', $args, $seqid, TMessageType::CALL, $protocolClass);
+}
+
+// 把消息装进 THeader 帧：长度、魔数 0x0FFF、flags、seqid、头部长度 (以 4 字节计)，
+// 头部只有协议号 0 (binary) 与变换数 0，补齐到 4 字节
+function header_frame($message) {
+    $header = "\x00\x00\x00\x00";
+    return pack('NnnNn', 10 + strlen($header) + strlen($message), 0x0FFF, 0, 0, strlen($header) / 4)
+        . $header . $message;
+}
+
+// 取出 THeader 帧中的消息，不是 THeader 帧时返回空字符串
+function header_message($frame) {
+    $fields = unpack('Nlength/nmagic/nflags/Nseqid/nwords', $frame);
+    return $fields['magic'] === 0x0FFF ? substr($frame, 14 + $fields['words'] * 4) : '';
+}
+
 // ----------------------------------------------------
 // --- 实际测试：与标准 Thrift 调用一致 ---
 // ----------------------------------------------------
@@ -49,4 +125,404 @@ try {
 } catch (\Exception $e) {
     echo "An exception occurred during RPC: " . $e->getMessage() . "\n";
     // 捕获 TTransportException 或其他 Thrift/PHP 异常
-}
\ No newline at end of file
+    $failures++;
+}
+
+// TEST 3: 原生客户端按插件导出的 IDL 描述在 C 层编解码：嵌套结构体、list、map 原样往返，
+// 缺少必填字段、容器元素类型与描述不符、调用描述中没有的方法都抛出异常
+if (!$sidecar) {
+    $native = new ThriftBridgeClient('DynamicServiceA');
+    $batch = [
+        'items' => [['transaction_id' => 151, 'amount' => 1.5], ['transaction_id' => 152, 'amount' => 2.5]],
+        'totals' => ['min' => 1.5, 'max' => 2.5],
+        'tags' => [7, 8, 9],
+    ];
+    check("client round trip", $native->echo_batch($batch) == $batch);
+    $output = $native->process_transaction_a(new InputData(['transaction_id' => 153, 'amount' => 10.00]));
+    check("client object argument", $output == ['result_flag' => 1, 'message' => 'ServiceA: ID 153 processed.']);
+    try {
+        $native->process_transaction_a(['transaction_id' => 154]);
+        check("client missing required field", false);
+    } catch (\Exception $e) {
+        check("client missing required field", strpos($e->getMessage(), 'InputData.amount') !== false);
+    }
+    // DynamicServiceAMismatch 的描述把响应中的 tags 声明为 list<i64>，实际收到 list<i32>
+    $mismatch = new ThriftBridgeClient('DynamicServiceAMismatch');
+    check("client empty container", $mismatch->echo_batch(['items' => [], 'tags' => []]) == ['items' => [], 'tags' => []]);
+    try {
+        $mismatch->echo_batch(['items' => [], 'tags' => [1]]);
+        check("client container type mismatch", false);
+    } catch (\Exception $e) {
+        check("client container type mismatch", strpos($e->getMessage(), 'does not match the spec') !== false);
+    }
+    try {
+        $native->no_such_method();
+        check("client undeclared method", false);
+    } catch (ThriftBridgeException $e) {
+        check("client undeclared method", $e->data === null);
+    } catch (\Exception $e) {
+        check("client undeclared method", false);
+    }
+    $output = $native->process_transaction_a(['transaction_id' => 155, 'amount' => 10.00]);
+    check("client after errors", $output['message'] === 'ServiceA: ID 155 processed.');
+
+    echo "\n----------------------------------------------------\n";
+}
+
+// TEST 4: 批量调用，结果与输入的键、各自的 seqid 一一对应，单项失败不影响其他项
+if (!$sidecar) {
+    $results = thrift_bridge_multi_call([
+        'a' => ['DynamicServiceA', transaction_call(201, 10.00, 11)],
+        'b' => ['DynamicServiceA', transaction_call(202, 500.00, 12)],
+        'c' => ['NoSuchService', transaction_call(203, 10.00, 13)],
+    ]);
+    check("multi_call keys", array_keys($results) === ['a', 'b', 'c']);
+    list($seqid, $output) = decode_reply($results['a']['response'], DynamicServiceA_process_transaction_a_result::class);
+    check("multi_call a", $results['a']['ok'] && $seqid === 11 && $output->message === 'ServiceA: ID 201 processed.');
+    list($seqid, $output) = decode_reply($results['b']['response'], DynamicServiceA_process_transaction_a_result::class);
+    check("multi_call b", $results['b']['ok'] && $seqid === 12 && $output->result_flag === 0);
+    check("multi_call unknown service", !$results['c']['ok'] && $results['c']['error'] !== '');
+
+    echo "\n----------------------------------------------------\n";
+}
+
+// TEST 5: 异步调用，future 取回的响应带各自的 seqid；waitAny/waitAll 与超时参数
+if (!$sidecar) {
+    $transports = [];
+    $futures = [];
+    for ($i = 0; $i < 3; $i++) {
+        $transport = new ThriftBridgeTransport('DynamicServiceA');
+        $transport->write(transaction_call(300 + $i, 10.00, 40 + $i));
+        $futures[$i] = $transport->flushAsync();
+        $transports[$i] = $transport;
+    }
+    $first = ThriftBridgeFuture::waitAny($futures, 5.0);
+    check("async waitAny", $first !== null && isset($futures[$first]));
+    ThriftBridgeFuture::waitAll($futures, 5.0);
+    $ok = true;
+    foreach ($futures as $i => $future) {
+        $done = $future->isDone();
+        list($seqid, $output) = decode_reply($future->wait(1.0), DynamicServiceA_process_transaction_a_result::class);
+        $ok = $ok && $done && $seqid === 40 + $i && $output->message === 'ServiceA: ID ' . (300 + $i) . ' processed.';
+    }
+    check("async futures", $ok);
+
+    // 生成的 Client 拆成 send_xxx/recv_xxx，recv 时自动等待
+    $transport = new ThriftBridgeTransport('DynamicServiceA');
+    $transport->setAsync(true);
+    $async_client = new DynamicExt\DynamicServiceAClient(new TBinaryProtocolAccelerated($transport));
+    $async_client->send_process_transaction_a(new InputData(['transaction_id' => 304, 'amount' => 10.00]));
+    check("async getFuture", $transport->getFuture() instanceof ThriftBridgeFuture);
+    $output = $async_client->recv_process_transaction_a();
+    check("async send/recv", $output->message === 'ServiceA: ID 304 processed.');
+
+    echo "\n----------------------------------------------------\n";
+}
+
+// TEST 6: 按服务选择处理器协议 (thrift_bridge.protocol 可在运行时修改)。compact 与 THeader 帧编码的调用
+// 分别在 "DynamicServiceA=compact"、"DynamicServiceA=header" 与 "auto" 下执行，响应按同一协议解码
+$protocol_setting = ini_get('thrift_bridge.protocol');
+$result_class = DynamicServiceA_process_transaction_a_result::class;
+ini_set('thrift_bridge.protocol', 'binary, DynamicServiceA=compact');
+list($seqid, $output) = decode_reply(thrift_bridge_call_raw('DynamicServiceA', transaction_call(351, 10.00, 81, TCompactProtocol::class)),
+                                     $result_class, TCompactProtocol::class);
+check("protocol compact", $seqid === 81 && $output->message === 'ServiceA: ID 351 processed.');
+$compact_client = new DynamicExt\DynamicServiceAClient(new TCompactProtocol(new ThriftBridgeTransport('DynamicServiceA')));
+$output = $compact_client->process_transaction_a(new InputData(['transaction_id' => 352, 'amount' => 10.00]));
+check("protocol compact transport", $output->message === 'ServiceA: ID 352 processed.');
+
+ini_set('thrift_bridge.protocol', 'auto');
+list($seqid, $output) = decode_reply(thrift_bridge_call_raw('DynamicServiceA', transaction_call(353, 10.00, 82)), $result_class);
+check("protocol auto binary", $seqid === 82 && $output->message === 'ServiceA: ID 353 processed.');
+list($seqid, $output) = decode_reply(thrift_bridge_call_raw('DynamicServiceA', transaction_call(354, 10.00, 83, TCompactProtocol::class)),
+                                     $result_class, TCompactProtocol::class);
+check("protocol auto compact", $seqid === 83 && $output->message === 'ServiceA: ID 354 processed.');
+
+// 旁车模式只支持 binary 和 compact
+if (!$sidecar) {
+    list($seqid, $output) = decode_reply(header_message(thrift_bridge_call_raw('DynamicServiceA', header_frame(transaction_call(355, 10.00, 84)))),
+                                         $result_class);
+    check("protocol auto header", $seqid === 84 && $output->message === 'ServiceA: ID 355 processed.');
+    ini_set('thrift_bridge.protocol', 'binary, DynamicServiceA=header');
+    list($seqid, $output) = decode_reply(header_message(thrift_bridge_call_raw('DynamicServiceA', header_frame(transaction_call(356, 10.00, 85)))),
+                                         $result_class);
+    check("protocol header", $seqid === 85 && $output->message === 'ServiceA: ID 356 processed.');
+}
+ini_set('thrift_bridge.protocol', $protocol_setting);
+
+echo "\n----------------------------------------------------\n";
+
+// TEST 7: 调用统计按服务和方法计数，延迟给出分位数
+if (!$sidecar && ini_get('thrift_bridge.stats')) {
+    $method_calls = function () {
+        $stats = thrift_bridge_stats();
+        return $stats['DynamicServiceA']['methods']['process_transaction_a']['calls'] ?? 0;
+    };
+    $before = $method_calls();
+    $client->process_transaction_a(new InputData(['transaction_id' => 400, 'amount' => 10.00]));
+    $client->process_transaction_a(new InputData(['transaction_id' => 401, 'amount' => 10.00]));
+    check("stats method calls", $method_calls() - $before === 2);
+    $stats = thrift_bridge_stats();
+    $service = $stats['DynamicServiceA'] ?? [];
+    check("stats service", ($service['calls'] ?? 0) >= 2 && ($service['request_bytes'] ?? 0) > 0
+        && isset($service['latency_ns']['p50'], $service['latency_ns']['p99'], $service['latency_ns']['max']));
+    check("stats all workers", isset(thrift_bridge_stats(true)['DynamicServiceA']));
+    check("stats prometheus", strpos(thrift_bridge_metrics_prometheus(), 'thrift_bridge_calls_total{service="DynamicServiceA"') !== false);
+
+    echo "\n----------------------------------------------------\n";
+}
+
+// TEST 8: 分阶段耗时 (thrift_bridge.profile = 1 时记录，否则为 NULL)
+if (!$sidecar) {
+    $client->process_transaction_a(new InputData(['transaction_id' => 500, 'amount' => 10.00]));
+    $profile = thrift_bridge_last_call_profile();
+    if (ini_get('thrift_bridge.profile')) {
+        $phases = ['php_encode', 'dispatch', 'decode', 'handler', 'encode', 'copy', 'php_decode'];
+        check("profile call", $profile !== null && $profile['service'] === 'DynamicServiceA'
+            && $profile['method'] === 'process_transaction_a' && $profile['total_ns'] > 0);
+        check("profile phases", $profile !== null && array_keys($profile['phases_ns']) === $phases
+            && array_sum($profile['phases_ns']) === $profile['total_ns']);
+    } else {
+        check("profile disabled", $profile === null);
+    }
+
+    echo "\n----------------------------------------------------\n";
+}
+
+// TEST 9: 慢调用日志由后台线程写出 (需要 thrift_bridge.slow_log，阈值为 0 时记录所有调用)
+$slow_log = ini_get('thrift_bridge.slow_log');
+if (!$sidecar && $slow_log !== '' && (float)ini_get('thrift_bridge.slow_log_threshold') == 0) {
+    // transaction_id 601 在请求中编码为 i16 字段 06 0001 0259
+    $client->process_transaction_a(new InputData(['transaction_id' => 601, 'amount' => 10.00]));
+    $found = false;
+    for ($i = 0; $i < 20 && !$found; $i++) {
+        usleep(100000);
+        clearstatcache();
+        foreach (@file($slow_log) ?: [] as $line) {
+            if (strpos($line, 'pid=' . getmypid() . ' ') !== false && strpos($line, '0600010259') !== false) {
+                $found = strpos($line, 'method=process_transaction_a ') !== false && strpos($line, 'status=ok ') !== false;
+                break;
+            }
+        }
+    }
+    check("slow log record", $found);
+
+    echo "\n----------------------------------------------------\n";
+}
+
+// TEST 10: 插件热更新。先 mv 一个副本覆盖插件 (新 inode)，再原地改写 (inode 不变)：
+// 两次都切换到新版本，已有的 transport 继续可用，热更新前解码出的数组 (键为旧版本编译的字段名) 不受影响
+$plugin = rtrim(ini_get('thrift_bridge.plugin_dir'), '/') . '/libservice_a.so';
+if (!$sidecar && is_writable($plugin) && is_writable(dirname($plugin))) {
+    $native = new ThriftBridgeClient('DynamicServiceA');
+    $decoded = $native->process_transaction_a(['transaction_id' => 700, 'amount' => 10.00]);
+    check("reload unchanged", thrift_bridge_reload() === []);
+
+    $staged = dirname($plugin) . '/.libservice_a.so.test';
+    copy($plugin, $staged);
+    rename($staged, $plugin);
+    check("reload renamed", thrift_bridge_reload() === [$plugin => 'reloaded']);
+    $output = $client->process_transaction_a(new InputData(['transaction_id' => 701, 'amount' => 10.00]));
+    check("reload existing transport", $output->message === 'ServiceA: ID 701 processed.');
+
+    file_put_contents($plugin, file_get_contents($plugin));
+    check("reload rewritten in place", thrift_bridge_reload() === [$plugin => 'reloaded']);
+    $after = $native->process_transaction_a(['transaction_id' => 702, 'amount' => 10.00]);
+    check("reload native client", $after['message'] === 'ServiceA: ID 702 processed.');
+    check("reload earlier arrays", array_keys($decoded) === array_keys($after)
+        && $decoded['message'] === 'ServiceA: ID 700 processed.' && $decoded['result_flag'] === 1);
+
+    echo "\n----------------------------------------------------\n";
+}
+
+// TEST 11: 异步调用进行中热更新：进行中的调用用开始时的版本完成，旧版本等它们都结束后才卸载
+// (热更新加载的版本经描述符打开，卸载时关闭，文件被替换后描述符指向 "(deleted)")；
+// 热更新之前创建的 transport 之后调用的是新版本
+if (!$sidecar && is_writable($plugin) && is_writable(dirname($plugin))) {
+    $retired_versions = function () {
+        $count = 0;
+        foreach (scandir('/proc/self/fd') as $fd) {
+            $link = @readlink('/proc/self/fd/' . $fd);
+            if ($link !== false && substr($link, -strlen('/libservice_a.so (deleted)')) === '/libservice_a.so (deleted)') {
+                $count++;
+            }
+        }
+        return $count;
+    };
+    $staged = dirname($plugin) . '/.libservice_a.so.test';
+    copy($plugin, $staged);
+    rename($staged, $plugin);
+    thrift_bridge_reload();
+    $early_client = new DynamicExt\DynamicServiceAClient(new TBinaryProtocol(new ThriftBridgeTransport('DynamicServiceA')));
+
+    $transports = [];
+    $futures = [];
+    for ($i = 0; $i < 4; $i++) {
+        $transport = new ThriftBridgeTransport('DynamicServiceA');
+        // 处理器休眠 300ms
+        $transport->write(transaction_call(-300, 10.00, 90 + $i));
+        $futures[$i] = $transport->flushAsync();
+        $transports[$i] = $transport;
+    }
+    usleep(50000);
+    copy($plugin, $staged);
+    rename($staged, $plugin);
+    check("reload during async calls", thrift_bridge_reload() === [$plugin => 'reloaded']);
+    check("reload keeps the running version", $retired_versions() === 1);
+    ThriftBridgeFuture::waitAll($futures, 5.0);
+    $ok = true;
+    foreach ($futures as $i => $future) {
+        list($seqid, $output) = decode_reply($future->wait(), DynamicServiceA_process_transaction_a_result::class);
+        $ok = $ok && $seqid === 90 + $i && $output->message === 'ServiceA: ID -300 processed.';
+    }
+    check("reload async futures", $ok);
+    // 宽限期在下一次热更新 (或下一个请求的 RINIT) 时再检查
+    check("reload drained", thrift_bridge_reload() === [] && $retired_versions() === 0);
+    $output = $early_client->process_transaction_a(new InputData(['transaction_id' => 901, 'amount' => 10.00]));
+    check("reload earlier transport", $output->message === 'ServiceA: ID 901 processed.');
+
+    echo "\n----------------------------------------------------\n";
+}
+
+// TEST 12: 相同调用合并 (thrift_bridge.coalesce 含 DynamicServiceA.process_transaction_a)。
+// 同时发出参数相同、seqid 不同的异步调用，被合并的调用拿到的响应必须换成各自的 seqid
+if (!$sidecar && preg_match('/DynamicServiceA\.(process_transaction_a|\*)/', ini_get('thrift_bridge.coalesce'))) {
+    $stats = thrift_bridge_stats();
+    $before = $stats['DynamicServiceA']['methods']['process_transaction_a'] ?? [];
+    $transports = [];
+    $futures = [];
+    for ($i = 0; $i < 8; $i++) {
+        $transport = new ThriftBridgeTransport('DynamicServiceA');
+        $transport->write(transaction_call(800, 10.00, 1000 + $i));
+        $futures[$i] = $transport->flushAsync();
+        $transports[$i] = $transport;
+    }
+    ThriftBridgeFuture::waitAll($futures, 5.0);
+    $ok = true;
+    foreach ($futures as $i => $future) {
+        list($seqid, $output) = decode_reply($future->wait(), DynamicServiceA_process_transaction_a_result::class);
+        $ok = $ok && $seqid === 1000 + $i && $output->message === 'ServiceA: ID 800 processed.';
+    }
+    check("coalesce seqids", $ok);
+    if (ini_get('thrift_bridge.stats')) {
+        $stats = thrift_bridge_stats();
+        $after = $stats['DynamicServiceA']['methods']['process_transaction_a'];
+        check("coalesce stats", $after['calls'] - ($before['calls'] ?? 0) === 8);
+        echo "Coalesced: " . (($after['coalesced'] ?? 0) - ($before['coalesced'] ?? 0)) . " of 8\n";
+    }
+
+    echo "\n----------------------------------------------------\n";
+}
+
+// TEST 13: 共享响应缓存 (thrift_bridge.cache_size > 0；service_a.c 把 echo_batch 声明为可缓存)。
+// 第二次调用命中缓存，响应中的 seqid 必须换成本次的
+if (!$sidecar && (int)ini_get('thrift_bridge.cache_size') > 0) {
+    $batch = new BatchData(['items' => [
+        new InputData(['transaction_id' => 900 + getmypid() % 1000, 'amount' => 1.50]),
+        new InputData(['transaction_id' => 901, 'amount' => 2.50]),
+    ]]);
+    $args = new DynamicServiceA_echo_batch_args(['batch' => $batch]);
+    $stats = thrift_bridge_stats();
+    $before = $stats['DynamicServiceA']['methods']['echo_batch']['cached'] ?? 0;
+    list($seqid_first, $first) = decode_reply(thrift_bridge_call_raw('DynamicServiceA', encode_call('echo_batch', $args, 21)),
+                                              DynamicServiceA_echo_batch_result::class);
+    list($seqid_second, $second) = decode_reply(thrift_bridge_call_raw('DynamicServiceA', encode_call('echo_batch', $args, 22)),
+                                                DynamicServiceA_echo_batch_result::class);
+    check("cache seqids", $seqid_first === 21 && $seqid_second === 22);
+    check("cache response", $first == $batch && $second == $batch);
+    if (ini_get('thrift_bridge.stats')) {
+        $stats = thrift_bridge_stats();
+        check("cache hit", ($stats['DynamicServiceA']['methods']['echo_batch']['cached'] ?? 0) - $before === 1);
+    }
+
+    echo "\n----------------------------------------------------\n";
+}
+
+// TEST 14: 请求内记忆 (thrift_bridge.memoize 含 DynamicServiceA.process_transaction_a)。
+// 相同参数的后续调用不进入核心库 (不计入统计)，返回的响应换成各自的 seqid
+if (!$sidecar && preg_match('/DynamicServiceA\.(process_transaction_a|\*)/', ini_get('thrift_bridge.memoize'))) {
+    $stats = thrift_bridge_stats();
+    $before = $stats['DynamicServiceA']['methods']['process_transaction_a']['calls'] ?? 0;
+    list($seqid_first, $first) = decode_reply(thrift_bridge_call_raw('DynamicServiceA', transaction_call(1100, 10.00, 31)),
+                                              DynamicServiceA_process_transaction_a_result::class);
+    list($seqid_second, $second) = decode_reply(thrift_bridge_call_raw('DynamicServiceA', transaction_call(1100, 10.00, 32)),
+                                                DynamicServiceA_process_transaction_a_result::class);
+    $results = thrift_bridge_multi_call([['DynamicServiceA', transaction_call(1100, 10.00, 33)]]);
+    list($seqid_third, $third) = decode_reply($results[0]['response'], DynamicServiceA_process_transaction_a_result::class);
+    check("memoize seqids", $seqid_first === 31 && $seqid_second === 32 && $seqid_third === 33);
+    check("memoize response", $first == $second && $second == $third && $first->message === 'ServiceA: ID 1100 processed.');
+    if (ini_get('thrift_bridge.stats')) {
+        $stats = thrift_bridge_stats();
+        check("memoize stats", $stats['DynamicServiceA']['methods']['process_transaction_a']['calls'] - $before === 1);
+    }
+
+    echo "\n----------------------------------------------------\n";
+}
+
+// TEST 15: 旁车模式 (thrift_bridge.sidecar 指向运行中的 thrift_bridge_sidecar)
+if ($sidecar) {
+    list($seqid, $output) = decode_reply(thrift_bridge_call_raw('DynamicServiceA', transaction_call(1200, 10.00, 51)),
+                                         DynamicServiceA_process_transaction_a_result::class);
+    check("sidecar call_raw", $seqid === 51 && $output->message === 'ServiceA: ID 1200 processed.');
+    try {
+        thrift_bridge_call_raw('NoSuchService', transaction_call(1201, 10.00, 52));
+        check("sidecar unknown service", false);
+    } catch (\Exception $e) {
+        check("sidecar unknown service", true);
+    }
+    // 失败的调用之后连接 (或通道) 仍然可用
+    $output = $client->process_transaction_a(new InputData(['transaction_id' => 1202, 'amount' => 10.00]));
+    check("sidecar after failure", $output->message === 'ServiceA: ID 1202 processed.');
+    try {
+        $transport = new ThriftBridgeTransport('DynamicServiceA');
+        $transport->write(transaction_call(1203, 10.00, 53));
+        $transport->flushAsync();
+        check("sidecar rejects async", false);
+    } catch (\Exception $e) {
+        check("sidecar rejects async", true);
+    }
+    // 批量调用逐项交给守护进程；原生客户端拿不到 IDL 描述，明确报错
+    $results = thrift_bridge_multi_call([
+        'a' => ['DynamicServiceA', transaction_call(1204, 10.00, 54)],
+        'b' => ['NoSuchService', transaction_call(1205, 10.00, 55)],
+    ]);
+    list($seqid, $output) = decode_reply((string)$results['a']['response'], DynamicServiceA_process_transaction_a_result::class);
+    check("sidecar multi_call", $results['a']['ok'] && $seqid === 54 && $output->message === 'ServiceA: ID 1204 processed.'
+        && !$results['b']['ok']);
+    try {
+        new ThriftBridgeClient('DynamicServiceA');
+        check("sidecar rejects native client", false);
+    } catch (\Exception $e) {
+        check("sidecar rejects native client", strpos($e->getMessage(), 'sidecar mode') !== false);
+    }
+
+    echo "\n----------------------------------------------------\n";
+}
+
+// TEST 16: 共享内存环 (thrift_bridge.sidecar_ring > 0)
+if ($sidecar && (int)ini_get('thrift_bridge.sidecar_ring') > 0) {
+    list($seqid, $output) = decode_reply(thrift_bridge_call_raw('DynamicServiceA', transaction_call(1300, 10.00, 61)),
+                                         DynamicServiceA_process_transaction_a_result::class);
+    check("ring call_raw", $seqid === 61 && $output->message === 'ServiceA: ID 1300 processed.');
+    // 标为 oneway 的消息立即得到空响应，后续调用的响应不会错位
+    $args = new DynamicServiceA_process_transaction_a_args(['input' => new InputData(['transaction_id' => 1301, 'amount' => 10.00])]);
+    $response = thrift_bridge_call_raw('DynamicServiceA', encode_call('process_transaction_a', $args, 62, TMessageType::ONEWAY));
+    check("ring oneway", $response === '');
+    list($seqid, $output) = decode_reply(thrift_bridge_call_raw('DynamicServiceA', transaction_call(1302, 10.00, 63)),
+                                         DynamicServiceA_process_transaction_a_result::class);
+    check("ring after oneway", $seqid === 63 && $output->message === 'ServiceA: ID 1302 processed.');
+    // 放不进环的请求改走套接字 (每个元素编码后约 23 字节)
+    $items = [];
+    for ($i = 0, $n = (int)(ini_get('thrift_bridge.sidecar_ring') / 16); $i < $n; $i++) {
+        $items[] = new InputData(['transaction_id' => $i, 'amount' => 1.00]);
+    }
+    $batch = new BatchData(['items' => $items]);
+    list($seqid, $output) = decode_reply(thrift_bridge_call_raw('DynamicServiceA',
+                                                                encode_call('echo_batch', new DynamicServiceA_echo_batch_args(['batch' => $batch]), 64)),
+                                         DynamicServiceA_echo_batch_result::class);
+    check("ring socket fallback", $seqid === 64 && $output == $batch);
+
+    echo "\n----------------------------------------------------\n";
+}
+
+exit($failures > 0 ? 1 : 0);
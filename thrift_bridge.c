@@ -9,43 +9,657 @@
 #include "Zend/zend_exceptions.h"
 #include "ext/standard/info.h"
 #include "ext/standard/php_string.h"
+#include "main/SAPI.h"
 
 #include <stdlib.h> 
 #include <string.h>
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <dlfcn.h> 
+#include <unistd.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <errno.h> // for strerror
+#include <execinfo.h>
+#include <time.h>
+#include <sys/syscall.h>
 
 // Thrift 真实头文件
 #include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/protocol/TCompactProtocol.h>
+#include <thrift/protocol/THeaderProtocol.h>
+#include <thrift/TApplicationException.h>
 #include <thrift/transport/TBufferTransports.h>
 #include <thrift/TProcessor.h>
+#include <thrift/concurrency/Monitor.h>
+#include <thrift/concurrency/ThreadFactory.h>
+#include <thrift/concurrency/ThreadManager.h>
 
 #include "./plugin_api.h"
+#include "./thrift_bridge_metrics.h"
+#include "./thrift_bridge_ring.h"
 #define PLUGIN_SUFFIX ".so"
 
+// 旧版 glibc 的 struct sigevent 没有这个字段名
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// --- USDT 静态探针 (provider: thrift_bridge) ---
+// 系统有 <sys/sdt.h> (systemtap-sdt-dev) 时编译进去，未挂载时每个探针只是一条 nop；
+// 编译时定义 THRIFT_BRIDGE_NO_PROBES 可去掉。探针列表与参数见 README。
+// 方法名、seqid 等需要解析消息头的参数只在跟踪器置位信号量 (bpftrace、systemtap 会) 时才计算。
+#if defined(__has_include) && !defined(THRIFT_BRIDGE_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#define THRIFT_BRIDGE_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef THRIFT_BRIDGE_HAVE_PROBES
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+// 信号量由跟踪器在挂载时加一，必须是外部链接的变量且不能被编译器常量折叠
+#define THRIFT_BRIDGE_PROBE_SEMAPHORE(name) \
+    __extension__ unsigned short thrift_bridge_##name##_semaphore \
+    __attribute__((unused)) __attribute__((section(".probes"))) = 0
+#define THRIFT_BRIDGE_PROBE_ENABLED(name) \
+    __builtin_expect(*(volatile unsigned short*)&thrift_bridge_##name##_semaphore != 0, 0)
+#define THRIFT_BRIDGE_PROBE2(name, a, b) STAP_PROBE2(thrift_bridge, name, a, b)
+#define THRIFT_BRIDGE_PROBE3(name, a, b, c) STAP_PROBE3(thrift_bridge, name, a, b, c)
+#define THRIFT_BRIDGE_PROBE4(name, a, b, c, d) STAP_PROBE4(thrift_bridge, name, a, b, c, d)
+#define THRIFT_BRIDGE_PROBE5(name, a, b, c, d, e) STAP_PROBE5(thrift_bridge, name, a, b, c, d, e)
+#else
+#define THRIFT_BRIDGE_PROBE_SEMAPHORE(name) static_assert(true, "")
+#define THRIFT_BRIDGE_PROBE_ENABLED(name) 0
+// 参数照常"使用"一次，避免只为探针准备的局部变量产生未使用警告
+#define THRIFT_BRIDGE_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define THRIFT_BRIDGE_PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#define THRIFT_BRIDGE_PROBE4(name, a, b, c, d) do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#define THRIFT_BRIDGE_PROBE5(name, a, b, c, d, e) do { (void)(a); (void)(b); (void)(c); (void)(d); (void)(e); } while (0)
+#endif
+
+extern "C" {
+THRIFT_BRIDGE_PROBE_SEMAPHORE(plugin__load);
+THRIFT_BRIDGE_PROBE_SEMAPHORE(plugin__register);
+THRIFT_BRIDGE_PROBE_SEMAPHORE(flush__entry);
+THRIFT_BRIDGE_PROBE_SEMAPHORE(dispatch);
+THRIFT_BRIDGE_PROBE_SEMAPHORE(handler__entry);
+THRIFT_BRIDGE_PROBE_SEMAPHORE(handler__return);
+THRIFT_BRIDGE_PROBE_SEMAPHORE(dispatch__return);
+THRIFT_BRIDGE_PROBE_SEMAPHORE(copy);
+}
+
 
 namespace TC {
+// --- 编译后的 IDL 类型描述 (见 plugin_api.h 的 ThriftBridge*Spec) ---
+// 注册时把插件的静态描述表转换成便于编解码的形式：字段名预先做成带哈希的
+// 持久 zend_string，PHP 数组按字段取值时无需再计算哈希。
+struct CompiledStruct;
+
+struct CompiledType {
+    apache::thrift::protocol::TType type;
+    CompiledStruct* struct_type;  // STRUCT
+    const CompiledType* key;      // MAP
+    const CompiledType* value;    // LIST/SET/MAP
+};
+
+struct CompiledField {
+    int16_t id;
+    bool required;
+    // 由 ProcessorFactory 持有 (见 fieldName)，不随结构体释放
+    zend_string* name;
+    const CompiledType* type;
+};
+
+struct CompiledStruct {
+    std::string name;
+    std::vector<CompiledField> fields;
+    // 字段类型 (含容器的元素类型)，随结构体一起释放
+    std::deque<CompiledType> types;
+    // 在属性槽位缓存 (tls_class_slots) 中的下标
+    size_t slots_index;
+    // 描述表所在的插件 (LoadedPlugin)，插件被替换后随之释放
+    const void* plugin;
+
+    const CompiledField* findField(int16_t id, size_t& cursor) const {
+        // 字段通常按声明顺序出现，先看游标位置
+        if (cursor < fields.size() && fields[cursor].id == id) {
+            return &fields[cursor++];
+        }
+        for (size_t i = 0; i < fields.size(); i++) {
+            if (fields[i].id == id) {
+                cursor = i + 1;
+                return &fields[i];
+            }
+        }
+        return nullptr;
+    }
+};
+
+// 对象属性槽位缓存：类 -> 每个字段对应的属性偏移 (0 表示不是已声明的公有属性)，
+// 按 CompiledStruct::slots_index 分组。用户类只在单个请求内有效，每次 RINIT 清空；
+// ZTS 下各线程的请求各自定义用户类，因此缓存按线程保存
+typedef std::unordered_map<zend_class_entry*, std::vector<uint32_t>> ClassSlots;
+static thread_local std::vector<ClassSlots> tls_class_slots;
+
+static void reset_class_slots() {
+    tls_class_slots.clear();
+}
+
+struct CompiledMethod {
+    std::string name;
+    zend_ulong hash;
+    CompiledStruct* args;
+    CompiledStruct* result;  // oneway 方法为 nullptr
+    // ZTS 下可能被多个线程同时更新，与 ServiceEntry::output_hwm 一样是 relaxed 原子变量
+    std::atomic<size_t> request_hwm;
+};
+
+struct CompiledService {
+    // 导出描述的插件 (LoadedPlugin)
+    const void* plugin;
+    std::vector<std::unique_ptr<CompiledMethod>> methods;
+    std::unordered_multimap<zend_ulong, CompiledMethod*> by_hash;
+
+    CompiledMethod* findMethod(zend_string* name) const {
+        auto range = by_hash.equal_range(ZSTR_HASH(name));
+        for (auto it = range.first; it != range.second; ++it) {
+            const std::string& candidate = it->second->name;
+            if (candidate.size() == ZSTR_LEN(name) && memcmp(candidate.data(), ZSTR_VAL(name), ZSTR_LEN(name)) == 0) {
+                return it->second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+// 键本身已经是 zend_string 的哈希值，无需再散列一次
+struct ZendHashIdentity {
+    size_t operator()(zend_ulong h) const { return (size_t)h; }
+};
+
+// 插件为方法声明的选项 (ThriftBridgeMethodFlags)
+struct MethodOptions {
+    std::string name;
+    unsigned int flags;
+    uint32_t ttl_ms;
+};
+
+// 按方法名合并：后声明的覆盖先声明的
+static void merge_method_options(std::vector<MethodOptions>& into, const std::vector<MethodOptions>& from) {
+    for (const MethodOptions& options : from) {
+        auto it = std::find_if(into.begin(), into.end(),
+            [&options](const MethodOptions& item) { return item.name == options.name; });
+        if (it != into.end()) {
+            *it = options;
+        } else {
+            into.push_back(options);
+        }
+    }
+}
+
+// 服务当前绑定的处理器与 IDL 描述。绑定一经发布不再修改：重复注册或注册描述时
+// 发布一份新的绑定，旧绑定至少保留到进行中的调用都结束 (见 ProcessorFactory::collect)，
+// 因此调用方读到的绑定在整个调用期间有效，既不用加锁，也不用复制 shared_ptr
+// (不碰共享的引用计数)。
+struct ServiceBinding {
+    std::shared_ptr<apache::thrift::TProcessor> processor;
+    // 插件声明的处理器类型 (ThriftBridgeProcessorFlavor)
+    int flavor;
+    // 插件导出的 IDL 描述 (register_spec_ptr)，未导出时为 nullptr
+    const CompiledService* spec;
+    // 处理器所在的插件 (LoadedPlugin)
+    const void* plugin;
+    // 插件声明了选项的方法 (register_method_flags_ptr)
+    std::vector<MethodOptions> method_options;
+    // 插件文件的标识 (见 plugin_generation)，作为共享响应缓存键的一部分：
+    // 插件被替换后，旧版本缓存的响应不会被新版本的调用命中
+    uint64_t generation;
+
+    const MethodOptions* findMethodOptions(const char* name, size_t len) const {
+        for (const MethodOptions& options : method_options) {
+            if (options.name.size() == len && memcmp(options.name.data(), name, len) == 0) {
+                return &options;
+            }
+        }
+        return nullptr;
+    }
+};
+
+// 已注册的服务。条目一经创建地址不变 (直到 MSHUTDOWN)，
+// 因此 ThriftBridgeTransport 可以在构造时解析一次并直接缓存其指针。
+struct ServiceEntry {
+    std::string name;
+    zend_ulong hash;
+    std::atomic<const ServiceBinding*> binding;
+    // 近期响应大小的高水位 (缓慢衰减)，作为下一次输出缓冲区的初始容量。
+    // 异步调用的工作线程也会更新，因此是原子变量 (只需 relaxed，值不精确无妨)
+    std::atomic<size_t> output_hwm;
+    // 在统计表 (StatsTable::services) 中的下标，超出容量时为 -1 (不统计)
+    int stats_index;
+
+    const ServiceBinding* current() const {
+        return binding.load(std::memory_order_acquire);
+    }
+};
+
+// 服务表快照：注册时复制一份加入新条目后整体发布，发布后只读。
+// 查找只有一次 acquire 读取，不加锁，多线程 (ZTS) 下随线程数线性扩展
+struct ServiceTable {
+    std::unordered_multimap<zend_ulong, ServiceEntry*, ZendHashIdentity> by_hash;
+    // 按注册顺序
+    std::vector<ServiceEntry*> entries;
+};
+
+// 处理器事件回调，在 MINIT 中创建：thrift_bridge.profile 打开时为分阶段计时的 PhaseEventHandler，
+// 否则在编译了探针时为只触发 handler 探针的 ProbeEventHandler (均见 G)。
+// 注册处理器时挂到没有自带事件回调的处理器上
+static std::shared_ptr<apache::thrift::TProcessorEventHandler> phase_event_handler;
+
+// --- 读端临界区 (插件热更新的宽限期) ---
+// 调用处理器或使用 IDL 描述期间处于临界区：线程进入时把当前纪元写进自己的记录，
+// 离开时清零，只写本线程独占的缓存行。热更新发布新绑定后推进纪元，等所有记录要么为 0、
+// 要么不早于新纪元 (之后开始的调用只会读到新绑定)，旧版本便不再被使用，可以释放和 dlclose。
+struct ReaderRecord {
+    std::atomic<uint64_t> active;
+    std::atomic<bool> in_use;
+    // 各线程的记录不共享缓存行
+    char padding[64 - sizeof(std::atomic<uint64_t>) - sizeof(std::atomic<bool>)];
+};
+
+static std::atomic<uint64_t> reader_epoch{1};
+static std::mutex reader_mutex;
+// 记录只增不减，线程退出后留给后来的线程复用
+static std::vector<ReaderRecord*> reader_records;
+static thread_local ReaderRecord* tls_reader = nullptr;
+static thread_local uint32_t tls_reader_depth = 0;
+
+// 线程退出时归还记录
+struct ReaderRecordOwner {
+    ~ReaderRecordOwner() {
+        if (tls_reader) {
+            tls_reader->active.store(0, std::memory_order_release);
+            tls_reader->in_use.store(false, std::memory_order_release);
+        }
+    }
+};
+static thread_local ReaderRecordOwner tls_reader_owner;
+
+static ReaderRecord* reader_register() {
+    std::lock_guard<std::mutex> guard(reader_mutex);
+    ReaderRecord* record = nullptr;
+    for (ReaderRecord* candidate : reader_records) {
+        if (!candidate->in_use.load(std::memory_order_relaxed)) {
+            record = candidate;
+            break;
+        }
+    }
+    if (record == nullptr) {
+        record = new ReaderRecord();
+        record->active.store(0, std::memory_order_relaxed);
+        reader_records.push_back(record);
+    }
+    record->in_use.store(true, std::memory_order_relaxed);
+    tls_reader = record;
+    // thread_local 对象在首次使用时才构造，线程退出时才会析构
+    (void)&tls_reader_owner;
+    return record;
+}
+
+// 可以嵌套 (处理器内部再次发起的调用)，只有最外层进出时写记录
+class ReaderSection {
+public:
+    ReaderSection() : left_(false) {
+        if (tls_reader_depth++ == 0) {
+            ReaderRecord* record = tls_reader ? tls_reader : reader_register();
+            record->active.store(reader_epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+            // 记录必须在读取绑定之前对热更新线程可见
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+    ~ReaderSection() {
+        leave();
+    }
+    // 提前离开 (Zend bailout 经 longjmp 离开时不会调用析构函数)
+    void leave() {
+        if (!left_) {
+            left_ = true;
+            if (--tls_reader_depth == 0) {
+                tls_reader->active.store(0, std::memory_order_release);
+            }
+        }
+    }
+
+private:
+    bool left_;
+};
+
+// 请求开始时调用：上一个请求因 bailout 中途离开时留下的临界区记录作废 (请求之间不在任何调用内)
+static void reader_reset() {
+    tls_reader_depth = 0;
+    if (tls_reader) {
+        tls_reader->active.store(0, std::memory_order_release);
+    }
+}
+
+// 开始一个宽限期：推进纪元并返回目标纪元。调用前新的绑定必须已经发布
+static uint64_t reader_advance() {
+    uint64_t target = reader_epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return target;
+}
+
+// 在 target 之前进入临界区的线程是否已全部离开。不等待：没有离开时由调用方稍后再查；
+// 在临界区内调用永远返回 false (本线程的记录早于 target)
+static bool reader_quiescent(uint64_t target) {
+    std::lock_guard<std::mutex> guard(reader_mutex);
+    for (ReaderRecord* record : reader_records) {
+        uint64_t active = record->active.load(std::memory_order_acquire);
+        if (active != 0 && active < target) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// fork 后子进程里只剩调用 fork 的线程 (不在临界区内)，其他线程的记录作废；
+// fork 时锁可能正被其他线程持有，重新构造
+static void reader_atfork_child() {
+    new (&reader_mutex) std::mutex();
+    for (ReaderRecord* record : reader_records) {
+        record->active.store(0, std::memory_order_relaxed);
+        record->in_use.store(record == tls_reader, std::memory_order_relaxed);
+    }
+}
+
 // --- A. 处理器工厂 (ProcessorFactory) ---
+// 以 zend_string 的哈希值 (zend_inline_hash_func) 为键，PHP 端传入的服务名
+// 自带缓存的哈希，查找时只在哈希碰撞的条目之间比较名字。
+// 读写分离 (RCU 式)：查找只读当前发布的 ServiceTable 快照和条目的 ServiceBinding，
+// 不加锁；注册在 write_mutex_ 下构造新的快照/绑定再原子发布。被替换的快照和绑定
+// 平时不回收 (注册只发生在加载插件时，数量有限)，读者因此不需要引用计数；
+// 只有插件热更新会在进行中的调用结束 (reader_quiescent) 后调用 collect() 释放。
 class ProcessorFactory {
 private:
-    std::map<std::string, std::shared_ptr<apache::thrift::TProcessor>> processors_;
+    // 一次插件加载中登记的处理器和描述，加载结束时一起发布 (见 endPlugin)
+    struct PendingService {
+        std::string name;
+        // 本次加载没有登记处理器 (只登记了描述) 时为空，沿用当前的处理器
+        std::shared_ptr<apache::thrift::TProcessor> processor;
+        int flavor;
+        const CompiledService* spec;
+        std::vector<MethodOptions> method_options;
+    };
+
+    std::mutex write_mutex_;
+    std::atomic<const ServiceTable*> table_{nullptr};
+    // 以下只在 write_mutex_ 下修改，拥有所有发布过的对象
+    std::vector<std::unique_ptr<ServiceEntry>> entries_;
+    std::vector<std::unique_ptr<const ServiceTable>> tables_;
+    std::vector<std::unique_ptr<const ServiceBinding>> bindings_;
+    std::vector<std::unique_ptr<CompiledService>> compiled_services_;
+    // 编译后的结构体按原始描述表地址去重，多个方法/服务共用同一结构体时只编译一次
+    std::unordered_map<const ThriftBridgeStructSpec*, std::unique_ptr<CompiledStruct>> structs_;
+    // 字段名按内容去重，只在 MSHUTDOWN (clean) 时释放：解码出的数组以它们为键，
+    // 热更新释放旧版本的结构体时这些数组可能仍在请求中 (ZTS 下 interned 的键不计引用)
+    std::unordered_map<std::string, zend_string*> field_names_;
+    size_t next_slots_index_ = 0;
+    int next_stats_index_ = 0;
+    // 正在加载的插件 (beginPlugin 与 endPlugin 之间)；不在加载中时登记立即发布
+    bool loading_ = false;
+    const void* loading_plugin_ = nullptr;
+    uint64_t loading_generation_ = 0;
+    std::vector<PendingService> pending_;
+
+    const CompiledType* compileType(const ThriftBridgeTypeSpec& spec, CompiledStruct* owner) {
+        owner->types.emplace_back();
+        CompiledType* type = &owner->types.back();
+        type->type = (apache::thrift::protocol::TType)spec.type;
+        type->struct_type = spec.type == THRIFT_BRIDGE_T_STRUCT ? compileStruct(spec.struct_spec) : nullptr;
+        type->key = (spec.type == THRIFT_BRIDGE_T_MAP && spec.key) ? compileType(*spec.key, owner) : nullptr;
+        type->value = spec.value ? compileType(*spec.value, owner) : nullptr;
+        return type;
+    }
+
+    zend_string* fieldName(const char* name) {
+        size_t len = strlen(name);
+        auto it = field_names_.find(std::string(name, len));
+        if (it != field_names_.end()) {
+            return it->second;
+        }
+        zend_string* str = zend_string_init(name, len, 1);
+        zend_string_hash_val(str);
+#ifdef ZTS
+        // 解码时作为数组键插入请求内的数组，多个线程会同时这样做：
+        // 标记为 interned 后 PHP 不再修改其引用计数，由 clean() 直接释放
+        GC_ADD_FLAGS(str, IS_STR_INTERNED | IS_STR_PERMANENT);
+#else
+        // 解码时作为数组键插入请求内的数组，只在本线程修改引用计数
+        GC_MAKE_PERSISTENT_LOCAL(str);
+#endif
+        field_names_.emplace(std::string(name, len), str);
+        return str;
+    }
+
+    CompiledStruct* compileStruct(const ThriftBridgeStructSpec* spec) {
+        if (spec == nullptr) {
+            return nullptr;
+        }
+        auto it = structs_.find(spec);
+        if (it != structs_.end()) {
+            return it->second.get();
+        }
+        // 先登记再编译字段，允许结构体递归引用自身
+        CompiledStruct* compiled = new CompiledStruct();
+        structs_.emplace(spec, std::unique_ptr<CompiledStruct>(compiled));
+        compiled->name = spec->name ? spec->name : "";
+        compiled->slots_index = next_slots_index_++;
+        compiled->plugin = loading_plugin_;
+        compiled->fields.reserve(spec->field_count);
+        for (int i = 0; i < spec->field_count; i++) {
+            const ThriftBridgeFieldSpec& field_spec = spec->fields[i];
+            CompiledField field;
+            field.id = field_spec.id;
+            field.required = field_spec.required != 0;
+            field.name = fieldName(field_spec.name);
+            field.type = compileType(field_spec.type, compiled);
+            compiled->fields.push_back(field);
+        }
+        return compiled;
+    }
     
+    // 以下在 write_mutex_ 下调用
+    PendingService* findPending(const char* name) {
+        for (PendingService& pending : pending_) {
+            if (pending.name == name) {
+                return &pending;
+            }
+        }
+        return nullptr;
+    }
+
+    PendingService* addPending(const char* name) {
+        pending_.emplace_back();
+        PendingService* pending = &pending_.back();
+        pending->name = name;
+        pending->flavor = THRIFT_BRIDGE_PROCESSOR_VIRTUAL;
+        pending->spec = nullptr;
+        return pending;
+    }
+
+    // 为登记过的服务发布新的绑定，新服务先建条目，最后发布一份包含它们的快照
+    void commitPending() {
+        std::vector<ServiceEntry*> added;
+        for (PendingService& pending : pending_) {
+            zend_ulong h = zend_inline_hash_func(pending.name.data(), pending.name.size());
+            ServiceEntry* entry = findService(pending.name.data(), pending.name.size(), h);
+            const ServiceBinding* current = entry ? entry->current() : nullptr;
+
+            ServiceBinding* binding = new ServiceBinding();
+            if (pending.processor) {
+                binding->processor = pending.processor;
+                binding->flavor = pending.flavor;
+                binding->plugin = loading_plugin_;
+                // 同一插件重复注册处理器时 IDL 描述沿用；新版本插件没有导出描述时不能沿用旧版本的
+                binding->spec = pending.spec ? pending.spec
+                    : (current && current->plugin == loading_plugin_) ? current->spec : nullptr;
+                // 方法选项同理，新版本插件要重新声明
+                if (current && current->plugin == loading_plugin_) {
+                    binding->method_options = current->method_options;
+                }
+                binding->generation = loading_generation_;
+            } else {
+                binding->processor = current->processor;
+                binding->flavor = current->flavor;
+                binding->plugin = current->plugin;
+                binding->spec = pending.spec ? pending.spec : current->spec;
+                binding->method_options = current->method_options;
+                binding->generation = current->generation;
+            }
+            merge_method_options(binding->method_options, pending.method_options);
+            bindings_.emplace_back(binding);
+
+            if (entry == nullptr) {
+                entry = new ServiceEntry();
+                entry->name = pending.name;
+                entry->hash = h;
+                entry->output_hwm = 0;
+                entry->stats_index = next_stats_index_ < kStatsMaxServices ? next_stats_index_++ : -1;
+                entries_.emplace_back(entry);
+                added.push_back(entry);
+            }
+            // 已缓存的条目指针保持有效，之后开始的调用使用新的绑定
+            entry->binding.store(binding, std::memory_order_release);
+        }
+        pending_.clear();
+
+        if (!added.empty()) {
+            const ServiceTable* current = table_.load(std::memory_order_relaxed);
+            ServiceTable* table = current ? new ServiceTable(*current) : new ServiceTable();
+            for (ServiceEntry* entry : added) {
+                table->by_hash.emplace(entry->hash, entry);
+                table->entries.push_back(entry);
+            }
+            tables_.emplace_back(table);
+            table_.store(table, std::memory_order_release);
+        }
+    }
+
 public:
-    void registerProcessor(const std::string& service_name, std::shared_ptr<apache::thrift::TProcessor> processor) {
-        processors_[service_name] = processor;
+    void registerProcessor(const std::string& service_name, std::shared_ptr<apache::thrift::TProcessor> processor,
+                           int flavor = THRIFT_BRIDGE_PROCESSOR_VIRTUAL) {
+        if (phase_event_handler && !processor->getEventHandler()) {
+            processor->setEventHandler(phase_event_handler);
+        }
+        {
+            std::lock_guard<std::mutex> guard(write_mutex_);
+            PendingService* pending = findPending(service_name.c_str());
+            if (pending == nullptr) {
+                pending = addPending(service_name.c_str());
+            }
+            pending->processor = processor;
+            pending->flavor = flavor;
+            if (!loading_) {
+                commitPending();
+            }
+        }
+        THRIFT_BRIDGE_PROBE2(plugin__register, service_name.c_str(), flavor);
         std::cout << "[CoreLib] Registered Service: " << service_name << std::endl;
     }
 
-    std::shared_ptr<apache::thrift::TProcessor> getProcessor(const std::string& service_name) {
-        auto it = processors_.find(service_name);
-        return (it != processors_.end()) ? it->second : nullptr;
+    ServiceEntry* findService(const char* name, size_t len, zend_ulong h) const {
+        const ServiceTable* table = table_.load(std::memory_order_acquire);
+        if (table == nullptr) {
+            return nullptr;
+        }
+        auto range = table->by_hash.equal_range(h);
+        for (auto it = range.first; it != range.second; ++it) {
+            const std::string& candidate = it->second->name;
+            if (candidate.size() == len && memcmp(candidate.data(), name, len) == 0) {
+                return it->second;
+            }
+        }
+        return nullptr;
+    }
+
+    ServiceEntry* findService(zend_string* name) const {
+        return findService(ZSTR_VAL(name), ZSTR_LEN(name), ZSTR_HASH(name));
+    }
+
+    void registerSpec(const ThriftBridgeServiceSpec* spec) {
+        const char* service_name = spec->service_name;
+        std::lock_guard<std::mutex> guard(write_mutex_);
+        PendingService* pending = findPending(service_name);
+        if (pending == nullptr && findService(service_name, strlen(service_name),
+                                              zend_inline_hash_func(service_name, strlen(service_name))) == nullptr) {
+            std::cerr << "[CoreLib Error]: Spec for unregistered service " << service_name << " ignored." << std::endl;
+            return;
+        }
+
+        std::unique_ptr<CompiledService> compiled(new CompiledService());
+        compiled->plugin = loading_plugin_;
+        for (int i = 0; i < spec->method_count; i++) {
+            const ThriftBridgeMethodSpec& method_spec = spec->methods[i];
+            CompiledMethod* method = new CompiledMethod();
+            method->name = method_spec.name;
+            method->hash = zend_inline_hash_func(method->name.data(), method->name.size());
+            method->args = compileStruct(method_spec.args);
+            method->result = compileStruct(method_spec.result);
+            method->request_hwm = 0;
+            compiled->methods.emplace_back(method);
+            compiled->by_hash.emplace(method->hash, method);
+        }
+        if (pending == nullptr) {
+            pending = addPending(service_name);
+        }
+        pending->spec = compiled.get();
+        compiled_services_.push_back(std::move(compiled));
+        if (!loading_) {
+            commitPending();
+        }
+        std::cout << "[CoreLib] Registered Spec: " << service_name << " (" << spec->method_count << " methods)" << std::endl;
+    }
+
+    void registerMethodFlags(const char* service_name, const char* method_name, unsigned int flags, unsigned int ttl_ms) {
+        std::lock_guard<std::mutex> guard(write_mutex_);
+        PendingService* pending = findPending(service_name);
+        if (pending == nullptr && findService(service_name, strlen(service_name),
+                                              zend_inline_hash_func(service_name, strlen(service_name))) == nullptr) {
+            std::cerr << "[CoreLib Error]: Flags for unregistered service " << service_name << " ignored." << std::endl;
+            return;
+        }
+        if (pending == nullptr) {
+            pending = addPending(service_name);
+        }
+        MethodOptions options;
+        options.name = method_name;
+        options.flags = flags;
+        options.ttl_ms = ttl_ms;
+        merge_method_options(pending->method_options, std::vector<MethodOptions>{ options });
+        if (!loading_) {
+            commitPending();
+        }
     }
 
     // 静态回调函数，供 C 风格的插件接口调用
@@ -55,9 +669,113 @@ public:
         std::shared_ptr<apache::thrift::TProcessor> processor((apache::thrift::TProcessor*)t_processor_ptr);
         factory->registerProcessor(service_name, processor);
     }
+
+    static void staticRegisterExCallback(void* factory_instance, const char* service_name, void* t_processor_ptr, int flavor) {
+        ProcessorFactory* factory = static_cast<ProcessorFactory*>(factory_instance);
+        std::shared_ptr<apache::thrift::TProcessor> processor((apache::thrift::TProcessor*)t_processor_ptr);
+        factory->registerProcessor(service_name, processor, flavor);
+    }
+
+    static void staticRegisterSpecCallback(void* factory_instance, const ThriftBridgeServiceSpec* spec) {
+        ProcessorFactory* factory = static_cast<ProcessorFactory*>(factory_instance);
+        factory->registerSpec(spec);
+    }
+
+    static void staticRegisterMethodFlagsCallback(void* factory_instance, const char* service_name, const char* method_name,
+                                                  unsigned int flags, unsigned int ttl_ms) {
+        ProcessorFactory* factory = static_cast<ProcessorFactory*>(factory_instance);
+        factory->registerMethodFlags(service_name, method_name, flags, ttl_ms);
+    }
+
+    template <typename Fn>
+    void forEachService(Fn fn) const {
+        const ServiceTable* table = table_.load(std::memory_order_acquire);
+        if (table == nullptr) {
+            return;
+        }
+        for (const ServiceEntry* entry : table->entries) {
+            fn(*entry);
+        }
+    }
+
+    // 插件的注册函数执行期间登记的处理器和描述暂存起来，结束时一起发布：
+    // 热更新时同一插件的各个服务在同一时刻切换到新版本
+    void beginPlugin(const void* plugin, uint64_t generation) {
+        std::lock_guard<std::mutex> guard(write_mutex_);
+        loading_ = true;
+        loading_plugin_ = plugin;
+        loading_generation_ = generation;
+    }
+
+    void endPlugin() {
+        std::lock_guard<std::mutex> guard(write_mutex_);
+        commitPending();
+        loading_ = false;
+        loading_plugin_ = nullptr;
+        loading_generation_ = 0;
+    }
+
+    // 在宽限期 (reader_advance 之后 reader_quiescent) 之后调用，且两者之间没有新的发布：释放已被替换的快照、
+    // 绑定和 IDL 描述。plugin 不再被任何当前绑定引用时一并释放它编译的结构体，返回 true，
+    // 此后可以 dlclose；仍被引用 (新版本没有注册同名服务) 时返回 false
+    bool collect(const void* plugin) {
+        std::lock_guard<std::mutex> guard(write_mutex_);
+        std::unordered_set<const ServiceBinding*> live_bindings;
+        std::unordered_set<const CompiledService*> live_specs;
+        bool in_use = false;
+        for (const auto& entry : entries_) {
+            const ServiceBinding* binding = entry->current();
+            live_bindings.insert(binding);
+            if (binding->spec) {
+                live_specs.insert(binding->spec);
+            }
+            if (binding->plugin == plugin || (binding->spec && binding->spec->plugin == plugin)) {
+                in_use = true;
+            }
+        }
+
+        const ServiceTable* table = table_.load(std::memory_order_relaxed);
+        tables_.erase(std::remove_if(tables_.begin(), tables_.end(),
+            [table](const std::unique_ptr<const ServiceTable>& item) { return item.get() != table; }), tables_.end());
+        bindings_.erase(std::remove_if(bindings_.begin(), bindings_.end(),
+            [&live_bindings](const std::unique_ptr<const ServiceBinding>& item) { return !live_bindings.count(item.get()); }),
+            bindings_.end());
+        compiled_services_.erase(std::remove_if(compiled_services_.begin(), compiled_services_.end(),
+            [&live_specs](const std::unique_ptr<CompiledService>& item) { return !live_specs.count(item.get()); }),
+            compiled_services_.end());
+        if (in_use) {
+            return false;
+        }
+        for (auto it = structs_.begin(); it != structs_.end();) {
+            if (it->second->plugin == plugin) {
+                it = structs_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return true;
+    }
+
+    // 只在 MSHUTDOWN (不再有调用) 时使用
     void clean()
     {
-        processors_.clear();
+        std::lock_guard<std::mutex> guard(write_mutex_);
+        table_.store(nullptr, std::memory_order_release);
+        tables_.clear();
+        bindings_.clear();
+        entries_.clear();
+        compiled_services_.clear();
+        structs_.clear();
+        for (const auto& item : field_names_) {
+#ifdef ZTS
+            pefree(item.second, 1);
+#else
+            zend_string_release_ex(item.second, 1);
+#endif
+        }
+        field_names_.clear();
+        pending_.clear();
+        next_stats_index_ = 0;
     }
 };
 
@@ -65,37 +783,178 @@ public:
 }
 
 static TC::ProcessorFactory global_factory; 
-static bool core_initialized = false;
-static std::vector<void*> plugin_handles;
+// ZTS 下多个线程可能同时执行第一个请求的 RINIT：加载插件在 core_init_mutex 下进行，
+// 完成后以 release 语义置位 core_initialized，之后的请求只做一次 acquire 读取
+static std::atomic<bool> core_initialized{false};
+static std::mutex core_init_mutex;
+
+// 已加载的插件。记录加载时文件的标识，重新扫描时据此判断文件是否被替换
+struct LoadedPlugin {
+    std::string path;
+    void* handle;
+    // 插件导出的 fork 后初始化函数 (PLUGIN_CHILD_INIT_FUNC_NAME)
+    PluginChildInitFunc child_init;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    // 热更新加载的版本经 /proc/self/fd/N 打开 (见 open_plugin_file)，首次加载为 -1。
+    // 描述符保持到卸载，之后的版本不会拿到与它相同的路径
+    int fd = -1;
+
+    ~LoadedPlugin() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+// 以下只在 core_init_mutex 下 (或 MSHUTDOWN 时) 修改
+static std::vector<std::unique_ptr<LoadedPlugin>> plugins;
+// 已被新版本替换、但仍有服务引用 (新版本没有注册同名服务) 的旧版本，之后每次热更新再尝试释放
+static std::vector<std::unique_ptr<LoadedPlugin>> retired_plugins;
+// 加载插件时使用的目录，热更新扫描同一目录
+static std::string core_plugin_dir;
+// 插件加载 (或上一次执行 fork 后初始化) 时所在的进程
+static pid_t core_pid = 0;
+// 最近一次替换插件后开始的宽限期 (reader_advance 的目标纪元)
+static uint64_t retire_target = 0;
+// 有旧版本等宽限期结束后回收；RINIT 不加锁地检查，见 collect_retired_plugins
+static std::atomic<bool> retire_pending{false};
 
 
 // --- B. 插件加载器函数 ---
-static void load_plugin(const char* plugin_path) {
-    void* handle = dlopen(plugin_path, RTLD_LAZY | RTLD_GLOBAL);
+// 插件经 thrift_bridge_context_api_version() (plugin_api.h) 确认宿主版本；
+// PHP 以 RTLD_GLOBAL 加载扩展，插件在全局范围内可以找到这个符号
+extern "C" __attribute__((visibility("default"))) int thrift_bridge_host_api_version(void) {
+    return THRIFT_BRIDGE_PLUGIN_API_VERSION;
+}
+
+// 插件文件的标识：加载同一个文件的各进程得到相同的值，文件被替换后改变
+static uint64_t plugin_generation(const struct stat& st) {
+    uint64_t fields[] = { (uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size,
+                          (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec };
+    return zend_inline_hash_func((const char*)fields, sizeof(fields));
+}
+
+// 首次加载与热更新用同样的标志。RTLD_LOCAL：插件的符号不进入全局作用域，新版本与旧版本并存时
+// 解析的是自己的定义而不是旧版本的同名符号；RTLD_NOW：缺符号在切换前暴露。
+// 不用 RTLD_DEEPBIND：C++ 插件会先在自己的依赖中解析 operator new/delete、iostream 等
+// libstdc++ 符号，与宿主和其他库使用的不是同一份
+static const int kPluginOpenFlags = RTLD_NOW | RTLD_LOCAL;
+
+// fd 为热更新时打开的文件 (见 open_plugin_file)，从 /proc/self/fd/N 加载并归插件所有；首次加载为 -1。
+// 插件注册的处理器和描述在注册函数返回后一起发布 (ProcessorFactory::beginPlugin/endPlugin)
+static LoadedPlugin* load_plugin(const char* plugin_path, const struct stat& st, int fd) {
+    std::string open_path = fd >= 0 ? "/proc/self/fd/" + std::to_string(fd) : plugin_path;
+    void* handle = dlopen(open_path.c_str(), kPluginOpenFlags);
+    THRIFT_BRIDGE_PROBE2(plugin__load, plugin_path, handle != nullptr);
     if (!handle) {
         std::cerr << "[CoreLib Error]: Cannot open library " << plugin_path << ": " << dlerror() << std::endl;
-        return;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return nullptr;
     }
-    plugin_handles.push_back(handle);
+    LoadedPlugin* plugin = new LoadedPlugin();
+    plugin->path = plugin_path;
+    plugin->handle = handle;
+    plugin->dev = st.st_dev;
+    plugin->ino = st.st_ino;
+    plugin->size = st.st_size;
+    plugin->mtime = st.st_mtim;
+    plugin->child_init = nullptr;
+    plugin->fd = fd;
 
     RegisterProcessorFunc register_func = (RegisterProcessorFunc)dlsym(handle, PLUGIN_REGISTER_FUNC_NAME);
     if (!register_func) {
         std::cerr << "[CoreLib Error]: Cannot find function " << PLUGIN_REGISTER_FUNC_NAME << " in " << plugin_path << ": " << dlerror() << std::endl;
-        return;
+        return plugin;
     }
 
     // 构建上下文结构体
     ProcessorFactoryContext context;
     context.factory_instance = &global_factory;
     context.register_func_ptr = TC::ProcessorFactory::staticRegisterCallback;
+    context.api_version = THRIFT_BRIDGE_PLUGIN_API_VERSION;
+    context.register_func_ex_ptr = TC::ProcessorFactory::staticRegisterExCallback;
+    context.register_spec_ptr = TC::ProcessorFactory::staticRegisterSpecCallback;
+    context.register_method_flags_ptr = TC::ProcessorFactory::staticRegisterMethodFlagsCallback;
     
+    global_factory.beginPlugin(plugin, plugin_generation(st));
     register_func(&context);
+    global_factory.endPlugin();
+    // 只有注册成功的插件才在 fork 后初始化
+    plugin->child_init = (PluginChildInitFunc)dlsym(handle, PLUGIN_CHILD_INIT_FUNC_NAME);
+    return plugin;
+}
+
+// dlopen 按路径和 (设备, inode) 识别已加载的库，被替换的插件要换一个路径、一个文件加载新版本：
+// 打开新文件后经 /proc/self/fd/N 加载 (与磁盘上的文件共享页缓存，不留下任何临时文件)；
+// 文件被原地改写 (inode 与当前版本相同) 时先复制到 memfd。st 返回打开的文件的标识
+static int open_plugin_file(const char* plugin_path, const LoadedPlugin& current, struct stat* st) {
+    int in = open(plugin_path, O_RDONLY | O_CLOEXEC);
+    if (in < 0 || fstat(in, st) != 0) {
+        std::cerr << "[CoreLib Error]: Cannot read " << plugin_path << ": " << strerror(errno) << std::endl;
+        if (in >= 0) {
+            close(in);
+        }
+        return -1;
+    }
+    if (st->st_dev != current.dev || st->st_ino != current.ino) {
+        return in;
+    }
+
+    int out = (int)syscall(SYS_memfd_create, "thrift_bridge_plugin", 1u /* MFD_CLOEXEC */);
+    bool ok = out >= 0;
+    char buf[65536];
+    ssize_t n;
+    while (ok && (n = read(in, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+        for (ssize_t done = 0; done < n;) {
+            ssize_t w = write(out, buf + done, n - done);
+            if (w < 0 && errno != EINTR) {
+                ok = false;
+                break;
+            }
+            done += w > 0 ? w : 0;
+        }
+    }
+    if (!ok) {
+        std::cerr << "[CoreLib Error]: Cannot stage a copy of " << plugin_path << ": " << strerror(errno) << std::endl;
+        if (out >= 0) {
+            close(out);
+        }
+        out = -1;
+    }
+    close(in);
+    return out;
+}
+
+static bool same_plugin_file(const LoadedPlugin& plugin, const struct stat& st) {
+    return plugin.dev == st.st_dev && plugin.ino == st.st_ino && plugin.size == st.st_size
+        && plugin.mtime.tv_sec == st.st_mtim.tv_sec && plugin.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+static bool is_plugin_file_name(const char* d_name) {
+    size_t name_len = strlen(d_name);
+    size_t suffix_len = strlen(PLUGIN_SUFFIX);
+    return name_len > suffix_len
+        && strcmp(d_name + name_len - suffix_len, PLUGIN_SUFFIX) == 0;
 }
 
 // --- C. 自动扫描目录 ---
-static void load_plugins_from_directory(const char* dir_path) {
+// 在 core_init_mutex 下调用。没加载过的插件直接加载；已加载但文件被替换过的插件
+// 从新打开的文件加载新版本，旧版本移入 retired_plugins，由调用方在宽限期后释放。
+// results 非空时记录有变化的插件: 路径 -> "loaded" / "reloaded" / "failed"；返回是否替换了插件
+static bool load_plugins_from_directory(const char* dir_path,
+                                        std::vector<std::pair<std::string, const char*>>* results = nullptr) {
     DIR *dp;
     struct dirent *dirp;
+    bool replaced = false;
 
     std::cout << "--- CoreLib Scanning plugin directory: " << dir_path << " ---" << std::endl;
 
@@ -103,173 +962,3913 @@ static void load_plugins_from_directory(const char* dir_path) {
         // 如果目录不存在，创建目录（可选，简化错误处理）
         if (errno == ENOENT) {
             std::cout << "[CoreLib Info]: Plugin directory not found. Skipping scan." << std::endl;
-            return;
+            return false;
         }
         std::cerr << "[CoreLib Error]: Could not open directory " << dir_path << ": " << strerror(errno) << std::endl;
-        return;
+        return false;
     }
 
     while ((dirp = readdir(dp)) != NULL) {
-        const char* d_name = dirp->d_name;
-        size_t name_len = strlen(d_name);
-        size_t suffix_len = strlen(PLUGIN_SUFFIX);
+        if (!is_plugin_file_name(dirp->d_name)) {
+            continue;
+        }
+        std::string full_path = std::string(dir_path) + "/" + dirp->d_name;
+        struct stat st;
+        if (stat(full_path.c_str(), &st) != 0) {
+            continue;
+        }
 
-        if (strcmp(d_name, ".") == 0 || strcmp(d_name, "..") == 0) {
+        auto current = std::find_if(plugins.begin(), plugins.end(),
+            [&full_path](const std::unique_ptr<LoadedPlugin>& plugin) { return plugin->path == full_path; });
+        if (current == plugins.end()) {
+            LoadedPlugin* plugin = load_plugin(full_path.c_str(), st, -1);
+            if (plugin) {
+                plugins.emplace_back(plugin);
+            }
+            if (results) {
+                results->emplace_back(full_path, plugin ? "loaded" : "failed");
+            }
+            continue;
+        }
+        if (same_plugin_file(**current, st)) {
             continue;
         }
 
-        if (name_len > suffix_len && 
-            strcmp(d_name + name_len - suffix_len, PLUGIN_SUFFIX) == 0) 
-        {
-            std::string full_path = std::string(dir_path) + "/" + d_name;
-            load_plugin(full_path.c_str());
+        // 新版本与旧版本同时存在 (见 kPluginOpenFlags)
+        LoadedPlugin* plugin = nullptr;
+        int fd = open_plugin_file(full_path.c_str(), **current, &st);
+        if (fd >= 0) {
+            plugin = load_plugin(full_path.c_str(), st, fd);
+        }
+        if (plugin) {
+            std::cout << "[CoreLib] Reloaded plugin: " << full_path << std::endl;
+            retired_plugins.push_back(std::move(*current));
+            current->reset(plugin);
+            replaced = true;
+        }
+        if (results) {
+            results->emplace_back(full_path, plugin ? "reloaded" : "failed");
         }
     }
     closedir(dp);
+    return replaced;
 }
 
 static void initialize_core_lib(const char* plugin_dir) {
-    if (core_initialized) return;
+    if (core_initialized.load(std::memory_order_acquire)) return;
+    std::lock_guard<std::mutex> guard(core_init_mutex);
+    if (core_initialized.load(std::memory_order_relaxed)) return;
 
     // 调用自动扫描，使用 INI 配置的路径
+    core_plugin_dir = plugin_dir;
     load_plugins_from_directory(plugin_dir); 
     
-    core_initialized = true;
+    core_pid = getpid();
+    core_initialized.store(true, std::memory_order_release);
 }
-    
-static char* process_thrift_data_generic(
-    const char* service_name, size_t service_len,
-    const char* input_buf, size_t input_len, 
-    size_t* output_len) 
-{
-    // 核心 RPC 逻辑 (与前例相同)
-    if (!core_initialized) return nullptr;
-
-    std::string service_str(service_name, service_len);
-    std::shared_ptr<apache::thrift::TProcessor> processor = global_factory.getProcessor(service_str);
 
-    if (!processor) {
-        return nullptr;
+// 在 core_init_mutex 下调用。最近一次替换之前开始的调用都已结束时释放旧版本的处理器、
+// IDL 描述并 dlclose；还有调用没结束时什么都不做，留给之后的请求 (RINIT) 再试，不在请求中等待
+static void collect_retired_plugins_locked() {
+    if (!retire_pending.load(std::memory_order_relaxed) || !TC::reader_quiescent(retire_target)) {
+        return;
     }
-    
-    std::shared_ptr<apache::thrift::transport::TMemoryBuffer> input_transport(new apache::thrift::transport::TMemoryBuffer((uint8_t*)input_buf, input_len));
-    std::shared_ptr<apache::thrift::transport::TMemoryBuffer> output_transport(new apache::thrift::transport::TMemoryBuffer());
-    
-    std::shared_ptr<apache::thrift::protocol::TBinaryProtocol> input_protocol(new apache::thrift::protocol::TBinaryProtocol(input_transport));
-    std::shared_ptr<apache::thrift::protocol::TBinaryProtocol> output_protocol(new apache::thrift::protocol::TBinaryProtocol(output_transport));
-
-    try {
-        if (!processor->process(input_protocol, output_protocol, nullptr)) {
-                return nullptr;
+    retire_pending.store(false, std::memory_order_relaxed);
+    for (auto it = retired_plugins.begin(); it != retired_plugins.end();) {
+        if (global_factory.collect(it->get())) {
+            dlclose((*it)->handle);
+            it = retired_plugins.erase(it);
+        } else {
+            std::cerr << "[CoreLib Info]: Previous version of " << (*it)->path
+                      << " is still referenced by a service and stays loaded." << std::endl;
+            ++it;
         }
-    } catch (const apache::thrift::TException& tx) {
-        std::cerr << "[CoreLib Exception]: " << tx.what() << std::endl;
-        return nullptr;
     }
-    
-    uint8_t* buf;
-    uint32_t len;
-    output_transport->getBuffer(&buf, &len);
-    
-    char* result = (char*)malloc(len);
-    if (result == nullptr) return nullptr;
-    memcpy(result, buf, len);
-    *output_len = len;
-    
-    return result; 
 }
-  
-// --- 类结构体定义 ---
-typedef struct _php_thrift_bridge_transport_object {
-    // 存储 serviceName (当前调用的目标 Service 名称)
-    zend_string *serviceName; 
-    
-    // 存储 wBuf (写入缓冲区)
-    zend_string *wBuf;
-
-    // 存储 rBuf (读取缓冲区)
-    zend_string *rBuf;
-    
-    // 存储 rBufPos (读取缓冲区当前位置)
-    zend_long rBufPos;
-    
-    // Zend 引擎要求必须包含 zend_object
-    zend_object std; 
-} php_thrift_bridge_transport_object;
-
-zend_class_entry *thrift_bridge_transport_ce;
-zend_class_entry *thrift_transport_exception_ce;
-static zend_object_handlers thrift_bridge_handlers;
 
-// --- 辅助宏：用于从 zend_object 获取自定义结构体 ---
-static zend_always_inline php_thrift_bridge_transport_object *php_thrift_bridge_transport_fetch_object(zend_object *obj) {
-    // 通过结构体成员的偏移量计算自定义结构体的起始地址
-    return (php_thrift_bridge_transport_object *)((char *)(obj) - XtOffsetOf(php_thrift_bridge_transport_object, std));
+static void collect_retired_plugins() {
+    if (!retire_pending.load(std::memory_order_acquire) || TC::tls_reader_depth > 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(core_init_mutex);
+    collect_retired_plugins_locked();
 }
 
-static void php_thrift_bridge_transport_dtor_object(zend_object *object)
-{
-    php_thrift_bridge_transport_object *intern = php_thrift_bridge_transport_fetch_object(object);
-    
-    if (intern->serviceName) {
-        zend_string_release(intern->serviceName);
+// 重新扫描插件目录并切换到被替换插件的新版本 (见 load_plugins_from_directory)。
+// 新版本发布后开始宽限期，旧版本在进行中的调用结束后释放 (见 collect_retired_plugins)。
+// 只影响当前进程：FPM 的每个工作进程各自重新加载
+static void reload_plugins(std::vector<std::pair<std::string, const char*>>* results = nullptr) {
+    if (TC::tls_reader_depth > 0) {
+        std::cerr << "[CoreLib Error]: Plugins cannot be reloaded from inside a call." << std::endl;
+        return;
     }
-    if (intern->wBuf) {
-        zend_string_release(intern->wBuf);
+    std::lock_guard<std::mutex> guard(core_init_mutex);
+    if (!core_initialized.load(std::memory_order_relaxed)) {
+        return;
     }
-    if (intern->rBuf) {
-        zend_string_release(intern->rBuf);
+    // 每次发布都重新开始宽限期 (collect() 要求宽限期之后没有新的发布)；
+    // 仍被引用的旧版本也借此再检查一次，新版本可能补上了同名服务
+    if (load_plugins_from_directory(core_plugin_dir.c_str(), results) || !retired_plugins.empty()) {
+        retire_target = TC::reader_advance();
+        retire_pending.store(true, std::memory_order_release);
     }
-    
-    // 调用父类的析构函数
-    zend_objects_destroy_object(object);
+    collect_retired_plugins_locked();
 }
 
-// 对象的创建函数：为 Zend 对象分配自定义结构体
+// thrift_bridge.watch_plugins 打开时用 inotify 监视插件目录：每个进程 (FPM 各工作进程)
+// 各自建立监视，在 RINIT 中非阻塞地读取事件，有插件写完或移入时重新扫描
+static int watch_fd = -1;
+static std::atomic<pid_t> watch_pid{0};
+
+static void watch_plugins_poll() {
+    if (watch_pid.load(std::memory_order_acquire) != getpid()) {
+        {
+            std::lock_guard<std::mutex> guard(core_init_mutex);
+            if (watch_pid.load(std::memory_order_relaxed) == getpid()) {
+                return;
+            }
+            // 从父进程继承的描述符与父进程共享同一个事件队列，不能再用
+            if (watch_fd >= 0) {
+                close(watch_fd);
+            }
+            watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (watch_fd >= 0 && inotify_add_watch(watch_fd, core_plugin_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+                std::cerr << "[CoreLib Error]: Cannot watch " << core_plugin_dir << ": " << strerror(errno) << std::endl;
+                close(watch_fd);
+                watch_fd = -1;
+            }
+            watch_pid.store(getpid(), std::memory_order_release);
+        }
+        // 插件加载之后、建立监视之前的替换没有事件，补扫一次
+        reload_plugins();
+        return;
+    }
+    if (watch_fd < 0) {
+        return;
+    }
+
+    bool changed = false;
+    union {
+        struct inotify_event event;
+        char buf[4096];
+    } events;
+    ssize_t n;
+    while ((n = read(watch_fd, events.buf, sizeof(events.buf))) > 0) {
+        for (char* p = events.buf; p < events.buf + n;) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            if (event->len > 0 && is_plugin_file_name(event->name)) {
+                changed = true;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    if (changed) {
+        reload_plugins();
+    }
+}
+
+namespace TC {
+// --- D. 零拷贝输出缓冲区 ---
+// 处理器的输出直接写进 Zend 分配的 zend_string，调用结束后该字符串原样
+// 交给 PHP 层作为 rBuf，不再经过 malloc 中转和 zend_string_init 的二次拷贝。
+// 只覆写 writeSlow：快路径仍是 TBufferBase 的内联 memcpy，空间不足时按 2 倍扩容。
+// 对象本身可复用：begin() 开始一次输出，release()/discard() 结束。
+class ZendStringBuffer : public apache::thrift::transport::TMemoryBuffer {
+public:
+    ZendStringBuffer()
+        : TMemoryBuffer(nullptr, 0, OBSERVE), str_(nullptr), persistent_(false) {
+    }
+
+    ~ZendStringBuffer() override {
+        discard();
+    }
+
+    void begin(size_t capacity, bool persistent = false) {
+        discard();
+        persistent_ = persistent;
+        grow(capacity < 64 ? 64 : capacity);
+    }
+
+    // 取走已写入的数据，调用方负责 zend_string_release
+    zend_string* release() {
+        size_t used = wBase_ - buffer_;
+        zend_string* str = str_;
+        // 容量远大于实际长度时收缩，避免大响应在 rBuf 里长期多占一倍内存
+        if (ZSTR_LEN(str) > 4096 && ZSTR_LEN(str) - used > used) {
+            str = zend_string_truncate(str, used, persistent_);
+        }
+        ZSTR_LEN(str) = used;
+        ZSTR_VAL(str)[used] = '\0';
+
+        str_ = nullptr;
+        detach();
+        return str;
+    }
+
+    // 丢弃未完成的输出 (处理器抛出异常时)
+    void discard() {
+        if (str_) {
+            zend_string_free(str_);
+            str_ = nullptr;
+        }
+        detach();
+    }
+
+    size_t written() const { return wBase_ - buffer_; }
+
+protected:
+    void writeSlow(const uint8_t* buf, uint32_t len) override {
+        size_t need = (wBase_ - buffer_) + (size_t)len;
+        size_t capacity = bufferSize_ ? bufferSize_ : 64;
+        while (capacity < need) {
+            capacity <<= 1;
+        }
+        grow(capacity);
+        memcpy(wBase_, buf, len);
+        wBase_ += len;
+    }
+
+private:
+    void grow(size_t capacity) {
+        if (capacity > UINT32_MAX) {
+            throw apache::thrift::transport::TTransportException(
+                apache::thrift::transport::TTransportException::BAD_ARGS, "Response exceeds 4GB.");
+        }
+        size_t used = wBase_ - buffer_;
+        // ZSTR_LEN 在写入期间记录的是容量，release() 时才改成真实长度
+        str_ = str_ ? zend_string_extend(str_, capacity, persistent_)
+                    : zend_string_alloc(capacity, persistent_);
+        buffer_ = (uint8_t*)ZSTR_VAL(str_);
+        bufferSize_ = (uint32_t)capacity;
+        rBase_ = rBound_ = buffer_;
+        wBase_ = buffer_ + used;
+        wBound_ = buffer_ + capacity;
+    }
+
+    // 内存归 zend_string 所有，owner_ 始终为 false，基类析构时不会 free
+    void detach() {
+        buffer_ = nullptr;
+        bufferSize_ = 0;
+        rBase_ = rBound_ = wBase_ = wBound_ = nullptr;
+    }
+
+    zend_string* str_;
+    bool persistent_;
+};
+
+// --- E. 可复用的输入缓冲区 ---
+// TMemoryBuffer::resetBuffer(buf, len) 内部会构造临时对象 (连带分配 TConfiguration)，
+// 这里直接改写读指针来观察新的请求数据，整个过程没有任何分配。
+class ObservingBuffer : public apache::thrift::transport::TMemoryBuffer {
+public:
+    ObservingBuffer() : TMemoryBuffer(nullptr, 0, OBSERVE) {}
+
+    void observe(const char* buf, uint32_t len) {
+        buffer_ = (uint8_t*)buf;
+        bufferSize_ = len;
+        rBase_ = rBound_ = buffer_;
+        wBase_ = wBound_ = buffer_ + len;
+        resetConsumedMessageSize();
+    }
+
+    void clear() {
+        observe(nullptr, 0);
+    }
+};
+
+// 协议直接以具体的 TMemoryBuffer 为传输层实例化，读写走 TBufferBase 的内联快路径。
+// 用 templates 选项生成、并以同一类型实例化的处理器 (THRIFT_BRIDGE_PROCESSOR_BINARY_MEMBUF)
+// 会在 TDispatchProcessorT::process 中命中 processFast，整个编解码过程没有虚函数调用；
+// 普通处理器经 TVirtualProtocol 转发一次后同样落到这里的内联实现。
+typedef apache::thrift::protocol::TBinaryProtocolT<apache::thrift::transport::TMemoryBuffer> BinaryProtocol;
+typedef apache::thrift::protocol::TCompactProtocolT<apache::thrift::transport::TMemoryBuffer> CompactProtocol;
+
+// 处理器两端使用的协议 (thrift_bridge.protocol 或 ThriftBridgeTransport 的构造参数)
+enum Protocol {
+    PROTOCOL_BINARY = 0,
+    PROTOCOL_COMPACT,
+    // THeaderProtocol：THeader 帧，也兼容带帧/不带帧的 binary 与 compact
+    PROTOCOL_HEADER,
+    // 按请求的前几个字节识别，见 detect_protocol
+    PROTOCOL_AUTO
+};
+
+// 协议名 (binary/compact/header/auto)，无法识别时返回 -1
+static int parse_protocol(const char* name, size_t len) {
+    static const char* const names[] = { "binary", "compact", "header", "auto" };
+    for (int i = 0; i < 4; i++) {
+        if (strlen(names[i]) == len && strncasecmp(names[i], name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static const char* protocol_name(int protocol) {
+    switch (protocol) {
+    case PROTOCOL_COMPACT: return "compact";
+    case PROTOCOL_HEADER:  return "header";
+    case PROTOCOL_AUTO:    return "auto";
+    default:               return "binary";
+    }
+}
+
+// 与 THeaderTransport::readFrame 相同的识别方式：不带帧的 binary 消息以版本号 0x8001 开头，
+// compact 以协议号 0x82 开头；这两种直接走对应的具体协议，其余 (带帧、THeader) 交给 THeaderProtocol。
+static inline Protocol detect_protocol(const char* buf, size_t len) {
+    const uint8_t* p = (const uint8_t*)buf;
+    if (len >= 2 && p[0] == 0x80 && p[1] == 0x01) {
+        return PROTOCOL_BINARY;
+    }
+    if (len >= 1 && p[0] == 0x82) {
+        return PROTOCOL_COMPACT;
+    }
+    return PROTOCOL_HEADER;
+}
+
+// --- F. 调用上下文 ---
+// 每个线程一份，预先构造好输入/输出缓冲区和协议对象，调用之间只重置指针，
+// 调用路径上不再有 shared_ptr 和 TMemoryBuffer 的分配与释放。
+struct CallContext {
+    std::shared_ptr<ObservingBuffer> input_transport;
+    std::shared_ptr<ZendStringBuffer> output_transport;
+    std::shared_ptr<BinaryProtocol> input_protocol;
+    std::shared_ptr<BinaryProtocol> output_protocol;
+    bool in_use;
+    // 输出是否写入持久 (malloc) 内存：异步调用的工作线程上不能使用 emalloc
+    bool persistent;
+
+    // 紧凑协议与 THeader 协议共用上面的两个缓冲区，第一次用到时才创建
+    std::shared_ptr<CompactProtocol> compact_input_protocol;
+    std::shared_ptr<CompactProtocol> compact_output_protocol;
+    // THeaderProtocol 的输入输出是同一个对象 (与 THeaderProtocolFactory 一致)
+    std::shared_ptr<apache::thrift::protocol::THeaderProtocol> header_protocol;
+
+    CallContext()
+        : input_transport(new ObservingBuffer()),
+          output_transport(new ZendStringBuffer()),
+          input_protocol(new BinaryProtocol(input_transport)),
+          output_protocol(new BinaryProtocol(output_transport)),
+          in_use(false),
+          persistent(false) {
+    }
+
+    void ensureCompact() {
+        if (!compact_input_protocol) {
+            compact_input_protocol.reset(new CompactProtocol(input_transport));
+            compact_output_protocol.reset(new CompactProtocol(output_transport));
+        }
+    }
+
+    void ensureHeader() {
+        if (!header_protocol) {
+            header_protocol.reset(new apache::thrift::protocol::THeaderProtocol(
+                input_transport, output_transport, apache::thrift::protocol::T_BINARY_PROTOCOL));
+        }
+    }
+};
+
+static CallContext& thread_call_context() {
+    static thread_local CallContext context;
+    return context;
+}
+
+// 用上下文中对应协议的对象执行处理器。异常在这里转成 failure：
+// 上下文会被下一次调用复用，异常不能越过这里把它留在半写状态
+static bool run_processor(CallContext& ctx, apache::thrift::TProcessor* processor, int protocol,
+                          std::string& failure) {
+    try {
+        switch (protocol) {
+        case PROTOCOL_COMPACT:
+            ctx.ensureCompact();
+            return processor->process(ctx.compact_input_protocol, ctx.compact_output_protocol, nullptr);
+        case PROTOCOL_HEADER:
+            ctx.ensureHeader();
+            return processor->process(ctx.header_protocol, ctx.header_protocol, nullptr);
+        default:
+            return processor->process(ctx.input_protocol, ctx.output_protocol, nullptr);
+        }
+    } catch (const apache::thrift::TException& tx) {
+        // 不在调用线程上写 stderr：异常信息随 error 交给调用方，并 (打开时) 经慢调用日志的环形缓冲区写出
+        failure.assign(tx.what());
+    } catch (const std::exception& ex) {
+        failure.assign(ex.what());
+    } catch (...) {
+        failure.assign("Processor threw an unknown exception.");
+    }
+    return false;
+}
+
+// 高水位按 1/8 衰减，偶发的超大响应不会让之后的小响应一直占用大缓冲区
+static inline void update_hwm(size_t& hwm, size_t len) {
+    size_t decayed = hwm - (hwm >> 3);
+    hwm = len > decayed ? len : decayed;
+}
+
+static inline void update_hwm(std::atomic<size_t>& hwm, size_t len) {
+    size_t value = hwm.load(std::memory_order_relaxed);
+    update_hwm(value, len);
+    hwm.store(value, std::memory_order_relaxed);
+}
+
+// --- G. 调用统计 ---
+// 思路与 processor/StatsProcessor.h、PeekProcessor.h 相同，但不包装处理器：方法名直接从
+// 请求字节中窥探，计数写进当前线程认领的统计表 (布局见 thrift_bridge_metrics.h)。
+// 统计表位于 MINIT 时创建的共享内存区域中，FPM 各工作进程各写各的槽位，读取时汇总全部槽位。
+static bool stats_enabled = true;
+static MetricsHeader* metrics_region = nullptr;
+static size_t metrics_mapped_size = 0;
+static std::string metrics_path;
+
+// 当前线程认领的统计表，以及表中各服务项是否属于本进程的同名服务
+// (接管的旧槽位可能来自注册顺序不同的进程：0 未检查，1 一致，-1 不一致)
+// thrift_bridge.metrics_slots 为 0 (自动) 时按此数目的工作进程估计槽位数
+static const zend_long kMetricsDefaultWorkers = 512;
+static const zend_long kMetricsMaxSlots = 65536;
+
+static thread_local StatsTable* tls_stats_table = nullptr;
+static thread_local bool tls_stats_claim_failed = false;
+static thread_local int8_t tls_stats_service_state[kStatsMaxServices];
+
+// 线程退出 (含进程正常退出时的主线程) 时释放认领的槽位，计数留给之后接管它的线程
+struct MetricsSlotOwner {
+    MetricsSlot* slot = nullptr;
+
+    void release() {
+        if (slot) {
+            __atomic_store_n(&slot->pid, kMetricsSlotReleased, __ATOMIC_RELEASE);
+            slot = nullptr;
+        }
+    }
+
+    ~MetricsSlotOwner() {
+        release();
+    }
+};
+static thread_local MetricsSlotOwner tls_metrics_owner;
+
+// 一次调用的分阶段耗时 (阶段定义见 thrift_bridge_metrics.h 的 CallPhase)。由发起调用的一方持有
+// (ThriftBridgeTransport 对象内或栈上)，调用期间经 tls_call_profile 交给处理器事件回调填写。
+struct CallProfile {
+    uint64_t id;                  // 本线程内递增，0 表示无效
+    const ServiceEntry* service;
+    char method[kStatsNameMax];
+    uint32_t method_len;
+    uint64_t phase_ns[PHASE_COUNT];
+    uint64_t mark;                // 上一个阶段结束的时间点
+    // 本次调用计入的统计项 (stats_record_call 填写)，PHP 侧解码结束后再补上最后一个阶段
+    StatsCounters* service_counters;
+    StatsCounters* method_counters;
+};
+
+static bool profile_enabled = false;
+static thread_local CallProfile* tls_call_profile = nullptr;
+// 本线程最近一次完成的调用 (thrift_bridge_last_call_profile)，RINIT 时清空
+static thread_local CallProfile last_call_profile;
+static thread_local uint64_t profile_sequence = 0;
+
+static void metrics_reset_thread() {
+    tls_stats_table = nullptr;
+    tls_stats_claim_failed = false;
+    memset(tls_stats_service_state, 0, sizeof(tls_stats_service_state));
+    // 不释放：fork 出的子进程里这是父进程仍在使用的槽位
+    tls_metrics_owner.slot = nullptr;
+}
+
+// fork 出的子进程不能继续写父进程认领的槽位
+static void metrics_atfork_child() {
+    metrics_reset_thread();
+}
+
+// 进程的启动时间 (/proc/<pid>/stat 第 22 项，开机以来的时钟周期数)，读不到时为 0。
+// pid 相同而启动时间不同，说明原来的进程已经退出、pid 被复用
+static uint64_t process_start_time(int32_t pid) {
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    char buf[1024];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    // 进程名可能含空格和括号，从最后一个 ')' 之后数：第 3 项 (状态) 起再数 19 项
+    const char* p = strrchr(buf, ')');
+    for (int field = 2; p && field < 22; field++) {
+        p = strchr(p + 1, ' ');
+    }
+    return p ? strtoull(p + 1, nullptr, 10) : 0;
+}
+
+// 本进程的启动时间，fork 后重新读取
+static uint64_t metrics_self_start() {
+    static pid_t cached_pid = 0;
+    static uint64_t cached_start = 0;
+    pid_t pid = getpid();
+    if (cached_pid != pid) {
+        cached_start = process_start_time((int32_t)pid);
+        cached_pid = pid;
+    }
+    return cached_start;
+}
+
+static void metrics_init_header(MetricsHeader* header, uint32_t slot_count) {
+    header->version = kMetricsVersion;
+    header->slot_count = slot_count;
+    header->slot_size = (uint32_t)metrics_slot_size();
+    header->table_size = sizeof(StatsTable);
+    __atomic_store_n(&header->magic, kMetricsMagic, __ATOMIC_RELEASE);
+}
+
+// 创建共享统计区域。path 为空时使用匿名共享映射 (只在 fork 出的进程之间共享)；
+// 否则映射该文件，布局一致时沿用其中的计数，供命令行工具读取。
+static bool metrics_open(const char* path, uint32_t slot_count) {
+    size_t size = metrics_region_size(slot_count);
+    void* addr;
+
+    if (path == nullptr || *path == '\0') {
+        addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            std::cerr << "[CoreLib Error]: Cannot map metrics region: " << strerror(errno) << std::endl;
+            return false;
+        }
+        metrics_init_header((MetricsHeader*)addr, slot_count);
+    } else {
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            std::cerr << "[CoreLib Error]: Cannot open metrics file " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        // 同时启动的多个进程 (FPM 与 CLI) 串行初始化
+        flock(fd, LOCK_EX);
+        struct stat st;
+        bool reuse = false;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size == size) {
+            addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            reuse = addr != MAP_FAILED && metrics_region_valid((MetricsHeader*)addr, size)
+                    && ((MetricsHeader*)addr)->slot_count == slot_count;
+            if (addr != MAP_FAILED && !reuse) {
+                munmap(addr, size);
+            }
+        }
+        if (!reuse) {
+            // 布局或槽位数变化：清空重建 (ftruncate 出来的稀疏页只在写入时分配)
+            if (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)size) != 0) {
+                std::cerr << "[CoreLib Error]: Cannot size metrics file " << path << ": " << strerror(errno) << std::endl;
+                flock(fd, LOCK_UN);
+                close(fd);
+                return false;
+            }
+            addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (addr != MAP_FAILED) {
+                metrics_init_header((MetricsHeader*)addr, slot_count);
+            }
+        }
+        flock(fd, LOCK_UN);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            std::cerr << "[CoreLib Error]: Cannot map metrics file " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        metrics_path = path;
+    }
+
+    metrics_region = (MetricsHeader*)addr;
+    metrics_mapped_size = size;
+    return true;
+}
+
+static void metrics_close() {
+    tls_metrics_owner.release();
+    if (metrics_region) {
+        munmap(metrics_region, metrics_mapped_size);
+        metrics_region = nullptr;
+        metrics_mapped_size = 0;
+    }
+    metrics_path.clear();
+    metrics_reset_thread();
+}
+
+// 槽位的所属线程是否已经不在：显式释放、进程已退出，或 pid 已被启动时间不同的进程复用。
+// 所属进程仍在时它的每个线程都持有自己的槽位 (包括本进程的其他线程)
+static bool metrics_slot_orphaned(int32_t owner, uint64_t owner_start) {
+    if (owner == kMetricsSlotReleased) {
+        return true;
+    }
+    if (owner <= 0) {
+        return false;
+    }
+    if (kill(owner, 0) != 0 && errno == ESRCH) {
+        return true;
+    }
+    uint64_t start = owner == (int32_t)getpid() ? metrics_self_start() : process_start_time(owner);
+    return owner_start != 0 && start != 0 && start != owner_start;
+}
+
+// 认领一个槽位：优先使用空闲槽位，其次接管已释放或所属进程已经退出的槽位 (保留其计数)。
+// 接管时先把 pid 置 0 再写启动时间和新 pid，其他线程不会在半途判断它
+static MetricsSlot* metrics_claim_slot() {
+    int32_t pid = (int32_t)getpid();
+    uint64_t start = metrics_self_start();
+
+    for (uint32_t i = 0; i < metrics_region->slot_count; i++) {
+        MetricsSlot* slot = metrics_slot(metrics_region, i);
+        uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (state != METRICS_SLOT_FREE) {
+            continue;
+        }
+        uint32_t expected = METRICS_SLOT_FREE;
+        if (__atomic_compare_exchange_n(&slot->state, &expected, (uint32_t)METRICS_SLOT_USED,
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&slot->owner_start, start, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->pid, pid, __ATOMIC_RELEASE);
+            return slot;
+        }
+    }
+
+    for (uint32_t i = 0; i < metrics_region->slot_count; i++) {
+        MetricsSlot* slot = metrics_slot(metrics_region, i);
+        int32_t owner = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != METRICS_SLOT_USED
+            || !metrics_slot_orphaned(owner, __atomic_load_n(&slot->owner_start, __ATOMIC_RELAXED))) {
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&slot->pid, &owner, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&slot->owner_start, start, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->pid, pid, __ATOMIC_RELEASE);
+            return slot;
+        }
+    }
+    return nullptr;
+}
+
+static inline StatsTable* thread_stats_table() {
+    if (tls_stats_table == nullptr && !tls_stats_claim_failed && metrics_region) {
+        MetricsSlot* slot = metrics_claim_slot();
+        tls_metrics_owner.slot = slot;
+        tls_stats_table = slot ? &slot->table : nullptr;
+        if (tls_stats_table == nullptr) {
+            tls_stats_claim_failed = true;
+            std::cerr << "[CoreLib Error]: No free metrics slot, increase thrift_bridge.metrics_slots." << std::endl;
+        }
+    }
+    return tls_stats_table;
+}
+
+// 调用的响应从哪里来
+enum CallSource {
+    CALL_DISPATCHED,  // 执行了处理器
+    CALL_COALESCED,   // 同时进行的相同调用 (见 J)
+    CALL_CACHED,      // 共享响应缓存 (见 K)
+};
+
+static inline void stats_record(StatsCounters& c, bool ok, size_t request_bytes, size_t response_bytes, uint64_t ns,
+                                int source = CALL_DISPATCHED) {
+    stat_add(c.calls, 1);
+    if (!ok) {
+        stat_add(c.errors, 1);
+    }
+    if (source == CALL_COALESCED) {
+        stat_add(c.coalesced, 1);
+    } else if (source == CALL_CACHED) {
+        stat_add(c.cached, 1);
+    }
+    stat_add(c.request_bytes, request_bytes);
+    stat_add(c.response_bytes, response_bytes);
+    stat_add(c.latency_sum_ns, ns);
+    stat_add(c.latency[latency_bucket(ns)], 1);
+}
+
+static inline void stats_set_name(StatsEntry& entry, uint32_t service, const char* name, size_t len) {
+    if (len > kStatsNameMax) {
+        len = kStatsNameMax;
+    }
+    entry.service = service;
+    memcpy(entry.name, name, len);
+    __atomic_store_n(&entry.name_len, (uint32_t)len, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t peek_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline bool peek_varint(const uint8_t*& p, const uint8_t* end, uint32_t* value) {
+    uint32_t result = 0;
+    for (int shift = 0; shift < 35 && p < end; shift += 7) {
+        uint8_t byte = *p++;
+        result |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+// 从请求消息头中取方法名 (以及 seqid)，不消费输入。THeader 帧 (头部可变长) 不解析，返回 false。
+static bool peek_method_name(const char* buf, size_t len, int protocol, const char** name, uint32_t* name_len,
+                             int32_t* seqid = nullptr) {
+    const uint8_t* p = (const uint8_t*)buf;
+    const uint8_t* end = p + len;
+
+    if (protocol == PROTOCOL_HEADER) {
+        // 带帧的 binary/compact：跳过 4 字节帧长度后按内层协议解析
+        if (len < 6) {
+            return false;
+        }
+        protocol = detect_protocol(buf + 4, len - 4);
+        if (protocol == PROTOCOL_HEADER) {
+            return false;
+        }
+        p += 4;
+    }
+
+    uint32_t n;
+    uint32_t id = 0;
+    // seqid 在名字之后的字节数：严格模式 0，非严格模式先有 1 字节消息类型；compact 的 seqid 在名字之前
+    int seqid_offset = -1;
+    if (protocol == PROTOCOL_COMPACT) {
+        // [0x82][版本|类型][varint seqid][varint 名字长度][名字]
+        if (end - p < 2) {
+            return false;
+        }
+        p += 2;
+        if (!peek_varint(p, end, &id) || !peek_varint(p, end, &n)) {
+            return false;
+        }
+    } else {
+        // 严格模式 [版本|类型 4B][名字长度 4B][名字][seqid 4B]；
+        // 旧的非严格模式 [名字长度 4B][名字][类型 1B][seqid 4B]
+        if (end - p < 4) {
+            return false;
+        }
+        seqid_offset = 1;
+        if (p[0] & 0x80) {
+            seqid_offset = 0;
+            p += 4;
+            if (end - p < 4) {
+                return false;
+            }
+        }
+        n = peek_be32(p);
+        p += 4;
+    }
+
+    if (n == 0 || n > (size_t)(end - p)) {
+        return false;
+    }
+    *name = (const char*)p;
+    *name_len = n;
+    if (seqid) {
+        if (seqid_offset >= 0) {
+            p += n + seqid_offset;
+            id = end - p >= 4 ? peek_be32(p) : 0;
+        }
+        *seqid = (int32_t)id;
+    }
+    return true;
+}
+
+// 探针参数用：请求的 seqid，无法解析时为 -1
+static int32_t probe_seqid(const char* buf, size_t len, int protocol) {
+    if (protocol == PROTOCOL_AUTO) {
+        protocol = detect_protocol(buf, len);
+    }
+    const char* name;
+    uint32_t name_len;
+    int32_t seqid = -1;
+    peek_method_name(buf, len, protocol, &name, &name_len, &seqid);
+    return seqid;
+}
+
+// 当前线程正在执行的调用的 seqid (只在有跟踪器挂载时解析)，供 handler 探针使用
+static thread_local int32_t tls_probe_seqid = -1;
+
+// 记录一次调用；protocol 为实际使用的协议 (不会是 PROTOCOL_AUTO)
+// profile 非空时记下本次调用计入的统计项
+static void stats_record_call(const ServiceEntry* service, int protocol,
+                              const char* input, size_t input_len,
+                              bool ok, size_t output_len, uint64_t ns,
+                              CallProfile* profile = nullptr, int source = CALL_DISPATCHED) {
+    if (service->stats_index < 0) {
+        return;
+    }
+    StatsTable* table = thread_stats_table();
+    if (table == nullptr) {
+        return;
+    }
+
+    uint32_t sidx = (uint32_t)service->stats_index;
+    StatsEntry& entry = table->services[sidx];
+    if (tls_stats_service_state[sidx] <= 0) {
+        if (tls_stats_service_state[sidx] < 0) {
+            return;
+        }
+        size_t len = service->name.size() > kStatsNameMax ? kStatsNameMax : service->name.size();
+        if (entry.name_len == 0) {
+            stats_set_name(entry, sidx, service->name.data(), len);
+        } else if (entry.name_len != len || memcmp(entry.name, service->name.data(), len) != 0) {
+            // 接管的槽位中这个下标属于别的服务，本线程不再记录该服务
+            tls_stats_service_state[sidx] = -1;
+            return;
+        }
+        tls_stats_service_state[sidx] = 1;
+    }
+    stats_record(entry.counters, ok, input_len, output_len, ns, source);
+    if (profile) {
+        profile->service_counters = &entry.counters;
+    }
+
+    const char* name;
+    uint32_t name_len;
+    if (!peek_method_name(input, input_len, protocol, &name, &name_len)) {
+        return;
+    }
+    if (name_len > kStatsNameMax) {
+        name_len = kStatsNameMax;
+    }
+
+    // 先看上次命中的方法，再顺序查找本服务的方法项，都没有时追加
+    StatsEntry* method = nullptr;
+    uint32_t last = table->last_method[sidx];
+    if (last && table->methods[last - 1].name_len == name_len &&
+        memcmp(table->methods[last - 1].name, name, name_len) == 0) {
+        method = &table->methods[last - 1];
+    } else {
+        for (uint32_t i = 0; i < table->method_count; i++) {
+            StatsEntry& candidate = table->methods[i];
+            if (candidate.service == sidx && candidate.name_len == name_len &&
+                memcmp(candidate.name, name, name_len) == 0) {
+                method = &candidate;
+                break;
+            }
+        }
+        if (method == nullptr) {
+            if (table->method_count >= (uint32_t)kStatsMaxMethods) {
+                return;
+            }
+            method = &table->methods[table->method_count];
+            stats_set_name(*method, sidx, name, name_len);
+            __atomic_store_n(&table->method_count, table->method_count + 1, __ATOMIC_RELEASE);
+        }
+        table->last_method[sidx] = (uint16_t)(method - table->methods + 1);
+    }
+    stats_record(method->counters, ok, input_len, output_len, ns, source);
+    if (profile) {
+        profile->method_counters = &method->counters;
+    }
+}
+
+static inline uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// 把从上一个时间点到现在的耗时记入 phase
+static inline void profile_mark(void* ctx, CallPhase phase) {
+    if (ctx) {
+        CallProfile* profile = (CallProfile*)ctx;
+        uint64_t now = monotonic_ns();
+        profile->phase_ns[phase] += now - profile->mark;
+        profile->mark = now;
+    }
+}
+
+// 处理器内部的阶段边界由生成代码的事件回调给出：preRead/postRead 之间为解码，
+// postRead/preWrite 之间为 handler，preWrite/postWrite 之间为编码。
+// 没有发起方的 profile (异步、批量调用，或未打开 thrift_bridge.profile) 时回调什么都不做。
+class PhaseEventHandler : public apache::thrift::TProcessorEventHandler {
+public:
+    void* getContext(const char* fn_name, void* server_context) override {
+        (void)server_context;
+        CallProfile* profile = tls_call_profile;
+        if (profile && fn_name) {
+            // 生成代码传入 "Service.method"
+            const char* dot = strrchr(fn_name, '.');
+            const char* name = dot ? dot + 1 : fn_name;
+            size_t len = strlen(name);
+            if (len > (size_t)kStatsNameMax) {
+                len = kStatsNameMax;
+            }
+            memcpy(profile->method, name, len);
+            profile->method_len = (uint32_t)len;
+        }
+        return profile;
+    }
+
+    void preRead(void* ctx, const char*) override { profile_mark(ctx, PHASE_DISPATCH); }
+
+    void postRead(void* ctx, const char* fn_name, uint32_t) override {
+        profile_mark(ctx, PHASE_DECODE);
+        THRIFT_BRIDGE_PROBE2(handler__entry, fn_name, tls_probe_seqid);
+    }
+
+    void preWrite(void* ctx, const char* fn_name) override {
+        profile_mark(ctx, PHASE_HANDLER);
+        THRIFT_BRIDGE_PROBE3(handler__return, fn_name, tls_probe_seqid, 1);
+    }
+
+    void postWrite(void* ctx, const char*, uint32_t) override { profile_mark(ctx, PHASE_ENCODE); }
+
+    // handler 抛出未声明的异常、oneway 方法执行完毕时没有 preWrite
+    void handlerError(void* ctx, const char* fn_name) override {
+        profile_mark(ctx, PHASE_HANDLER);
+        THRIFT_BRIDGE_PROBE3(handler__return, fn_name, tls_probe_seqid, 0);
+    }
+
+    void asyncComplete(void* ctx, const char* fn_name) override {
+        profile_mark(ctx, PHASE_HANDLER);
+        THRIFT_BRIDGE_PROBE3(handler__return, fn_name, tls_probe_seqid, 1);
+    }
+};
+
+#ifdef THRIFT_BRIDGE_HAVE_PROBES
+// 未打开 thrift_bridge.profile 时只为 handler__entry/handler__return 挂上的事件回调：
+// 不计时，跟踪器没有置位信号量时每个回调只是一次读内存比较
+class ProbeEventHandler : public apache::thrift::TProcessorEventHandler {
+public:
+    void postRead(void*, const char* fn_name, uint32_t) override {
+        if (THRIFT_BRIDGE_PROBE_ENABLED(handler__entry)) {
+            THRIFT_BRIDGE_PROBE2(handler__entry, fn_name, tls_probe_seqid);
+        }
+    }
+
+    void preWrite(void*, const char* fn_name) override {
+        if (THRIFT_BRIDGE_PROBE_ENABLED(handler__return)) {
+            THRIFT_BRIDGE_PROBE3(handler__return, fn_name, tls_probe_seqid, 1);
+        }
+    }
+
+    void handlerError(void*, const char* fn_name) override {
+        if (THRIFT_BRIDGE_PROBE_ENABLED(handler__return)) {
+            THRIFT_BRIDGE_PROBE3(handler__return, fn_name, tls_probe_seqid, 0);
+        }
+    }
+
+    void asyncComplete(void*, const char* fn_name) override {
+        if (THRIFT_BRIDGE_PROBE_ENABLED(handler__return)) {
+            THRIFT_BRIDGE_PROBE3(handler__return, fn_name, tls_probe_seqid, 1);
+        }
+    }
+};
+#endif
+
+// 开始记录一次调用；write_started 为 PHP 侧开始序列化的时间点，没有时为 0
+static inline void profile_begin(CallProfile& profile, const ServiceEntry* service, uint64_t write_started) {
+    uint64_t now = monotonic_ns();
+    memset(&profile, 0, sizeof(profile));
+    profile.id = ++profile_sequence;
+    profile.service = service;
+    profile.phase_ns[PHASE_PHP_ENCODE] = write_started ? now - write_started : 0;
+    profile.mark = now;
+}
+
+// 响应已交给 PHP：记入 COPY 阶段并计入统计，作为本线程最近一次调用。返回当前时间点。
+static inline uint64_t profile_finish(CallProfile& profile) {
+    profile_mark(&profile, PHASE_COPY);
+    StatsCounters* counters[] = { profile.service_counters, profile.method_counters };
+    for (StatsCounters* c : counters) {
+        if (c == nullptr) {
+            continue;
+        }
+        stat_add(c->profiled, 1);
+        for (int i = 0; i < PHASE_PHP_DECODE; i++) {
+            stat_add(c->phase_sum_ns[i], profile.phase_ns[i]);
+        }
+    }
+    last_call_profile = profile;
+    return profile.mark;
+}
+
+// PHP 侧解码结束 (read() 取完响应)，补上最后一个阶段
+static inline void profile_decoded(CallProfile& profile, uint64_t ns) {
+    profile.phase_ns[PHASE_PHP_DECODE] = ns;
+    StatsCounters* counters[] = { profile.service_counters, profile.method_counters };
+    for (StatsCounters* c : counters) {
+        if (c) {
+            stat_add(c->phase_sum_ns[PHASE_PHP_DECODE], ns);
+        }
+    }
+    if (last_call_profile.id == profile.id) {
+        last_call_profile.phase_ns[PHASE_PHP_DECODE] = ns;
+    }
+}
+
+// --- H. 慢调用日志 ---
+// 处理器耗时超过阈值 (或失败) 的调用记入一个无锁环形缓冲区，由后台线程定期写入文件。
+// 发起调用的线程 (PHP 工作线程、异步线程池的线程) 只做一次 CAS 和定长拷贝，从不等锁和 I/O；
+// 缓冲区满时丢弃新记录并计数，写线程把丢弃数一并写进日志。
+// 采样分析 (见 I) 的转储请求也由这个写线程处理，只打开采样时同样启动写线程。
+static const int kSlowLogCapacity = 512;          // 2 的幂
+static const int kSlowLogDumpMax = 256;
+static const int kSlowLogErrorMax = 128;
+static const int kSlowLogFlushIntervalMs = 200;
+
+struct SlowCallRecord {
+    uint64_t timestamp_ns;        // CLOCK_REALTIME
+    uint64_t duration_ns;         // 处理器耗时
+    uint64_t request_bytes;
+    uint64_t response_bytes;
+    int32_t pid;
+    int32_t protocol;
+    bool ok;
+    bool has_phases;
+    uint16_t service_len;
+    uint16_t method_len;
+    uint16_t error_len;
+    uint32_t dump_len;
+    char service[kStatsNameMax];
+    char method[kStatsNameMax];
+    char error[kSlowLogErrorMax];
+    uint64_t phase_ns[PHASE_COUNT];
+    uint8_t dump[kSlowLogDumpMax];  // 请求的前 dump_len 个字节
+};
+
+// Vyukov 有界队列：每个格子带序号，生产者 CAS 推进 head_ 认领格子，写完后发布序号；
+// 只有写线程一个消费者，tail_ 不需要 CAS。
+class SlowLogRing {
+public:
+    SlowLogRing() { reset(); }
+
+    // 只在没有其它线程访问时调用 (构造、fork 后的子进程)
+    void reset() {
+        for (int i = 0; i < kSlowLogCapacity; i++) {
+            cells_[i].sequence.store((uint64_t)i, std::memory_order_relaxed);
+        }
+        head_.store(0, std::memory_order_relaxed);
+        tail_ = 0;
+        dropped_.store(0, std::memory_order_relaxed);
+    }
+
+    // 认领一个格子，缓冲区满时返回 nullptr；填好后必须调用 commit
+    SlowCallRecord* claim(uint64_t* ticket) {
+        uint64_t pos = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells_[pos & (kSlowLogCapacity - 1)];
+            uint64_t seq = cell.sequence.load(std::memory_order_acquire);
+            int64_t diff = (int64_t)(seq - pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    *ticket = pos;
+                    return &cell.record;
+                }
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void commit(uint64_t ticket) {
+        cells_[ticket & (kSlowLogCapacity - 1)].sequence.store(ticket + 1, std::memory_order_release);
+    }
+
+    // 只由写线程调用
+    bool pop(SlowCallRecord& out) {
+        Cell& cell = cells_[tail_ & (kSlowLogCapacity - 1)];
+        if (cell.sequence.load(std::memory_order_acquire) != tail_ + 1) {
+            return false;
+        }
+        out = cell.record;
+        cell.sequence.store(tail_ + kSlowLogCapacity, std::memory_order_release);
+        tail_++;
+        return true;
+    }
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    struct Cell {
+        std::atomic<uint64_t> sequence;
+        SlowCallRecord record;
+    };
+    Cell cells_[kSlowLogCapacity];
+    alignas(64) std::atomic<uint64_t> head_;
+    alignas(64) uint64_t tail_;
+    std::atomic<uint64_t> dropped_;
+};
+
+static bool slow_log_enabled = false;
+static uint64_t slow_log_threshold_ns = 0;
+static uint32_t slow_log_dump_bytes = 0;
+static std::string slow_log_path;
+static SlowLogRing slow_log_ring;
+
+// 写线程与其监视器属于启动它的进程；fork 出的子进程里二者都已失效，见 slow_log_start
+static pid_t slow_log_pid = 0;
+static apache::thrift::concurrency::Monitor* slow_log_monitor = nullptr;
+static std::shared_ptr<apache::thrift::concurrency::Thread> slow_log_thread;
+static bool slow_log_stopping = false;
+// 打开了采样分析：写线程每轮检查一次转储请求
+static bool slow_log_sampling = false;
+static void sampling_check_dump();
+
+static inline void slow_log_copy(char* to, uint16_t* to_len, size_t max, const char* from, size_t len) {
+    if (len > max) {
+        len = max;
+    }
+    memcpy(to, from, len);
+    *to_len = (uint16_t)len;
+}
+
+// 在调用线程上执行：只拷贝定长数据，格式化留给写线程
+static void slow_log_record(const ServiceEntry* service, int protocol,
+                            const char* input, size_t input_len,
+                            bool ok, size_t output_len, uint64_t ns,
+                            const std::string& error, const CallProfile* profile) {
+    uint64_t ticket;
+    SlowCallRecord* record = slow_log_ring.claim(&ticket);
+    if (record == nullptr) {
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record->timestamp_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    record->duration_ns = ns;
+    record->request_bytes = input_len;
+    record->response_bytes = output_len;
+    record->pid = (int32_t)getpid();
+    record->protocol = protocol;
+    record->ok = ok;
+    slow_log_copy(record->service, &record->service_len, kStatsNameMax, service->name.data(), service->name.size());
+
+    const char* name;
+    uint32_t name_len;
+    if (peek_method_name(input, input_len, protocol, &name, &name_len)) {
+        slow_log_copy(record->method, &record->method_len, kStatsNameMax, name, name_len);
+    } else {
+        record->method_len = 0;
+    }
+    slow_log_copy(record->error, &record->error_len, kSlowLogErrorMax, error.data(), error.size());
+
+    // 处理器返回时已知的阶段 (copy 与 php_decode 尚未发生)
+    record->has_phases = profile != nullptr;
+    if (profile) {
+        memcpy(record->phase_ns, profile->phase_ns, sizeof(record->phase_ns));
+    }
+
+    record->dump_len = (uint32_t)(input_len < slow_log_dump_bytes ? input_len : slow_log_dump_bytes);
+    memcpy(record->dump, input, record->dump_len);
+
+    slow_log_ring.commit(ticket);
+}
+
+// 一条记录一行，key=value 形式，便于 grep 与日志采集
+static void slow_log_format(const SlowCallRecord& record, std::string& out) {
+    char buf[256];
+    time_t seconds = (time_t)(record.timestamp_ns / 1000000000ull);
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    size_t n = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + n, sizeof(buf) - n, ".%06uZ pid=%d service=",
+             (unsigned)(record.timestamp_ns % 1000000000ull / 1000), record.pid);
+    out += buf;
+    out.append(record.service, record.service_len);
+    out += " method=";
+    out.append(record.method_len ? record.method : "-", record.method_len ? record.method_len : 1);
+    snprintf(buf, sizeof(buf), " protocol=%s status=%s duration_us=%.1f request_bytes=%llu response_bytes=%llu",
+             protocol_name(record.protocol), record.ok ? "ok" : "error", record.duration_ns / 1000.0,
+             (unsigned long long)record.request_bytes, (unsigned long long)record.response_bytes);
+    out += buf;
+
+    if (record.has_phases) {
+        out += " phases_us=";
+        for (int i = 0; i <= PHASE_ENCODE; i++) {
+            snprintf(buf, sizeof(buf), "%s%s:%.1f", i ? "," : "", kPhaseNames[i], record.phase_ns[i] / 1000.0);
+            out += buf;
+        }
+    }
+
+    if (record.error_len) {
+        out += " error=\"";
+        for (uint16_t i = 0; i < record.error_len; i++) {
+            char ch = record.error[i];
+            out += (ch == '"' || ch == '\n' || ch == '\r') ? ' ' : ch;
+        }
+        out += '"';
+    }
+
+    static const char hex[] = "0123456789abcdef";
+    out += " payload=";
+    for (uint32_t i = 0; i < record.dump_len; i++) {
+        out += hex[record.dump[i] >> 4];
+        out += hex[record.dump[i] & 0x0f];
+    }
+    if (record.dump_len < record.request_bytes) {
+        out += "...";
+    }
+    out += '\n';
+}
+
+class SlowLogWriter : public apache::thrift::concurrency::Runnable {
+public:
+    explicit SlowLogWriter(apache::thrift::concurrency::Monitor* monitor) : monitor_(monitor) {}
+
+    void run() override {
+        int fd = slow_log_enabled ? open(slow_log_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644) : -1;
+        if (slow_log_enabled && fd < 0) {
+            std::cerr << "[CoreLib Error]: Cannot open slow log " << slow_log_path << ": " << strerror(errno) << std::endl;
+        }
+
+        std::string out;
+        uint64_t reported_dropped = slow_log_ring.dropped();
+        bool stopping = false;
+        while (!stopping) {
+            {
+                apache::thrift::concurrency::Synchronized guard(*monitor_);
+                if (!slow_log_stopping) {
+                    monitor_->waitForTimeRelative(kSlowLogFlushIntervalMs);
+                }
+                stopping = slow_log_stopping;
+            }
+
+            SlowCallRecord record;
+            while (slow_log_ring.pop(record)) {
+                slow_log_format(record, out);
+                if (out.size() >= 65536) {
+                    flush(fd, out);
+                }
+            }
+            uint64_t dropped = slow_log_ring.dropped();
+            if (dropped != reported_dropped) {
+                char buf[96];
+                snprintf(buf, sizeof(buf), "# pid=%d dropped %llu slow call records (ring full)\n",
+                         (int)getpid(), (unsigned long long)(dropped - reported_dropped));
+                out += buf;
+                reported_dropped = dropped;
+            }
+            flush(fd, out);
+            if (slow_log_sampling) {
+                sampling_check_dump();
+            }
+        }
+
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+private:
+    static void flush(int fd, std::string& out) {
+        size_t done = 0;
+        while (fd >= 0 && done < out.size()) {
+            ssize_t n = write(fd, out.data() + done, out.size() - done);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            done += (size_t)n;
+        }
+        out.clear();
+    }
+
+    apache::thrift::concurrency::Monitor* monitor_;
+};
+
+// RINIT 时调用：写线程在处理请求的进程里启动。插件在 fork 前加载时，子进程继承的
+// 线程对象与监视器已失效 (线程不存在，锁可能处于持有状态)，直接放弃 (只泄漏一次) 后重建。
+static void slow_log_start() {
+    if ((!slow_log_enabled && !slow_log_sampling) || slow_log_pid == getpid()) {
+        return;
+    }
+    if (slow_log_thread) {
+        new std::shared_ptr<apache::thrift::concurrency::Thread>(std::move(slow_log_thread));
+        // 父进程尚未写出的记录由父进程负责，子进程不重复写
+        slow_log_ring.reset();
+    }
+    slow_log_pid = getpid();
+    slow_log_monitor = new apache::thrift::concurrency::Monitor();
+    slow_log_stopping = false;
+
+    apache::thrift::concurrency::ThreadFactory factory(false);
+    slow_log_thread = factory.newThread(std::make_shared<SlowLogWriter>(slow_log_monitor));
+    slow_log_thread->start();
+}
+
+// 写出剩余记录后结束写线程
+static void slow_log_stop() {
+    if (!slow_log_thread || slow_log_pid != getpid()) {
+        return;
+    }
+    {
+        apache::thrift::concurrency::Synchronized guard(*slow_log_monitor);
+        slow_log_stopping = true;
+        slow_log_monitor->notify();
+    }
+    slow_log_thread->join();
+    slow_log_thread.reset();
+    delete slow_log_monitor;
+    slow_log_monitor = nullptr;
+    slow_log_pid = 0;
+}
+
+// --- I. 采样分析 ---
+// 按 thrift_bridge.sampling_rate 抽取一部分调用，在处理器执行期间用线程 CPU 时钟的 POSIX 定时器
+// 周期性地给当前线程发信号，信号处理函数记录调用栈；调用结束后把样本按服务归并。
+// 归并结果按需 (thrift_bridge_sampling_dump() 或向工作进程发 SIGRTMAX-1) 写成 pprof 可读的
+// 旧版 CPU profile 二进制格式，写法与 thrift/VirtualProfiling.cpp 的 profile_write_pprof_file 相同；
+// 信号触发的转储由 H 的后台写线程写出，不占用被抽中调用的时间。
+// 用实时信号而不是 SIGPROF：后者被 PHP 的 max_execution_time 占用。
+static const int kSamplingMaxDepth = 64;
+static const int kSamplingBufferSamples = 256;
+
+struct SampleStack {
+    uint32_t depth;
+    void* pcs[kSamplingMaxDepth];
+};
+
+// 每个执行处理器的线程一份，第一次被抽中时分配，线程退出时由 SamplingThreadOwner 释放
+struct SamplingThreadState {
+    timer_t timer;
+    bool timer_created;
+    // 正在采样的服务；为空时信号处理函数丢弃样本
+    const ServiceEntry* volatile service;
+    // 本次调用的样本，只由本线程 (含其信号处理函数) 读写
+    volatile uint32_t count;
+    SampleStack samples[kSamplingBufferSamples];
+    uint32_t rng;
+};
+
+typedef std::map<std::vector<void*>, uint64_t> SampleMap;
+
+static bool sampling_enabled = false;
+static uint32_t sampling_threshold = 0;    // 抽样概率 x 2^32
+static uint32_t sampling_interval_us = 0;
+static std::string sampling_dir;
+static int sampling_signal = 0;
+static int sampling_dump_signal = 0;
+static volatile sig_atomic_t sampling_dump_requested = 0;
+// 异步线程池的线程也会归并样本；fork 后子进程放弃 (泄漏) 继承来的锁与数据，见 sampling_atfork_child
+static std::mutex* sampling_mutex = nullptr;
+static std::map<std::string, SampleMap>* sampling_profiles = nullptr;
+
+// 信号处理函数读取的指针保持为平凡的 thread_local (不经过初始化守卫)，释放交给下面的 owner
+static thread_local SamplingThreadState* tls_sampling = nullptr;
+
+// 线程退出时删除定时器并释放本线程的状态 (异步线程池的线程会随池的重建而退出)
+struct SamplingThreadOwner {
+    SamplingThreadState* state = nullptr;
+
+    ~SamplingThreadOwner() {
+        if (state == nullptr) {
+            return;
+        }
+        if (state->timer_created) {
+            timer_delete(state->timer);
+        }
+        tls_sampling = nullptr;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        delete state;
+    }
+};
+
+static thread_local SamplingThreadOwner tls_sampling_owner;
+
+static void sampling_signal_handler(int, siginfo_t*, void*) {
+    SamplingThreadState* state = tls_sampling;
+    if (state == nullptr || state->service == nullptr || state->count >= (uint32_t)kSamplingBufferSamples) {
+        return;
+    }
+    int saved_errno = errno;
+    SampleStack& sample = state->samples[state->count];
+    int depth = backtrace(sample.pcs, kSamplingMaxDepth);
+    sample.depth = depth > 0 ? (uint32_t)depth : 0;
+    state->count = state->count + 1;
+    errno = saved_errno;
+}
+
+// 转储请求只置标志，由后台写线程在下一轮写文件
+static void sampling_dump_signal_handler(int) {
+    sampling_dump_requested = 1;
+}
+
+static void sampling_install_handlers() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+    sa.sa_sigaction = sampling_signal_handler;
+    sigaction(sampling_signal, &sa, nullptr);
+
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = sampling_dump_signal_handler;
+    sigaction(sampling_dump_signal, &sa, nullptr);
+}
+
+static void sampling_atfork_child() {
+    // 定时器不会被 fork 继承；线程状态只剩下执行 fork 的线程这一份
+    if (tls_sampling) {
+        tls_sampling->timer_created = false;
+        tls_sampling->service = nullptr;
+        tls_sampling->count = 0;
+    }
+    if (sampling_enabled) {
+        sampling_mutex = new std::mutex();
+        sampling_profiles = new std::map<std::string, SampleMap>();
+    }
+}
+
+static SamplingThreadState* sampling_thread_state() {
+    SamplingThreadState* state = tls_sampling;
+    if (state == nullptr) {
+        state = new SamplingThreadState();
+        state->timer_created = false;
+        state->service = nullptr;
+        state->count = 0;
+        state->rng = (uint32_t)monotonic_ns() ^ (uint32_t)(uintptr_t)state;
+        if (state->rng == 0) {
+            state->rng = 1;
+        }
+        // 先在普通上下文里触发一次：首次调用 backtrace 会加载 libgcc，不能发生在信号处理函数中。
+        // tls_sampling 也在这里第一次被访问，本模块的 TLS 块此后已分配，信号处理函数中读取是安全的
+        void* warmup[2];
+        backtrace(warmup, 2);
+        tls_sampling_owner.state = state;
+        tls_sampling = state;
+    }
+    return state;
+}
+
+// 是否抽中本次调用 (xorshift32)
+static inline bool sampling_should_sample() {
+    SamplingThreadState* state = sampling_thread_state();
+    uint32_t x = state->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    state->rng = x;
+    return x < sampling_threshold;
+}
+
+// 开始采样；已在采样 (处理器内部的嵌套调用，计入外层) 或无法创建定时器时返回 false
+static bool sampling_arm(SamplingThreadState* state, const ServiceEntry* service) {
+    if (state->service) {
+        return false;
+    }
+    if (!state->timer_created) {
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = sampling_signal;
+        sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+        if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &state->timer) != 0) {
+            return false;
+        }
+        state->timer_created = true;
+    }
+    state->count = 0;
+    state->service = service;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = sampling_interval_us / 1000000;
+    spec.it_interval.tv_nsec = (long)(sampling_interval_us % 1000000) * 1000;
+    spec.it_value = spec.it_interval;
+    timer_settime(state->timer, 0, &spec, nullptr);
+    return true;
+}
+
+static bool sampling_write_profile(const std::string& path, const SampleMap& samples) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (f == nullptr) {
+        return false;
+    }
+    // 头部：[0, 3 (头部字数), 0 (版本), 采样周期 (微秒), 0]
+    uintptr_t header[5] = { 0, 3, 0, sampling_interval_us, 0 };
+    fwrite(header, sizeof(header), 1, f);
+    for (const auto& item : samples) {
+        uintptr_t count = (uintptr_t)item.second;
+        uintptr_t depth = (uintptr_t)item.first.size();
+        fwrite(&count, sizeof(count), 1, f);
+        fwrite(&depth, sizeof(depth), 1, f);
+        fwrite(item.first.data(), sizeof(void*), item.first.size(), f);
+    }
+    uintptr_t trailer[3] = { 0, 1, 0 };
+    fwrite(trailer, sizeof(trailer), 1, f);
+
+    // pprof 按 /proc/self/maps 把地址映射回各个 .so (插件) 的符号
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), maps)) > 0) {
+            fwrite(buf, 1, n, f);
+        }
+        fclose(maps);
+    }
+    return fclose(f) == 0;
+}
+
+// 每个服务写一个文件：<dir>/thrift_bridge.<pid>.<service>.prof；返回服务名到文件路径
+static std::map<std::string, std::string> sampling_dump(const std::string& dir, bool reset) {
+    std::map<std::string, SampleMap> profiles;
+    {
+        std::lock_guard<std::mutex> guard(*sampling_mutex);
+        if (reset) {
+            profiles.swap(*sampling_profiles);
+        } else {
+            profiles = *sampling_profiles;
+        }
+    }
+
+    std::map<std::string, std::string> written;
+    for (const auto& item : profiles) {
+        std::string name = item.first;
+        for (char& ch : name) {
+            if (ch == '/' || ch == '\0') {
+                ch = '_';
+            }
+        }
+        std::string path = dir + "/thrift_bridge." + std::to_string((long)getpid()) + "." + name + ".prof";
+        if (sampling_write_profile(path, item.second)) {
+            written[item.first] = path;
+        } else {
+            std::cerr << "[CoreLib Error]: Cannot write profile " << path << ": " << strerror(errno) << std::endl;
+        }
+    }
+    return written;
+}
+
+// 响应信号的转储请求，在 H 的后台写线程上执行
+static void sampling_check_dump() {
+    if (sampling_dump_requested) {
+        sampling_dump_requested = 0;
+        sampling_dump(sampling_dir, false);
+    }
+}
+
+// 停止采样并把本次调用的样本归并到对应服务。signal handler 在 service 置空之后不再写入。
+static void sampling_disarm(SamplingThreadState* state) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    timer_settime(state->timer, 0, &spec, nullptr);
+    const ServiceEntry* service = state->service;
+    state->service = nullptr;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+
+    uint32_t count = state->count;
+    if (service && count > 0) {
+        std::lock_guard<std::mutex> guard(*sampling_mutex);
+        SampleMap& samples = (*sampling_profiles)[service->name];
+        for (uint32_t i = 0; i < count; i++) {
+            // 跳过信号处理函数自身与内核插入的信号返回帧
+            const SampleStack& sample = state->samples[i];
+            uint32_t skip = sample.depth > 2 ? 2 : 0;
+            samples[std::vector<void*>(sample.pcs + skip, sample.pcs + sample.depth)]++;
+        }
+    }
+    state->count = 0;
+}
+
+
+// --- J. 相同调用合并 (singleflight) ---
+// thrift_bridge.coalesce 中列出的方法 (须是幂等的)：同一时刻有多个线程 (ZTS、异步线程池)
+// 发起字节相同的请求 (不计 seqid) 时，只有第一个调用执行处理器，其余调用等它完成，
+// 拿到同一份响应 (seqid 换成各自的)。调用结束即从表中移除，不缓存结果。
+// 只合并最外层的调用：处理器内部发起的调用既不等待别人，也不被别人等待。
+// 等待有上限 (调用的截止时间，最多 kFlightWaitNs)：领头的调用迟迟不结束时，等待者退出合并自己执行。
+// 服务名 -> 方法名列表，列表为空表示该服务的所有方法
+typedef std::unordered_map<std::string, std::vector<std::string>> MethodRules;
+
+static bool coalesce_enabled = false;
+static MethodRules coalesce_rules;
+// 当前线程正在执行的处理器层数
+static thread_local uint32_t tls_dispatch_depth = 0;
+// 等待领头调用的最长时间
+static const uint64_t kFlightWaitNs = 10ULL * 1000 * 1000 * 1000;
+
+struct Flight {
+    apache::thrift::concurrency::Monitor monitor;
+    bool done;
+    bool ok;
+    // 只有在有调用等待时才复制
+    std::string response;
+    std::string error;
+    // 只在 flights_mutex 下修改
+    uint32_t waiters;
+};
+
+static std::mutex flights_mutex;
+static std::unordered_map<std::string, std::shared_ptr<Flight>> flights;
+
+// 消息头中 seqid 的位置，以及参数 (消息体) 开始的位置；不支持 THeader
+struct MessageLayout {
+    const char* name;
+    uint32_t name_len;
+    int type;   // TMessageType
+    int32_t seqid;
+    size_t seqid_pos;
+    size_t seqid_len;
+    size_t body;
+};
+
+static bool message_layout(const char* buf, size_t len, int protocol, MessageLayout* layout) {
+    const uint8_t* start = (const uint8_t*)buf;
+    const uint8_t* p = start;
+    const uint8_t* end = p + len;
+    uint32_t n;
+    if (protocol == PROTOCOL_COMPACT) {
+        // [0x82][版本|类型][varint seqid][varint 名字长度][名字]
+        if (len < 2) {
+            return false;
+        }
+        layout->type = (p[1] >> 5) & 0x07;
+        p += 2;
+        uint32_t id;
+        layout->seqid_pos = p - start;
+        if (!peek_varint(p, end, &id)) {
+            return false;
+        }
+        layout->seqid = (int32_t)id;
+        layout->seqid_len = (p - start) - layout->seqid_pos;
+        if (!peek_varint(p, end, &n) || n > (size_t)(end - p)) {
+            return false;
+        }
+        layout->name = (const char*)p;
+        layout->name_len = n;
+        layout->body = (p - start) + n;
+        return true;
+    }
+    if (protocol != PROTOCOL_BINARY) {
+        return false;
+    }
+    // 严格模式 [版本|类型 4B][名字长度 4B][名字][seqid 4B]；非严格模式 [名字长度 4B][名字][类型 1B][seqid 4B]
+    if (len < 4) {
+        return false;
+    }
+    bool strict = (p[0] & 0x80) != 0;
+    if (strict) {
+        layout->type = p[3] & 0x07;
+        p += 4;
+    }
+    if (end - p < 4) {
+        return false;
+    }
+    n = peek_be32(p);
+    p += 4;
+    size_t after_name = strict ? 4 : 5;
+    if (n > (size_t)(end - p) || (size_t)(end - p) - n < after_name) {
+        return false;
+    }
+    layout->name = (const char*)p;
+    layout->name_len = n;
+    layout->seqid_pos = (p - start) + n + (strict ? 0 : 1);
+    if (!strict) {
+        layout->type = start[layout->seqid_pos - 1];
+    }
+    layout->seqid = (int32_t)peek_be32(start + layout->seqid_pos);
+    layout->seqid_len = 4;
+    layout->body = layout->seqid_pos + 4;
+    return true;
+}
+
+static bool method_rules_match(const MethodRules& rules, const ServiceEntry* service, const MessageLayout& layout) {
+    auto it = rules.find(service->name);
+    if (it == rules.end()) {
+        return false;
+    }
+    if (it->second.empty()) {
+        return true;
+    }
+    for (const std::string& method : it->second) {
+        if (method.size() == layout.name_len && memcmp(method.data(), layout.name, layout.name_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 解析形如 "ConfigService.get_config, LookupService.*" 的方法列表 (thrift_bridge.coalesce 等)
+static void method_rules_parse(const char* spec, MethodRules& rules) {
+    rules.clear();
+    const char* p = spec ? spec : "";
+    while (*p) {
+        const char* item_end = strchr(p, ',');
+        if (item_end == nullptr) {
+            item_end = p + strlen(p);
+        }
+        std::string item(p, item_end);
+        p = *item_end ? item_end + 1 : item_end;
+        size_t first = item.find_first_not_of(" \t");
+        size_t last = item.find_last_not_of(" \t");
+        if (first == std::string::npos) {
+            continue;
+        }
+        item = item.substr(first, last - first + 1);
+        size_t dot = item.rfind('.');
+        if (dot == std::string::npos || dot == 0 || dot + 1 == item.size()) {
+            continue;
+        }
+        std::vector<std::string>& methods = rules[item.substr(0, dot)];
+        std::string method = item.substr(dot + 1);
+        if (method == "*") {
+            methods.clear();
+            methods.push_back("*");
+        } else if (methods.empty() || methods[0] != "*") {
+            methods.push_back(method);
+        }
+    }
+    for (auto& rule : rules) {
+        if (!rule.second.empty() && rule.second[0] == "*") {
+            rule.second.clear();
+        }
+    }
+}
+
+// 判断调用是否相同的键：服务、协议、方法名与参数字节 (跳过 seqid)
+static void call_key(const ServiceEntry* service, int protocol, const char* input, size_t input_len,
+                     const MessageLayout& layout, std::string& key) {
+    key.reserve(sizeof(service) + 1 + layout.name_len + 1 + (input_len - layout.body));
+    key.append((const char*)&service, sizeof(service));
+    key.push_back((char)protocol);
+    key.append(layout.name, layout.name_len);
+    key.push_back('\0');
+    key.append(input + layout.body, input_len - layout.body);
+}
+
+// 把 seqid 换成 seqid 后复制一份响应
+static zend_string* coalesce_response(const char* response, size_t response_len, int protocol, int32_t seqid,
+                                      bool persistent) {
+    MessageLayout layout;
+    if (!message_layout(response, response_len, protocol, &layout)) {
+        return nullptr;
+    }
+    uint8_t encoded[5];
+    size_t encoded_len = 0;
+    if (protocol == PROTOCOL_COMPACT) {
+        uint32_t v = (uint32_t)seqid;
+        while (v >= 0x80) {
+            encoded[encoded_len++] = (uint8_t)(v | 0x80);
+            v >>= 7;
+        }
+        encoded[encoded_len++] = (uint8_t)v;
+    } else {
+        uint32_t v = (uint32_t)seqid;
+        encoded[0] = (uint8_t)(v >> 24);
+        encoded[1] = (uint8_t)(v >> 16);
+        encoded[2] = (uint8_t)(v >> 8);
+        encoded[3] = (uint8_t)v;
+        encoded_len = 4;
+    }
+    size_t tail = response_len - layout.seqid_pos - layout.seqid_len;
+    zend_string* out = zend_string_alloc(layout.seqid_pos + encoded_len + tail, persistent);
+    char* w = ZSTR_VAL(out);
+    memcpy(w, response, layout.seqid_pos);
+    memcpy(w + layout.seqid_pos, encoded, encoded_len);
+    memcpy(w + layout.seqid_pos + encoded_len, response + layout.seqid_pos + layout.seqid_len, tail);
+    ZSTR_VAL(out)[ZSTR_LEN(out)] = '\0';
+    return out;
+}
+
+// 合并的结果
+enum FlightRole {
+    FLIGHT_NONE,      // 不合并，照常执行
+    FLIGHT_LEADER,    // 由本调用执行，结束时调用 flight_land
+    FLIGHT_FOLLOWER,  // 已拿到别的调用的结果
+};
+
+// PHP 线程上调用的截止时间 (monotonic_ns)：请求开始后 max_execution_time 秒 (墙钟)，不限时为 0
+static uint64_t request_deadline_ns() {
+    zend_long limit = EG(timeout_seconds);
+    if (limit <= 0) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    double remaining = sapi_get_request_time() + (double)limit - (now.tv_sec + now.tv_nsec / 1e9);
+    return monotonic_ns() + (remaining > 0 ? (uint64_t)(remaining * 1e9) : 0);
+}
+
+// 查找或发起一次合并。LEADER 时 flight 为新的合并，FOLLOWER 时 *response 为响应
+// (失败时为 nullptr，error 为异常信息)。等到 deadline_ns (0 不限，最多 kFlightWaitNs) 仍未完成时
+// 退出合并并返回 NONE：表中仍是这次合并时一并移除，之后的相同调用重新发起
+static FlightRole flight_join(const ServiceEntry* service, const char* input, size_t input_len, int protocol,
+                              bool persistent, uint64_t deadline_ns, std::string& key,
+                              std::shared_ptr<Flight>& flight, zend_string** response, std::string* error) {
+    MessageLayout layout;
+    if (tls_dispatch_depth > 0 || !message_layout(input, input_len, protocol, &layout)
+        || !method_rules_match(coalesce_rules, service, layout)) {
+        return FLIGHT_NONE;
+    }
+    call_key(service, protocol, input, input_len, layout, key);
+
+    std::shared_ptr<Flight> joined;
+    {
+        std::lock_guard<std::mutex> guard(flights_mutex);
+        auto it = flights.find(key);
+        if (it == flights.end()) {
+            flight = std::make_shared<Flight>();
+            flight->done = false;
+            flight->ok = false;
+            flight->waiters = 0;
+            flights.emplace(key, flight);
+            return FLIGHT_LEADER;
+        }
+        joined = it->second;
+        joined->waiters++;
+    }
+
+    uint64_t now = monotonic_ns();
+    uint64_t wait_ns = deadline_ns == 0 ? kFlightWaitNs : deadline_ns > now ? deadline_ns - now : 0;
+    if (wait_ns > kFlightWaitNs) {
+        wait_ns = kFlightWaitNs;
+    }
+    bool landed;
+    {
+        auto until = std::chrono::steady_clock::now() + std::chrono::nanoseconds(wait_ns);
+        apache::thrift::concurrency::Synchronized guard(joined->monitor);
+        while (!joined->done && joined->monitor.waitForTime(until) == 0) {
+        }
+        landed = joined->done;
+    }
+    if (!landed) {
+        std::lock_guard<std::mutex> guard(flights_mutex);
+        joined->waiters--;
+        auto it = flights.find(key);
+        if (it != flights.end() && it->second == joined) {
+            flights.erase(it);
+        }
+        key.clear();
+        return FLIGHT_NONE;
+    }
+
+    *response = nullptr;
+    if (joined->ok) {
+        int32_t seqid = 0;
+        const char* name;
+        uint32_t name_len;
+        peek_method_name(input, input_len, protocol, &name, &name_len, &seqid);
+        *response = coalesce_response(joined->response.data(), joined->response.size(), protocol, seqid, persistent);
+        if (*response == nullptr && error) {
+            error->assign("coalesced response has an unexpected message header");
+        }
+    } else if (error) {
+        error->assign(joined->error);
+    }
+    return FLIGHT_FOLLOWER;
+}
+
+// 领头的调用结束：从表中移除 (之后到达的相同请求重新执行；等待者超时时可能已被移除、
+// 换成了新的合并)，把结果交给等待的调用
+static void flight_land(const std::string& key, const std::shared_ptr<Flight>& flight,
+                        bool ok, const char* output, size_t output_len, const std::string& failure) {
+    uint32_t waiters;
+    {
+        std::lock_guard<std::mutex> guard(flights_mutex);
+        auto it = flights.find(key);
+        if (it != flights.end() && it->second == flight) {
+            flights.erase(it);
+        }
+        waiters = flight->waiters;
+    }
+    if (waiters == 0) {
+        return;
+    }
+    flight->ok = ok;
+    if (ok) {
+        flight->response.assign(output, output_len);
+    } else {
+        flight->error = failure.empty() ? "coalesced call failed" : failure;
+    }
+    apache::thrift::concurrency::Synchronized guard(flight->monitor);
+    flight->done = true;
+    flight->monitor.notifyAll();
+}
+
+// 领头调用的结束：任何退出路径 (包括异常) 都会落地，等待者不会一直等下去
+struct FlightLanding {
+    std::string key;
+    std::shared_ptr<Flight> flight;
+
+    ~FlightLanding() {
+        land(false, nullptr, 0, std::string());
+    }
+
+    void land(bool ok, const char* output, size_t output_len, const std::string& failure) {
+        if (flight) {
+            std::shared_ptr<Flight> landing;
+            landing.swap(flight);
+            flight_land(key, landing, ok, output, output_len, failure);
+        }
+    }
+};
+
+// --- K. 共享响应缓存 ---
+// 插件以 THRIFT_BRIDGE_METHOD_CACHEABLE 声明的方法 (须是参数的纯函数)，成功的响应存入 MINIT 时
+// 创建的共享内存 (FPM 各工作进程共用)，ttl_ms 毫秒内参数字节相同的调用直接拿到缓存的响应
+// (seqid 换成本次的)，不进入处理器。
+// 区域大小即 thrift_bridge.cache_size，切成等长的槽位，每 kCacheWays 个一组 (组相联)：
+// 键的哈希决定所在的组，组内按 CLOCK 淘汰。读取不加锁：槽位带序号 (写入期间为奇数)，
+// 读取前后序号相同才算命中；写入按组加自旋锁，组正被别人写入时放弃本次写入而不是等待
+// (写入者持锁时被杀死，该组此后不再更新，只是少了缓存)。
+static const uint32_t kCacheMagic = 0x31435254;  // "TRC1"
+static const uint32_t kCacheWays = 8;
+static const size_t kCacheLine = 64;
+
+struct CacheHeader {
+    uint32_t magic;
+    uint32_t set_count;
+    uint32_t slot_size;   // 含 CacheSlot 头部，按缓存行对齐
+    uint8_t padding[kCacheLine - 12];
+};
+
+// 每组一个，独占一个缓存行
+struct CacheSet {
+    uint32_t lock;
+    uint32_t hand;        // CLOCK 指针
+    uint8_t padding[kCacheLine - 8];
+};
+
+// 槽位头部，之后依次是 key_len 字节的键与 response_len 字节的响应
+struct CacheSlot {
+    uint32_t seq;
+    uint32_t referenced;  // CLOCK 访问位
+    uint64_t hash;        // 0 表示空槽位
+    uint64_t expires_ns;  // CLOCK_MONOTONIC，各进程一致
+    uint32_t key_len;
+    uint32_t response_len;
+};
+
+static bool cache_enabled = false;
+static CacheHeader* cache_region = nullptr;
+static size_t cache_mapped_size = 0;
+
+// 插件版本、服务名、协议与方法名在 head 中，参数字节 (跳过 seqid) 直接引用请求
+struct CacheKey {
+    std::string head;
+    const char* args;
+    size_t args_len;
+    uint64_t hash;
+    int32_t seqid;
+
+    size_t size() const { return head.size() + args_len; }
+};
+
+static inline size_t cache_slot_capacity() {
+    return cache_region->slot_size - sizeof(CacheSlot);
+}
+
+static inline CacheSet* cache_set(uint64_t hash) {
+    CacheSet* sets = (CacheSet*)(cache_region + 1);
+    return &sets[hash % cache_region->set_count];
+}
+
+static inline CacheSlot* cache_slot(const CacheSet* set, uint32_t way) {
+    const CacheSet* sets = (const CacheSet*)(cache_region + 1);
+    size_t index = (size_t)(set - sets) * kCacheWays + way;
+    char* slots = (char*)(sets + cache_region->set_count);
+    return (CacheSlot*)(slots + index * cache_region->slot_size);
+}
+
+static inline uint64_t cache_hash(uint64_t h, const char* data, size_t len) {
+    // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static inline bool cache_key_equals(const CacheSlot* slot, const CacheKey& key) {
+    const char* stored = (const char*)(slot + 1);
+    return memcmp(stored, key.head.data(), key.head.size()) == 0
+        && memcmp(stored + key.head.size(), key.args, key.args_len) == 0;
+}
+
+// 在 fork 之前创建，各工作进程共享；entry_max 为单个槽位能容纳的键与响应的字节数
+static bool cache_open(size_t size, size_t entry_max) {
+    size_t slot_size = (sizeof(CacheSlot) + entry_max + kCacheLine - 1) / kCacheLine * kCacheLine;
+    size_t set_count = size > sizeof(CacheHeader)
+        ? (size - sizeof(CacheHeader)) / (sizeof(CacheSet) + kCacheWays * slot_size) : 0;
+    if (set_count == 0 || set_count > UINT32_MAX || slot_size > UINT32_MAX) {
+        std::cerr << "[CoreLib Error]: thrift_bridge.cache_size is too small for thrift_bridge.cache_entry_max." << std::endl;
+        return false;
+    }
+    size_t mapped = sizeof(CacheHeader) + set_count * (sizeof(CacheSet) + kCacheWays * slot_size);
+    // 匿名映射的页在首次写入时才分配，且初始为零 (全部槽位为空)
+    void* addr = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        std::cerr << "[CoreLib Error]: Cannot map response cache: " << strerror(errno) << std::endl;
+        return false;
+    }
+    cache_region = (CacheHeader*)addr;
+    cache_region->set_count = (uint32_t)set_count;
+    cache_region->slot_size = (uint32_t)slot_size;
+    cache_region->magic = kCacheMagic;
+    cache_mapped_size = mapped;
+    return true;
+}
+
+static void cache_close() {
+    if (cache_region) {
+        munmap(cache_region, cache_mapped_size);
+        cache_region = nullptr;
+        cache_mapped_size = 0;
+    }
+    cache_enabled = false;
+}
+
+// 请求是否可以走缓存；可以时填好键，返回方法的选项
+static const MethodOptions* cache_prepare(const ServiceEntry* service, const ServiceBinding* binding,
+                                          const char* input, size_t input_len, int protocol, CacheKey& key) {
+    MessageLayout layout;
+    if (!message_layout(input, input_len, protocol, &layout) || layout.type != apache::thrift::protocol::T_CALL) {
+        return nullptr;
+    }
+    const MethodOptions* options = binding->findMethodOptions(layout.name, layout.name_len);
+    if (options == nullptr || !(options->flags & THRIFT_BRIDGE_METHOD_CACHEABLE) || options->ttl_ms == 0) {
+        return nullptr;
+    }
+    key.head.reserve(sizeof(binding->generation) + service->name.size() + 2 + layout.name_len);
+    key.head.append((const char*)&binding->generation, sizeof(binding->generation));
+    key.head.append(service->name);
+    key.head.push_back('\0');
+    key.head.push_back((char)protocol);
+    key.head.append(layout.name, layout.name_len);
+    key.args = input + layout.body;
+    key.args_len = input_len - layout.body;
+    // 放不进槽位的请求不缓存，也不必计算哈希
+    if (key.size() >= cache_slot_capacity()) {
+        return nullptr;
+    }
+    uint64_t h = cache_hash(cache_hash(0xcbf29ce484222325ULL, key.head.data(), key.head.size()), key.args, key.args_len);
+    key.hash = h ? h : 1;
+    key.seqid = layout.seqid;
+    return options;
+}
+
+// 命中时返回换好 seqid 的响应
+static zend_string* cache_lookup(const CacheKey& key, int protocol, bool persistent) {
+    static thread_local std::string scratch;
+    CacheSet* set = cache_set(key.hash);
+    uint64_t now = monotonic_ns();
+    size_t capacity = cache_slot_capacity();
+    for (uint32_t way = 0; way < kCacheWays; way++) {
+        CacheSlot* slot = cache_slot(set, way);
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) || __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != key.hash) {
+            continue;
+        }
+        uint64_t expires = __atomic_load_n(&slot->expires_ns, __ATOMIC_RELAXED);
+        uint32_t key_len = __atomic_load_n(&slot->key_len, __ATOMIC_RELAXED);
+        uint32_t response_len = __atomic_load_n(&slot->response_len, __ATOMIC_RELAXED);
+        if (expires <= now || key_len != key.size() || response_len > capacity - key_len
+            || !cache_key_equals(slot, key)) {
+            continue;
+        }
+        // 先复制出来，序号未变才说明读到的是完整的一份
+        scratch.assign((const char*)(slot + 1) + key_len, response_len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        if (!__atomic_load_n(&slot->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&slot->referenced, 1, __ATOMIC_RELAXED);
+        }
+        return coalesce_response(scratch.data(), scratch.size(), protocol, key.seqid, persistent);
+    }
+    return nullptr;
+}
+
+// 写入一次成功调用的响应；只缓存正常的应答 (T_REPLY)，不缓存 TApplicationException
+static void cache_store(const CacheKey& key, uint32_t ttl_ms, const char* response, size_t response_len, int protocol) {
+    MessageLayout layout;
+    if (key.size() + response_len > cache_slot_capacity()
+        || !message_layout(response, response_len, protocol, &layout) || layout.type != apache::thrift::protocol::T_REPLY) {
+        return;
+    }
+    CacheSet* set = cache_set(key.hash);
+    uint32_t unlocked = 0;
+    if (!__atomic_compare_exchange_n(&set->lock, &unlocked, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    uint64_t now = monotonic_ns();
+    // 依次选择：同一个键的旧响应、空的或过期的槽位、CLOCK 指针扫到的第一个未被访问的槽位
+    CacheSlot* victim = nullptr;
+    for (uint32_t way = 0; way < kCacheWays && victim == nullptr; way++) {
+        CacheSlot* slot = cache_slot(set, way);
+        if (slot->hash == key.hash && slot->key_len == key.size() && cache_key_equals(slot, key)) {
+            victim = slot;
+        }
+    }
+    for (uint32_t way = 0; way < kCacheWays && victim == nullptr; way++) {
+        CacheSlot* slot = cache_slot(set, way);
+        if (slot->hash == 0 || slot->expires_ns <= now) {
+            victim = slot;
+        }
+    }
+    while (victim == nullptr) {
+        CacheSlot* slot = cache_slot(set, set->hand);
+        set->hand = (set->hand + 1) % kCacheWays;
+        if (__atomic_load_n(&slot->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&slot->referenced, 0, __ATOMIC_RELAXED);
+        } else {
+            victim = slot;
+        }
+    }
+
+    uint32_t seq = victim->seq;
+    __atomic_store_n(&victim->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&victim->hash, key.hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->expires_ns, now + (uint64_t)ttl_ms * 1000000, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->key_len, (uint32_t)key.size(), __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->response_len, (uint32_t)response_len, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->referenced, 0, __ATOMIC_RELAXED);
+    char* data = (char*)(victim + 1);
+    memcpy(data, key.head.data(), key.head.size());
+    memcpy(data + key.head.size(), key.args, key.args_len);
+    memcpy(data + key.size(), response, response_len);
+    __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&set->lock, 0, __ATOMIC_RELEASE);
+}
+
+// --- L. 请求内记忆 ---
+// thrift_bridge.memoize 中列出的方法：同一个 PHP 请求内服务、方法与参数字节 (不计 seqid) 都相同的
+// 调用，直接返回第一次调用的响应 (seqid 换成本次的)，不再进入核心库。记忆属于当前请求，
+// 在 RSHUTDOWN 时释放，不会把一个请求的结果带到下一个请求。只在 PHP 线程上使用 (异步调用不记忆)，
+// 响应是请求内存中的 zend_string，记忆表只持有一个引用。
+static bool memo_enabled = false;
+static MethodRules memo_rules;
+// 一个请求内记忆的键与响应的总字节数上限，超过后不再记忆新的调用
+static const size_t kMemoMaxBytes = 16 * 1024 * 1024;
+
+struct MemoTable {
+    std::unordered_map<std::string, zend_string*> entries;
+    size_t bytes = 0;
+};
+
+static thread_local MemoTable tls_memo;
+
+// protocol 为实际使用的协议 (不会是 PROTOCOL_AUTO)。命中时返回响应 (由调用方释放)；
+// 未命中而方法需要记忆时填写 key，调用成功后交给 memo_store
+static zend_string* memo_lookup(const ServiceEntry* service, const char* input, size_t input_len, int protocol,
+                                std::string& key) {
+    MessageLayout layout;
+    if (!message_layout(input, input_len, protocol, &layout) || layout.type != apache::thrift::protocol::T_CALL
+        || !method_rules_match(memo_rules, service, layout)) {
+        return nullptr;
+    }
+    call_key(service, protocol, input, input_len, layout, key);
+    auto it = tls_memo.entries.find(key);
+    if (it == tls_memo.entries.end()) {
+        return nullptr;
+    }
+    zend_string* response = it->second;
+    MessageLayout stored;
+    if (message_layout(ZSTR_VAL(response), ZSTR_LEN(response), protocol, &stored) && stored.seqid == layout.seqid) {
+        return zend_string_copy(response);
+    }
+    return coalesce_response(ZSTR_VAL(response), ZSTR_LEN(response), protocol, layout.seqid, false);
+}
+
+// 只记忆正常的应答 (T_REPLY)
+static void memo_store(std::string& key, zend_string* response, int protocol) {
+    MessageLayout layout;
+    size_t bytes = key.size() + ZSTR_LEN(response);
+    if (tls_memo.bytes + bytes > kMemoMaxBytes
+        || !message_layout(ZSTR_VAL(response), ZSTR_LEN(response), protocol, &layout)
+        || layout.type != apache::thrift::protocol::T_REPLY) {
+        return;
+    }
+    if (tls_memo.entries.count(key) == 0) {
+        tls_memo.entries.emplace(std::move(key), zend_string_copy(response));
+        tls_memo.bytes += bytes;
+    }
+}
+
+static void memo_clear() {
+    for (auto& entry : tls_memo.entries) {
+        zend_string_release(entry.second);
+    }
+    tls_memo.entries.clear();
+    tls_memo.bytes = 0;
+}
+
+// --- M. 旁车模式 (sidecar) ---
+// thrift_bridge.sidecar 指向 thrift_bridge_sidecar 守护进程 (tools/thrift_bridge_sidecar.cc) 的
+// Unix socket 时，本进程不加载插件，ThriftBridgeTransport 与 thrift_bridge_call_raw 的调用
+// 交给守护进程执行：插件及其内存中的状态每台主机只有一份，工作进程保持精简。
+// 线路格式是 TFramedTransport ([长度 4B][消息])，方法名前加上 "服务名:" (TMultiplexedProcessor)，
+// 响应与进程内调用完全相同。每个线程保持一条连接，跨请求复用。
+// thrift_bridge.sidecar_ring 大于 0 时，每个线程另与守护进程共享一对环形缓冲区 (thrift_bridge_ring.h)：
+// 请求只复制一次 (写入环)，守护进程原地解码，收发本身没有系统调用 (每次调用只 poll 一次通道的 socket，
+// 感知守护进程退出或重启)；放不进环的请求仍走 socket。
+static bool sidecar_enabled = false;
+static std::string sidecar_path;
+static int sidecar_timeout_ms = 5000;
+static size_t sidecar_ring_size = 0;
+// TNonblockingServer 默认的帧长度上限
+static const uint32_t kSidecarMaxFrame = 256 * 1024 * 1024;
+static thread_local int tls_sidecar_fd = -1;
+// 等待共享内存通道时每隔这么久检查一次守护进程是否已挂断
+static const uint64_t kSidecarRingSliceNs = 100000000ull;
+// 通道建立失败后，这段时间内的调用直接走 socket
+static const uint64_t kSidecarRingRetryNs = 1000000000ull;
+
+// 共享内存通道：memfd 映射在两个进程中，socket 只用于交接 memfd 与让守护进程感知本进程退出
+struct SidecarChannel {
+    void* base = nullptr;
+    size_t size = 0;
+    int socket = -1;
+    // 建立失败后在此时刻 (ring_now_ns) 之前不再重试；fork 或 socket 连接断开时清零
+    uint64_t retry_at = 0;
+    RingSpin spin;
+};
+static thread_local SidecarChannel tls_sidecar_channel;
+
+static void sidecar_channel_close() {
+    SidecarChannel& channel = tls_sidecar_channel;
+    if (channel.base != nullptr) {
+        munmap(channel.base, channel.size);
+        channel.base = nullptr;
+    }
+    if (channel.socket >= 0) {
+        close(channel.socket);
+        channel.socket = -1;
+    }
+}
+
+static void sidecar_disconnect() {
+    if (tls_sidecar_fd >= 0) {
+        close(tls_sidecar_fd);
+        tls_sidecar_fd = -1;
+    }
+    sidecar_channel_close();
+    // 守护进程可能已经重启，下一次调用重新尝试建立通道
+    tls_sidecar_channel.retry_at = 0;
+}
+
+// fork 出的子进程不能与父进程共用一条连接 (响应会被另一方读走)，也不能共用同一对环
+static void sidecar_atfork_child() {
+    sidecar_disconnect();
+}
+
+static bool sidecar_connect(std::string& error) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        error = std::string("Cannot create sidecar socket: ") + strerror(errno);
+        return false;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sidecar_path.c_str(), sizeof(addr.sun_path) - 1);
+    struct timeval timeout;
+    timeout.tv_sec = sidecar_timeout_ms / 1000;
+    timeout.tv_usec = (sidecar_timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        error = "Cannot connect to sidecar " + sidecar_path + ": " + strerror(errno);
+        close(fd);
+        return false;
+    }
+    tls_sidecar_fd = fd;
+    return true;
+}
+
+static bool sidecar_send(struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(tls_sidecar_fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+// 返回读到的字节数，连接关闭或出错时小于 len
+static size_t sidecar_recv(char* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = recv(tls_sidecar_fd, buf + done, len - done, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// 创建 memfd 并交给守护进程 (<sidecar_path>.ring)，收到一个字节的确认后两边开始使用
+static bool sidecar_channel_open() {
+    SidecarChannel& channel = tls_sidecar_channel;
+    size_t size = ring_channel_size(sidecar_ring_size);
+    int fd = (int)syscall(SYS_memfd_create, "thrift_bridge_ring", 1u /* MFD_CLOEXEC */);
+    if (fd < 0) {
+        return false;
+    }
+    void* base = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (base == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    ring_channel_init(base, sidecar_ring_size);
+    channel.base = base;
+    channel.size = size;
+
+    std::string ring_path = sidecar_path + ".ring";
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, ring_path.c_str(), sizeof(addr.sun_path) - 1);
+    channel.socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct timeval timeout;
+    timeout.tv_sec = sidecar_timeout_ms / 1000;
+    timeout.tv_usec = (sidecar_timeout_ms % 1000) * 1000;
+    char byte = 0;
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    bool ok = channel.socket >= 0
+        && setsockopt(channel.socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0
+        && connect(channel.socket, (struct sockaddr*)&addr, sizeof(addr)) == 0
+        && sendmsg(channel.socket, &msg, MSG_NOSIGNAL) == 1
+        && recv(channel.socket, &byte, 1, 0) == 1;
+    close(fd);
+    if (!ok) {
+        sidecar_channel_close();
+    }
+    return ok;
+}
+
+// 守护进程是否已关闭通道 (退出或重启)；建立之后守护进程不再在通道的 socket 上发送任何数据
+static bool sidecar_channel_hung_up(const SidecarChannel& channel) {
+    struct pollfd pfd = { channel.socket, POLLIN | POLLRDHUP, 0 };
+    return poll(&pfd, 1, 0) > 0 && pfd.revents != 0;
+}
+
+// 分段执行 step(本段超时) 直到它返回 true，段之间检查通道是否被挂断。
+// 超过 sidecar_timeout 或被挂断时返回 false，hung_up 表示是后者
+template <typename Step>
+static bool sidecar_ring_wait(const SidecarChannel& channel, bool* hung_up, Step step) {
+    uint64_t deadline = ring_now_ns() + (uint64_t)sidecar_timeout_ms * 1000000ull;
+    *hung_up = false;
+    for (;;) {
+        uint64_t now = ring_now_ns();
+        uint64_t slice = deadline > now ? deadline - now : 0;
+        if (step(slice < kSidecarRingSliceNs ? slice : kSidecarRingSliceNs)) {
+            return true;
+        }
+        if (sidecar_channel_hung_up(channel)) {
+            *hung_up = true;
+            return false;
+        }
+        if (ring_now_ns() >= deadline) {
+            return false;
+        }
+    }
+}
+
+// 经共享内存通道调用：请求为 [服务名长度 2B][服务名][原始消息]，响应为 [消息或错误信息][RingStatus 1B]。
+// 请求放不进环、通道不可用或在请求发出前被挂断时返回 false，由调用方改走 socket
+static bool sidecar_ring_call(const char* service, size_t service_len, const char* input, size_t input_len,
+                              bool oneway, zend_string** response, std::string& error) {
+    SidecarChannel& channel = tls_sidecar_channel;
+    if (sidecar_ring_size == 0 || service_len > 0xffff
+        || 4 + 2 + service_len + input_len + 3 > sidecar_ring_size) {
+        return false;
+    }
+    if (channel.base != nullptr && sidecar_channel_hung_up(channel)) {
+        // 守护进程退出或重启过：旧通道不会再有人读，换一个新的
+        sidecar_channel_close();
+    }
+    if (channel.base == nullptr) {
+        if (channel.retry_at != 0 && ring_now_ns() < channel.retry_at) {
+            return false;
+        }
+        if (!sidecar_channel_open()) {
+            channel.retry_at = ring_now_ns() + kSidecarRingRetryNs;
+            return false;
+        }
+        channel.retry_at = 0;
+    }
+    RingHeader* requests = ring_at(channel.base, RING_REQUEST);
+    RingHeader* responses = ring_at(channel.base, RING_RESPONSE);
+    uint64_t timeout_ns = (uint64_t)sidecar_timeout_ms * 1000000ull;
+    uint16_t name_len = (uint16_t)service_len;
+    const void* parts[] = { &name_len, service, input };
+    size_t lens[] = { 2, service_len, input_len };
+    bool hung_up;
+    if (!sidecar_ring_wait(channel, &hung_up, [&](uint64_t slice) {
+            return ring_write_contiguous(requests, parts, lens, 3, channel.spin, slice);
+        })) {
+        // 请求没有发出：挂断时改走 socket；守护进程在超时内没有腾出空间时通道状态不再可信，
+        // 丢弃 (下次调用重新建立)
+        sidecar_channel_close();
+        if (hung_up) {
+            return false;
+        }
+        error = "Sidecar call timed out.";
+        *response = nullptr;
+        return true;
+    }
+    // oneway 调用守护进程在执行处理器之前就回复一条空消息，保持两个环一一对应，这里不等处理器
+    uint32_t len = 0;
+    zend_string* result = nullptr;
+    if (!sidecar_ring_wait(channel, &hung_up, [&](uint64_t slice) {
+            return ring_read_length(responses, &len, channel.spin, slice);
+        })) {
+        // 请求已经发出，不能再走 socket 重试 (可能重复执行)
+        error = hung_up ? "Sidecar closed the ring channel." : "Sidecar call timed out.";
+        sidecar_channel_close();
+        *response = nullptr;
+        return true;
+    }
+    // 长度来自另一个进程写入的共享内存，与 socket 路径一样先检查再分配
+    if (len < 1 || len - 1 > kSidecarMaxFrame) {
+        error = "Invalid sidecar response frame.";
+        sidecar_channel_close();
+        *response = nullptr;
+        return true;
+    }
+    result = zend_string_alloc(len, 0);
+    if (!ring_read_stream(responses, ZSTR_VAL(result), len, channel.spin, timeout_ns)) {
+        zend_string_efree(result);
+        error = "Sidecar call timed out.";
+        sidecar_channel_close();
+        *response = nullptr;
+        return true;
+    }
+    uint8_t status = (uint8_t)ZSTR_VAL(result)[len - 1];
+    ZSTR_LEN(result) = len - 1;
+    ZSTR_VAL(result)[len - 1] = '\0';
+    if (status != RING_STATUS_OK) {
+        error = std::string("Sidecar call failed: ") + std::string(ZSTR_VAL(result), ZSTR_LEN(result));
+        zend_string_efree(result);
+        result = nullptr;
+    } else if (oneway) {
+        zend_string_efree(result);
+        result = ZSTR_EMPTY_ALLOC();
+    }
+    *response = result;
+    return true;
+}
+
+// 把请求交给守护进程，返回请求内存中的响应 (oneway 调用为空字符串)；失败返回 nullptr 并写入 error
+static zend_string* sidecar_call(const char* service, size_t service_len, const char* input, size_t input_len,
+                                 int protocol, std::string& error) {
+    if (protocol == PROTOCOL_AUTO) {
+        protocol = detect_protocol(input, input_len);
+    }
+    MessageLayout layout;
+    if (!message_layout(input, input_len, protocol, &layout)) {
+        error = "Sidecar mode supports binary and compact messages only.";
+        return nullptr;
+    }
+    zend_string* ring_response;
+    if (sidecar_ring_call(service, service_len, input, input_len,
+                          layout.type == apache::thrift::protocol::T_ONEWAY, &ring_response, error)) {
+        return ring_response;
+    }
+
+    // 名字长度字段之前的部分原样发送，之后是新的名字长度、"服务名:" 与原来的名字及其后的全部字节
+    size_t name_pos = layout.name - input;
+    size_t length_pos = protocol == PROTOCOL_COMPACT ? layout.seqid_pos + layout.seqid_len : name_pos - 4;
+    uint32_t prefixed_len = (uint32_t)(service_len + 1 + layout.name_len);
+    uint8_t length[5];
+    size_t length_len = 0;
+    if (protocol == PROTOCOL_COMPACT) {
+        uint32_t v = prefixed_len;
+        while (v >= 0x80) {
+            length[length_len++] = (uint8_t)(v | 0x80);
+            v >>= 7;
+        }
+        length[length_len++] = (uint8_t)v;
+    } else {
+        length[0] = (uint8_t)(prefixed_len >> 24);
+        length[1] = (uint8_t)(prefixed_len >> 16);
+        length[2] = (uint8_t)(prefixed_len >> 8);
+        length[3] = (uint8_t)prefixed_len;
+        length_len = 4;
+    }
+    size_t frame_len = length_pos + length_len + service_len + 1 + (input_len - name_pos);
+    if (frame_len > kSidecarMaxFrame) {
+        error = "Payload exceeds the sidecar frame limit.";
+        return nullptr;
+    }
+    uint8_t frame_header[4] = { (uint8_t)(frame_len >> 24), (uint8_t)(frame_len >> 16),
+                                (uint8_t)(frame_len >> 8), (uint8_t)frame_len };
+
+    // 复用的连接可能已被守护进程 (重启) 关闭：发送失败时重连一次。已发出的请求不重试，避免重复执行
+    for (int attempt = 0; ; attempt++) {
+        bool reused = tls_sidecar_fd >= 0;
+        if (!reused && !sidecar_connect(error)) {
+            return nullptr;
+        }
+        struct iovec iov[6] = {
+            { frame_header, sizeof(frame_header) },
+            { (void*)input, length_pos },
+            { length, length_len },
+            { (void*)service, service_len },
+            { (void*)":", 1 },
+            { (void*)(input + name_pos), input_len - name_pos },
+        };
+        if (sidecar_send(iov, 6)) {
+            break;
+        }
+        int send_errno = errno;
+        sidecar_disconnect();
+        if (!reused || attempt > 0) {
+            error = std::string("Cannot send to sidecar: ") + strerror(send_errno);
+            return nullptr;
+        }
+    }
+
+    if (layout.type == apache::thrift::protocol::T_ONEWAY) {
+        return ZSTR_EMPTY_ALLOC();
+    }
+    uint8_t response_header[4];
+    errno = 0;
+    if (sidecar_recv((char*)response_header, 4) != 4) {
+        // 守护进程处理失败 (未知服务、处理器异常) 时关闭连接
+        error = errno == EAGAIN || errno == EWOULDBLOCK ? "Sidecar call timed out."
+            : "Sidecar closed the connection (unknown service or processor failure).";
+        sidecar_disconnect();
+        return nullptr;
+    }
+    uint32_t response_len = peek_be32(response_header);
+    if (response_len > kSidecarMaxFrame) {
+        error = "Invalid sidecar response frame.";
+        sidecar_disconnect();
+        return nullptr;
+    }
+    zend_string* response = zend_string_alloc(response_len, 0);
+    if (sidecar_recv(ZSTR_VAL(response), response_len) != response_len) {
+        zend_string_efree(response);
+        error = "Sidecar response was truncated.";
+        sidecar_disconnect();
+        return nullptr;
+    }
+    ZSTR_VAL(response)[response_len] = '\0';
+    return response;
+}
+
+// 请求开始时调用：上一个请求在调用中途 bailout (见 process_thrift_data_with_context) 时
+// 没来得及恢复的状态作废，请求之间本线程不在任何调用内
+static void reset_thread_call_state() {
+    reader_reset();
+    tls_dispatch_depth = 0;
+    tls_call_profile = nullptr;
+    tls_probe_seqid = -1;
+    thread_call_context().in_use = false;
+}
+
+}
+
+// 失败时返回 nullptr；error 非空时写入异常信息，profile 非空时由处理器事件回调填写各阶段。
+// deadline_ns 为调用的截止时间 (monotonic_ns)，为 0 时 PHP 线程上按请求的剩余时间
+static zend_string* process_thrift_data_with_context(
+    TC::CallContext& ctx, TC::ServiceEntry* service,
+    const char* input_buf, size_t input_len,
+    int protocol = TC::PROTOCOL_BINARY,
+    std::string* error = nullptr,
+    TC::CallProfile* profile = nullptr,
+    uint64_t deadline_ns = 0)
+{
+    if (protocol == TC::PROTOCOL_AUTO) {
+        protocol = TC::detect_protocol(input_buf, input_len);
+    }
+
+    // 整个调用使用同一个绑定；调用期间处理器被替换 (热更新) 也不影响本次调用，
+    // 旧版本要等本次调用离开临界区后才释放
+    TC::ReaderSection reader;
+    const TC::ServiceBinding* binding = service->current();
+
+    // 共享响应缓存：命中时直接返回缓存的响应，不进入处理器
+    TC::CacheKey cache_key;
+    const TC::MethodOptions* cache_method = nullptr;
+    if (TC::cache_enabled && !binding->method_options.empty()) {
+        uint64_t looked = TC::stats_enabled ? TC::monotonic_ns() : 0;
+        cache_method = TC::cache_prepare(service, binding, input_buf, input_len, protocol, cache_key);
+        zend_string* cached = cache_method ? TC::cache_lookup(cache_key, protocol, ctx.persistent) : nullptr;
+        if (cached) {
+            if (TC::stats_enabled) {
+                TC::stats_record_call(service, protocol, input_buf, input_len, true, ZSTR_LEN(cached),
+                                      TC::monotonic_ns() - looked, nullptr, TC::CALL_CACHED);
+            }
+            return cached;
+        }
+    }
+
+    // 相同调用合并：已有相同的调用在执行时等它完成，直接返回它的响应
+    TC::FlightLanding landing;
+    if (TC::coalesce_enabled) {
+        uint64_t waited = TC::stats_enabled ? TC::monotonic_ns() : 0;
+        if (deadline_ns == 0 && !ctx.persistent) {
+            deadline_ns = TC::request_deadline_ns();
+        }
+        zend_string* coalesced = nullptr;
+        std::string coalesce_error;
+        if (TC::flight_join(service, input_buf, input_len, protocol, ctx.persistent, deadline_ns,
+                            landing.key, landing.flight, &coalesced, &coalesce_error) == TC::FLIGHT_FOLLOWER) {
+            if (TC::stats_enabled) {
+                TC::stats_record_call(service, protocol, input_buf, input_len, coalesced != nullptr,
+                                      coalesced ? ZSTR_LEN(coalesced) : 0, TC::monotonic_ns() - waited, nullptr, TC::CALL_COALESCED);
+            }
+            if (error && !coalesce_error.empty()) {
+                error->swap(coalesce_error);
+            }
+            return coalesced;
+        }
+    }
+
+    ctx.input_transport->observe(input_buf, (uint32_t)input_len);
+    size_t hwm = service->output_hwm.load(std::memory_order_relaxed);
+    ctx.output_transport->begin(hwm ? hwm : input_len, ctx.persistent);
+
+    // 处理器内部再次发起的调用不带 profile，不能填进外层调用的记录
+    TC::CallProfile* outer_profile = TC::tls_call_profile;
+    TC::tls_call_profile = profile;
+
+    const char* probe_method = "";
+    uint32_t probe_method_len = 0;
+    int32_t probe_seqid = -1;
+    if (THRIFT_BRIDGE_PROBE_ENABLED(dispatch) || THRIFT_BRIDGE_PROBE_ENABLED(dispatch__return) ||
+        THRIFT_BRIDGE_PROBE_ENABLED(handler__entry) || THRIFT_BRIDGE_PROBE_ENABLED(handler__return)) {
+        TC::peek_method_name(input_buf, input_len, protocol, &probe_method, &probe_method_len, &probe_seqid);
+    }
+    int32_t outer_probe_seqid = TC::tls_probe_seqid;
+    TC::tls_probe_seqid = probe_seqid;
+    THRIFT_BRIDGE_PROBE5(dispatch, service->name.c_str(), probe_method, probe_method_len, input_len, probe_seqid);
+
+    // 抽中的调用在处理器执行期间采样调用栈
+    TC::SamplingThreadState* sampling = nullptr;
+    if (TC::sampling_enabled && TC::sampling_should_sample()) {
+        sampling = TC::sampling_thread_state();
+        if (!TC::sampling_arm(sampling, service)) {
+            sampling = nullptr;
+        }
+    }
+
+    apache::thrift::TProcessor* processor = binding->processor.get();
+    uint64_t started = (TC::stats_enabled || TC::slow_log_enabled) ? TC::monotonic_ns() : 0;
+    bool ok = false;
+    std::string failure;
+    TC::tls_dispatch_depth++;
+    if (ctx.persistent) {
+        ok = TC::run_processor(ctx, processor, protocol, failure);
+    } else {
+        // PHP 线程上输出写进请求内存，超过 memory_limit 时 Zend 经 longjmp 直接离开，
+        // 跳过下面的收尾和各个析构函数：先把本线程的状态恢复原样，再继续 bailout
+        zend_try {
+            ok = TC::run_processor(ctx, processor, protocol, failure);
+        } zend_catch {
+            TC::tls_dispatch_depth--;
+            if (sampling) {
+                TC::sampling_disarm(sampling);
+            }
+            ctx.input_transport->clear();
+            ctx.output_transport->discard();
+            if (protocol == TC::PROTOCOL_HEADER) {
+                ctx.header_protocol.reset();
+            }
+            TC::tls_call_profile = outer_profile;
+            TC::tls_probe_seqid = outer_probe_seqid;
+            landing.land(false, nullptr, 0, "Coalesced call was aborted.");
+            reader.leave();
+            ctx.in_use = false;
+            zend_bailout();
+        } zend_end_try();
+    }
+    TC::tls_dispatch_depth--;
+    if (sampling) {
+        TC::sampling_disarm(sampling);
+    }
+    ctx.input_transport->clear();
+    TC::tls_call_profile = outer_profile;
+    TC::tls_probe_seqid = outer_probe_seqid;
+
+    size_t output_len = ok ? ctx.output_transport->written() : 0;
+    THRIFT_BRIDGE_PROBE4(dispatch__return, service->name.c_str(), probe_seqid, ok, output_len);
+    uint64_t elapsed = started ? TC::monotonic_ns() - started : 0;
+    if (TC::stats_enabled) {
+        TC::stats_record_call(service, protocol, input_buf, input_len, ok, output_len, elapsed, profile);
+    }
+    // 失败或超过阈值的调用进入慢调用日志，由后台线程写出
+    if (TC::slow_log_enabled && (!ok || elapsed >= TC::slow_log_threshold_ns)) {
+        TC::slow_log_record(service, protocol, input_buf, input_len, ok, output_len, elapsed, failure, profile);
+    }
+    if (!ok) {
+        landing.land(false, nullptr, 0, failure);
+    }
+    if (error && !failure.empty()) {
+        error->swap(failure);
+    }
+
+    if (!ok) {
+        ctx.output_transport->discard();
+        // THeaderTransport 自带读写缓冲，失败的调用可能在其中留下半帧，丢弃后下次重建
+        if (protocol == TC::PROTOCOL_HEADER) {
+            ctx.header_protocol.reset();
+        }
+        return nullptr;
+    }
+
+    TC::update_hwm(service->output_hwm, ctx.output_transport->written());
+    zend_string* result = ctx.output_transport->release();
+    if (cache_method) {
+        TC::cache_store(cache_key, cache_method->ttl_ms, ZSTR_VAL(result), ZSTR_LEN(result), protocol);
+    }
+    landing.land(true, ZSTR_VAL(result), ZSTR_LEN(result), failure);
+    return result;
+}
+
+// 输入直接观察 (OBSERVE) 调用方的内存，输出写入新分配的 zend_string。
+// service 由调用方预先解析 (见 ThriftBridgeTransport::__construct)，调用路径上不再查表。
+// 成功时返回的 zend_string 由调用方释放；失败返回 nullptr。
+static zend_string* process_thrift_data_generic(
+    TC::ServiceEntry* service,
+    const char* input_buf, size_t input_len,
+    int protocol = TC::PROTOCOL_BINARY,
+    TC::CallProfile* profile = nullptr)
+{
+    if (input_len > UINT32_MAX) return nullptr;
+
+    // 请求内记忆：本请求已经执行过的相同调用直接返回它的响应
+    std::string memo_key;
+    if (TC::memo_enabled) {
+        if (protocol == TC::PROTOCOL_AUTO) {
+            protocol = TC::detect_protocol(input_buf, input_len);
+        }
+        zend_string* memoized = TC::memo_lookup(service, input_buf, input_len, protocol, memo_key);
+        if (memoized) {
+            return memoized;
+        }
+    }
+
+    zend_string* result;
+    TC::CallContext& ctx = TC::thread_call_context();
+    if (ctx.in_use) {
+        // 重入 (处理器内部再次发起调用) 时不能复用正在使用的上下文
+        TC::CallContext nested;
+        result = process_thrift_data_with_context(nested, service, input_buf, input_len, protocol, nullptr, profile);
+    } else {
+        ctx.in_use = true;
+        result = process_thrift_data_with_context(ctx, service, input_buf, input_len, protocol, nullptr, profile);
+        ctx.in_use = false;
+    }
+    if (result && !memo_key.empty()) {
+        TC::memo_store(memo_key, result, protocol);
+    }
+    return result;
+}
+
+namespace TC {
+// 批量调用中的一项
+struct BatchCall {
+    ServiceEntry* service;  // 未注册时为 nullptr
+    const char* input;
+    size_t input_len;
+    int protocol;
+    zend_string* response;  // 成功时由调用方接管
+    std::string error;
+};
+}
+
+// 一次进入核心库执行整批调用，共用同一个调用上下文，每项单独记录成功与否
+static void process_thrift_batch(std::vector<TC::BatchCall>& calls)
+{
+    TC::CallContext& shared = TC::thread_call_context();
+    std::unique_ptr<TC::CallContext> nested;
+    if (shared.in_use) {
+        nested.reset(new TC::CallContext());
+    }
+    TC::CallContext& ctx = nested ? *nested : shared;
+
+    ctx.in_use = true;
+    for (TC::BatchCall& call : calls) {
+        call.response = nullptr;
+        if (call.service == nullptr) {
+            if (call.error.empty()) {
+                call.error = "Service is not registered.";
+            }
+            continue;
+        }
+        if (call.input_len > UINT32_MAX) {
+            call.error = "Payload exceeds 4GB.";
+            continue;
+        }
+        std::string memo_key;
+        if (TC::memo_enabled) {
+            if (call.protocol == TC::PROTOCOL_AUTO) {
+                call.protocol = TC::detect_protocol(call.input, call.input_len);
+            }
+            call.response = TC::memo_lookup(call.service, call.input, call.input_len, call.protocol, memo_key);
+            if (call.response) {
+                continue;
+            }
+        }
+        call.response = process_thrift_data_with_context(ctx, call.service, call.input, call.input_len,
+                                                         call.protocol, &call.error);
+        if (call.response && !memo_key.empty()) {
+            TC::memo_store(memo_key, call.response, call.protocol);
+        }
+        if (call.response == nullptr && call.error.empty()) {
+            call.error = "CoreLib RPC failed or returned null.";
+        }
+    }
+    ctx.in_use = false;
+}
+
+namespace TC {
+// --- N. 异步调用 ---
+// flushAsync 把请求交给后台线程池执行，PHP 线程继续运行，需要结果时再 wait。
+// 工作线程上不能触碰 Zend 的请求内存 (emalloc 不是线程安全的)：请求复制一份交给工作线程；
+// 响应写入持久 (malloc) 的 zend_string，wait 时再交给 PHP。
+// 处理器 (及插件里的 handler) 会被多个线程同时调用，必须是线程安全的。
+struct AsyncCall : public apache::thrift::concurrency::Runnable {
+    ServiceEntry* service;
+    // 请求的副本：future 可能在调用完成之前被释放 (见 php_thrift_bridge_future_free_object)
+    std::string input;
+    int protocol;
+    // 发起时请求的剩余时间 (monotonic_ns，0 不限)，工作线程上读不到请求的状态
+    uint64_t deadline_ns;
+
+    // 以下字段由 async_monitor 保护
+    bool done;
+    bool abandoned;         // future 已释放，完成时由工作线程丢弃响应
+    zend_string* response;  // 持久分配，成功时非空
+    std::string error;
+
+    AsyncCall()
+        : service(nullptr), protocol(PROTOCOL_BINARY), deadline_ns(0),
+          done(false), abandoned(false), response(nullptr) {}
+
+    void run() override;
+};
+
+// 所有异步调用共用一个监视器，waitAny 可以同时等待多个调用
+static apache::thrift::concurrency::Monitor async_monitor;
+static std::shared_ptr<apache::thrift::concurrency::ThreadManager> async_pool;
+
+// 线程池在第一次异步调用时才启动：此时已在 fork 出的工作进程内，线程不会丢失
+static apache::thrift::concurrency::ThreadManager* async_thread_pool(size_t threads) {
+    if (!async_pool) {
+        using apache::thrift::concurrency::ThreadFactory;
+        using apache::thrift::concurrency::ThreadManager;
+        std::shared_ptr<ThreadManager> pool = ThreadManager::newSimpleThreadManager(threads ? threads : 1);
+        // 非分离线程，MSHUTDOWN 时 stop() 逐个 join
+        pool->threadFactory(std::make_shared<ThreadFactory>(false));
+        pool->start();
+        async_pool = pool;
+    }
+    return async_pool.get();
+}
+
+// fork 出的子进程里父进程的工作线程已不存在，stop() 会一直等下去：
+// 直接放弃旧的线程池对象 (只泄漏一次)，下一次异步调用时重新启动
+static void abandon_async_thread_pool() {
+    if (async_pool) {
+        new std::shared_ptr<apache::thrift::concurrency::ThreadManager>(std::move(async_pool));
+    }
+}
+
+static void stop_async_thread_pool() {
+    if (async_pool) {
+        async_pool->stop();
+        async_pool.reset();
+    }
+}
+
+}
+
+void TC::AsyncCall::run() {
+    CallContext& ctx = thread_call_context();
+    ctx.persistent = true;
+
+    std::string message;
+    zend_string* result = process_thrift_data_with_context(ctx, service, input.data(), input.size(), protocol,
+                                                           &message, nullptr, deadline_ns);
+    if (result == nullptr && message.empty()) {
+        message = "CoreLib RPC failed or returned null.";
+    }
+
+    apache::thrift::concurrency::Synchronized guard(async_monitor);
+    if (abandoned) {
+        if (result) {
+            zend_string_free(result);
+        }
+        done = true;
+        return;
+    }
+    response = result;
+    error.swap(message);
+    done = true;
+    async_monitor.notifyAll();
+}
+
+namespace TC {
+// --- O. IDL 描述驱动的编解码 ---
+// ThriftBridgeClient 使用：按插件导出的类型描述把 PHP 数组/对象直接编码成 Thrift 消息，
+// 并把响应解码回 PHP 数组，PHP 端不再需要生成代码和 apache/thrift 库。
+// 编解码失败时抛出 TProtocolException，由调用方在 PHP 边界转换成 PHP 异常。
+static const int kMaxCodecDepth = 64;
+
+[[noreturn]] static void codec_error(const std::string& message) {
+    throw apache::thrift::protocol::TProtocolException(
+        apache::thrift::protocol::TProtocolException::INVALID_DATA, message);
+}
+
+// 按字段描述从 PHP 数组或对象中取值，取不到时返回 nullptr
+static zval* struct_field_value(CompiledStruct* spec, size_t index, zval* container) {
+    const CompiledField& field = spec->fields[index];
+    zval* value = nullptr;
+
+    if (Z_TYPE_P(container) == IS_ARRAY) {
+        value = zend_hash_find(Z_ARRVAL_P(container), field.name);
+    } else if (Z_TYPE_P(container) == IS_OBJECT) {
+        zend_object* obj = Z_OBJ_P(container);
+        if (spec->slots_index >= tls_class_slots.size()) {
+            tls_class_slots.resize(spec->slots_index + 1);
+        }
+        std::vector<uint32_t>& slots = tls_class_slots[spec->slots_index][obj->ce];
+        if (slots.empty() && !spec->fields.empty()) {
+            // 每个类第一次出现时解析一次属性偏移，之后直接按槽位读取
+            slots.resize(spec->fields.size(), 0);
+            for (size_t i = 0; i < spec->fields.size(); i++) {
+                zend_property_info* info = zend_get_property_info(obj->ce, spec->fields[i].name, 1);
+                if (info && info != ZEND_WRONG_PROPERTY_INFO
+                    && (info->flags & ZEND_ACC_PUBLIC) && !(info->flags & ZEND_ACC_STATIC)) {
+                    slots[i] = info->offset;
+                }
+            }
+        }
+        if (slots[index]) {
+            value = OBJ_PROP(obj, slots[index]);
+        } else if (obj->properties) {
+            // 动态属性
+            value = zend_hash_find_ind(obj->properties, field.name);
+        }
+    }
+
+    if (value) {
+        ZVAL_DEREF(value);
+        if (Z_TYPE_P(value) == IS_UNDEF || Z_TYPE_P(value) == IS_NULL) {
+            value = nullptr;
+        }
+    }
+    return value;
+}
+
+template <class Protocol_>
+class SpecCodec {
+public:
+    explicit SpecCodec(Protocol_& protocol) : protocol_(protocol) {}
+
+    void writeValue(const CompiledType* type, zval* value, int depth) {
+        using namespace apache::thrift::protocol;
+        if (depth > kMaxCodecDepth) {
+            codec_error("Nesting too deep.");
+        }
+        ZVAL_DEREF(value);
+
+        switch (type->type) {
+        case T_BOOL:
+            protocol_.writeBool(zend_is_true(value));
+            break;
+        case T_BYTE:
+            protocol_.writeByte((int8_t)zval_get_long(value));
+            break;
+        case T_I16:
+            protocol_.writeI16((int16_t)zval_get_long(value));
+            break;
+        case T_I32:
+            protocol_.writeI32((int32_t)zval_get_long(value));
+            break;
+        case T_I64:
+            protocol_.writeI64((int64_t)zval_get_long(value));
+            break;
+        case T_DOUBLE:
+            protocol_.writeDouble(zval_get_double(value));
+            break;
+        case T_STRING: {
+            zend_string* tmp = zval_get_string(value);
+            scratch_.assign(ZSTR_VAL(tmp), ZSTR_LEN(tmp));
+            zend_string_release(tmp);
+            protocol_.writeBinary(scratch_);
+            break;
+        }
+        case T_STRUCT:
+            writeStruct(type->struct_type, value, depth + 1);
+            break;
+        case T_LIST:
+        case T_SET: {
+            if (Z_TYPE_P(value) != IS_ARRAY) {
+                codec_error("Expected array for list/set.");
+            }
+            HashTable* ht = Z_ARRVAL_P(value);
+            zval* elem;
+            if (type->type == T_LIST) {
+                protocol_.writeListBegin(type->value->type, zend_hash_num_elements(ht));
+            } else {
+                protocol_.writeSetBegin(type->value->type, zend_hash_num_elements(ht));
+            }
+            ZEND_HASH_FOREACH_VAL(ht, elem) {
+                writeValue(type->value, elem, depth + 1);
+            } ZEND_HASH_FOREACH_END();
+            if (type->type == T_LIST) {
+                protocol_.writeListEnd();
+            } else {
+                protocol_.writeSetEnd();
+            }
+            break;
+        }
+        case T_MAP: {
+            if (Z_TYPE_P(value) != IS_ARRAY) {
+                codec_error("Expected array for map.");
+            }
+            HashTable* ht = Z_ARRVAL_P(value);
+            zend_ulong num_key;
+            zend_string* str_key;
+            zval* elem;
+            protocol_.writeMapBegin(type->key->type, type->value->type, zend_hash_num_elements(ht));
+            ZEND_HASH_FOREACH_KEY_VAL(ht, num_key, str_key, elem) {
+                zval key;
+                if (str_key) {
+                    ZVAL_STR(&key, str_key);
+                } else {
+                    ZVAL_LONG(&key, (zend_long)num_key);
+                }
+                writeValue(type->key, &key, depth + 1);
+                writeValue(type->value, elem, depth + 1);
+            } ZEND_HASH_FOREACH_END();
+            protocol_.writeMapEnd();
+            break;
+        }
+        default:
+            codec_error("Unsupported field type " + std::to_string((int)type->type) + ".");
+        }
+    }
+
+    void writeStruct(CompiledStruct* spec, zval* value, int depth) {
+        if (Z_TYPE_P(value) != IS_ARRAY && Z_TYPE_P(value) != IS_OBJECT) {
+            codec_error("Expected array or object for struct " + spec->name + ".");
+        }
+        protocol_.writeStructBegin(spec->name.c_str());
+        for (size_t i = 0; i < spec->fields.size(); i++) {
+            const CompiledField& field = spec->fields[i];
+            zval* field_value = struct_field_value(spec, i, value);
+            if (field_value == nullptr) {
+                if (field.required) {
+                    codec_error("Required field " + spec->name + "." + ZSTR_VAL(field.name) + " is unset.");
+                }
+                continue;
+            }
+            protocol_.writeFieldBegin(ZSTR_VAL(field.name), field.type->type, field.id);
+            writeValue(field.type, field_value, depth);
+            protocol_.writeFieldEnd();
+        }
+        protocol_.writeFieldStop();
+        protocol_.writeStructEnd();
+    }
+
+    // 参数按位置对应 xxx_args 的字段
+    void writeArgs(CompiledStruct* spec, HashTable* arguments) {
+        protocol_.writeStructBegin(spec->name.c_str());
+        for (size_t i = 0; i < spec->fields.size(); i++) {
+            const CompiledField& field = spec->fields[i];
+            zval* arg = zend_hash_index_find(arguments, i);
+            if (arg) {
+                ZVAL_DEREF(arg);
+            }
+            if (arg == nullptr || Z_TYPE_P(arg) == IS_NULL) {
+                if (field.required) {
+                    codec_error("Missing required argument " + std::string(ZSTR_VAL(field.name)) + ".");
+                }
+                continue;
+            }
+            protocol_.writeFieldBegin(ZSTR_VAL(field.name), field.type->type, field.id);
+            writeValue(field.type, arg, 0);
+            protocol_.writeFieldEnd();
+        }
+        protocol_.writeFieldStop();
+        protocol_.writeStructEnd();
+    }
+
+    // out 由调用方提供，失败时可能已经部分填充，调用方负责 zval_ptr_dtor
+    void readValue(const CompiledType* type, zval* out, int depth) {
+        using namespace apache::thrift::protocol;
+        if (depth > kMaxCodecDepth) {
+            codec_error("Nesting too deep.");
+        }
+
+        switch (type->type) {
+        case T_BOOL: {
+            bool v;
+            protocol_.readBool(v);
+            ZVAL_BOOL(out, v);
+            break;
+        }
+        case T_BYTE: {
+            int8_t v;
+            protocol_.readByte(v);
+            ZVAL_LONG(out, v);
+            break;
+        }
+        case T_I16: {
+            int16_t v;
+            protocol_.readI16(v);
+            ZVAL_LONG(out, v);
+            break;
+        }
+        case T_I32: {
+            int32_t v;
+            protocol_.readI32(v);
+            ZVAL_LONG(out, v);
+            break;
+        }
+        case T_I64: {
+            int64_t v;
+            protocol_.readI64(v);
+            ZVAL_LONG(out, (zend_long)v);
+            break;
+        }
+        case T_DOUBLE: {
+            double v;
+            protocol_.readDouble(v);
+            ZVAL_DOUBLE(out, v);
+            break;
+        }
+        case T_STRING:
+            protocol_.readBinary(scratch_);
+            ZVAL_STRINGL(out, scratch_.data(), scratch_.size());
+            break;
+        case T_STRUCT:
+            readStruct(type->struct_type, out, depth + 1);
+            break;
+        case T_LIST:
+        case T_SET: {
+            TType elem_type;
+            uint32_t size;
+            if (type->value == nullptr) {
+                codec_error("Container spec without an element type.");
+            }
+            if (type->type == T_LIST) {
+                protocol_.readListBegin(elem_type, size);
+            } else {
+                protocol_.readSetBegin(elem_type, size);
+            }
+            // 与结构体字段不同，容器元素类型不符时无法跳过单个元素，按描述读下去只会读错
+            if (size > 0 && elem_type != type->value->type) {
+                codec_error("Element type " + std::to_string((int)elem_type) + " does not match the spec ("
+                            + std::to_string((int)type->value->type) + ").");
+            }
+            array_init_size(out, size < 4096 ? size : 4096);
+            for (uint32_t i = 0; i < size; i++) {
+                zval elem;
+                ZVAL_NULL(&elem);
+                readValue(type->value, zend_hash_next_index_insert_new(Z_ARRVAL_P(out), &elem), depth + 1);
+            }
+            if (type->type == T_LIST) {
+                protocol_.readListEnd();
+            } else {
+                protocol_.readSetEnd();
+            }
+            break;
+        }
+        case T_MAP: {
+            TType key_type, value_type;
+            uint32_t size;
+            if (type->key == nullptr || type->value == nullptr) {
+                codec_error("Map spec without a key or value type.");
+            }
+            protocol_.readMapBegin(key_type, value_type, size);
+            if (size > 0 && (key_type != type->key->type || value_type != type->value->type)) {
+                codec_error("Map key/value types " + std::to_string((int)key_type) + "/" + std::to_string((int)value_type)
+                            + " do not match the spec (" + std::to_string((int)type->key->type) + "/"
+                            + std::to_string((int)type->value->type) + ").");
+            }
+            array_init_size(out, size < 4096 ? size : 4096);
+            for (uint32_t i = 0; i < size; i++) {
+                zval key, elem;
+                ZVAL_NULL(&key);
+                readValue(type->key, &key, depth + 1);
+                ZVAL_NULL(&elem);
+                zval* slot;
+                if (Z_TYPE(key) == IS_STRING) {
+                    slot = zend_symtable_update(Z_ARRVAL_P(out), Z_STR(key), &elem);
+                } else if (Z_TYPE(key) == IS_LONG || Z_TYPE(key) == IS_DOUBLE || Z_TYPE(key) == IS_TRUE || Z_TYPE(key) == IS_FALSE) {
+                    slot = zend_hash_index_update(Z_ARRVAL_P(out), zval_get_long(&key), &elem);
+                } else {
+                    zval_ptr_dtor(&key);
+                    codec_error("Unsupported map key type.");
+                }
+                zval_ptr_dtor(&key);
+                readValue(type->value, slot, depth + 1);
+            }
+            protocol_.readMapEnd();
+            break;
+        }
+        default:
+            codec_error("Unsupported field type " + std::to_string((int)type->type) + ".");
+        }
+    }
+
+    void readStruct(CompiledStruct* spec, zval* out, int depth) {
+        using namespace apache::thrift::protocol;
+        std::string fname;
+        TType ftype;
+        int16_t fid;
+        size_t cursor = 0;
+
+        array_init(out);
+        protocol_.readStructBegin(fname);
+        while (true) {
+            protocol_.readFieldBegin(fname, ftype, fid);
+            if (ftype == T_STOP) {
+                break;
+            }
+            const CompiledField* field = spec->findField(fid, cursor);
+            if (field == nullptr || field->type->type != ftype) {
+                // 描述之外的字段 (例如服务端较新的 IDL) 直接跳过
+                protocol_.skip(ftype);
+            } else {
+                zval elem;
+                ZVAL_NULL(&elem);
+                readValue(field->type, zend_hash_update(Z_ARRVAL_P(out), field->name, &elem), depth);
+            }
+            protocol_.readFieldEnd();
+        }
+        protocol_.readStructEnd();
+    }
+
+private:
+    Protocol_& protocol_;
+    std::string scratch_;
+};
+
+// 编解码专用的缓冲区与协议，每线程一份
+struct CodecContext {
+    std::shared_ptr<ObservingBuffer> input_transport;
+    std::shared_ptr<ZendStringBuffer> output_transport;
+    std::shared_ptr<BinaryProtocol> input_protocol;
+    std::shared_ptr<BinaryProtocol> output_protocol;
+
+    CodecContext()
+        : input_transport(new ObservingBuffer()),
+          output_transport(new ZendStringBuffer()),
+          input_protocol(new BinaryProtocol(input_transport)),
+          output_protocol(new BinaryProtocol(output_transport)) {
+    }
+};
+
+static CodecContext& thread_codec_context() {
+    static thread_local CodecContext context;
+    return context;
+}
+
+// 把一次方法调用编码成请求消息，返回的 zend_string 由调用方释放
+static zend_string* encode_call(CompiledMethod* method, HashTable* arguments) {
+    CodecContext& ctx = thread_codec_context();
+    SpecCodec<BinaryProtocol> codec(*ctx.output_protocol);
+
+    ctx.output_transport->begin(method->request_hwm.load(std::memory_order_relaxed));
+    try {
+        ctx.output_protocol->writeMessageBegin(method->name,
+            method->result ? apache::thrift::protocol::T_CALL : apache::thrift::protocol::T_ONEWAY, 0);
+        codec.writeArgs(method->args, arguments);
+        ctx.output_protocol->writeMessageEnd();
+    } catch (...) {
+        ctx.output_transport->discard();
+        throw;
+    }
+    update_hwm(method->request_hwm, ctx.output_transport->written());
+    return ctx.output_transport->release();
+}
+
+// 解码响应消息中的 xxx_result 结构体到 out (数组)
+static void decode_reply(CompiledMethod* method, zend_string* response, zval* out) {
+    CodecContext& ctx = thread_codec_context();
+    SpecCodec<BinaryProtocol> codec(*ctx.input_protocol);
+    std::string fname;
+    apache::thrift::protocol::TMessageType mtype;
+    int32_t seqid;
+
+    ctx.input_transport->observe(ZSTR_VAL(response), (uint32_t)ZSTR_LEN(response));
+    try {
+        ctx.input_protocol->readMessageBegin(fname, mtype, seqid);
+        if (mtype == apache::thrift::protocol::T_EXCEPTION) {
+            apache::thrift::TApplicationException x;
+            x.read(ctx.input_protocol.get());
+            throw x;
+        }
+        codec.readStruct(method->result, out, 0);
+        ctx.input_protocol->readMessageEnd();
+    } catch (...) {
+        ctx.input_transport->clear();
+        throw;
+    }
+    ctx.input_transport->clear();
+}
+
+}
+
+ZEND_BEGIN_MODULE_GLOBALS(thrift_bridge)
+    char *plugin_dir;
+    // 异步调用线程池的线程数，线程池启动后修改不再生效
+    zend_long async_threads;
+    // 默认协议及按服务覆盖的协议，见 php_thrift_bridge_service_protocol
+    char *protocol;
+    // 在 MINIT 中加载插件 (FPM master fork 之前)，子进程以写时复制共享
+    zend_bool preload;
+    // 是否记录调用统计 (thrift_bridge_stats)
+    zend_bool stats;
+    // 统计共享内存的文件路径 (为空时使用匿名共享映射) 与槽位数 (0 自动)
+    char *metrics_file;
+    zend_long metrics_slots;
+    // 是否记录每次调用的分阶段耗时 (thrift_bridge_last_call_profile)
+    zend_bool profile;
+    // 是否监视插件目录，插件文件被替换时自动重新加载
+    zend_bool watch_plugins;
+    // 合并同时进行的相同调用的方法，形如 "ConfigService.get_config, LookupService.*"
+    char *coalesce;
+    // 同一请求内记忆调用结果的方法，格式同 coalesce
+    char *memoize;
+    // 旁车守护进程的 Unix socket 路径 (为空时在本进程内加载插件) 与收发超时 (毫秒)
+    char *sidecar;
+    zend_long sidecar_timeout;
+    // 每个线程与守护进程共享的环形缓冲区大小 (字节，每个方向一个；0 只用 socket)
+    zend_long sidecar_ring;
+    // 共享响应缓存的总字节数 (0 关闭) 与单个缓存项 (键与响应) 的上限
+    zend_long cache_size;
+    zend_long cache_entry_max;
+    // 慢调用日志的文件路径 (为空时关闭)、阈值 (毫秒) 与请求内容的记录字节数
+    char *slow_log;
+    double slow_log_threshold;
+    zend_long slow_log_dump_bytes;
+    // 处理器调用栈采样：抽样比例 (0 关闭)、采样间隔 (微秒，线程 CPU 时间) 与信号触发转储时的输出目录
+    double sampling_rate;
+    zend_long sampling_interval;
+    char *sampling_dir;
+ZEND_END_MODULE_GLOBALS(thrift_bridge)
+ZEND_DECLARE_MODULE_GLOBALS(thrift_bridge)
+// thrift_bridge.protocol 解析后的结果 (见 php_thrift_bridge_service_protocol)。配置可以被 ini_set 修改，
+// 修改 (及请求结束时的恢复) 都在当前线程执行 OnUpdateProtocol，因此每线程记一个版本号，变化后才重新解析
+struct ProtocolConfig {
+    bool parsed = false;
+    uint64_t generation = 0;
+    int fallback = TC::PROTOCOL_BINARY;
+    std::unordered_map<std::string, int> services;
+};
+static thread_local uint64_t tls_protocol_generation = 0;
+static thread_local ProtocolConfig tls_protocol_config;
+
+static ZEND_INI_MH(OnUpdateProtocol)
+{
+    tls_protocol_generation++;
+    return OnUpdateString(entry, new_value, mh_arg1, mh_arg2, mh_arg3, stage);
+}
+
+PHP_INI_BEGIN()
+    STD_PHP_INI_ENTRY("thrift_bridge.plugin_dir", "./plugins", PHP_INI_ALL, OnUpdateString, plugin_dir, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.async_threads", "4", PHP_INI_SYSTEM, OnUpdateLong, async_threads, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.protocol", "binary", PHP_INI_ALL, OnUpdateProtocol, protocol, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_BOOLEAN("thrift_bridge.preload", "0", PHP_INI_SYSTEM, OnUpdateBool, preload, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_BOOLEAN("thrift_bridge.stats", "1", PHP_INI_SYSTEM, OnUpdateBool, stats, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.metrics_file", "", PHP_INI_SYSTEM, OnUpdateString, metrics_file, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.metrics_slots", "0", PHP_INI_SYSTEM, OnUpdateLong, metrics_slots, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_BOOLEAN("thrift_bridge.profile", "0", PHP_INI_SYSTEM, OnUpdateBool, profile, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_BOOLEAN("thrift_bridge.watch_plugins", "0", PHP_INI_SYSTEM, OnUpdateBool, watch_plugins, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.coalesce", "", PHP_INI_SYSTEM, OnUpdateString, coalesce, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.memoize", "", PHP_INI_SYSTEM, OnUpdateString, memoize, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.sidecar", "", PHP_INI_SYSTEM, OnUpdateString, sidecar, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.sidecar_timeout", "5000", PHP_INI_SYSTEM, OnUpdateLong, sidecar_timeout, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.sidecar_ring", "0", PHP_INI_SYSTEM, OnUpdateLong, sidecar_ring, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.cache_size", "0", PHP_INI_SYSTEM, OnUpdateLong, cache_size, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.cache_entry_max", "4096", PHP_INI_SYSTEM, OnUpdateLong, cache_entry_max, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.slow_log", "", PHP_INI_SYSTEM, OnUpdateString, slow_log, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.slow_log_threshold", "100", PHP_INI_SYSTEM, OnUpdateReal, slow_log_threshold, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.slow_log_dump_bytes", "64", PHP_INI_SYSTEM, OnUpdateLong, slow_log_dump_bytes, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.sampling_rate", "0", PHP_INI_SYSTEM, OnUpdateReal, sampling_rate, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.sampling_interval", "1000", PHP_INI_SYSTEM, OnUpdateLong, sampling_interval, zend_thrift_bridge_globals, thrift_bridge_globals)
+    STD_PHP_INI_ENTRY("thrift_bridge.sampling_dir", "/tmp", PHP_INI_SYSTEM, OnUpdateString, sampling_dir, zend_thrift_bridge_globals, thrift_bridge_globals)
+PHP_INI_END()
+#ifdef ZTS
+#define THRIFT_BRIDGE_G(v) ZEND_MODULE_GLOBALS_ACCESSOR(thrift_bridge, v)
+#else
+#define THRIFT_BRIDGE_G(v) (thrift_bridge_globals.v)
+#endif
+static void php_thrift_bridge_init_globals(zend_thrift_bridge_globals *globals)
+{
+    // globals->plugin_dir = NULL;
+}
+
+// 按 thrift_bridge.protocol 确定服务使用的协议。取值形如 "binary" 或
+// "auto, DynamicServiceA=compact, DynamicServiceB=header"：不带服务名的一项是默认值，
+// 带服务名的项只作用于该服务。无法识别的项忽略，都没有时使用 binary。
+static void php_thrift_bridge_parse_protocols(const char *p, ProtocolConfig &config)
+{
+    config.fallback = TC::PROTOCOL_BINARY;
+    config.services.clear();
+
+    while (p && *p) {
+        const char *end = strchr(p, ',');
+        if (end == NULL) {
+            end = p + strlen(p);
+        }
+        while (p < end && isspace((unsigned char)*p)) p++;
+        const char *item_end = end;
+        while (item_end > p && isspace((unsigned char)item_end[-1])) item_end--;
+
+        const char *eq = (const char *)memchr(p, '=', item_end - p);
+        if (eq == NULL) {
+            int protocol = TC::parse_protocol(p, item_end - p);
+            if (protocol >= 0) {
+                config.fallback = protocol;
+            }
+        } else {
+            const char *key_end = eq;
+            while (key_end > p && isspace((unsigned char)key_end[-1])) key_end--;
+            const char *value = eq + 1;
+            while (value < item_end && isspace((unsigned char)*value)) value++;
+            int protocol = TC::parse_protocol(value, item_end - value);
+            if (protocol >= 0) {
+                // 同一服务出现多次时以第一项为准
+                config.services.emplace(std::string(p, key_end - p), protocol);
+            }
+        }
+        p = *end ? end + 1 : end;
+    }
+}
+
+static int php_thrift_bridge_service_protocol(const char *name, size_t name_len)
+{
+    ProtocolConfig &config = tls_protocol_config;
+    if (!config.parsed || config.generation != tls_protocol_generation) {
+        php_thrift_bridge_parse_protocols(THRIFT_BRIDGE_G(protocol), config);
+        config.parsed = true;
+        config.generation = tls_protocol_generation;
+    }
+    if (!config.services.empty()) {
+        auto it = config.services.find(std::string(name, name_len));
+        if (it != config.services.end()) {
+            return it->second;
+        }
+    }
+    return config.fallback;
+}
+
+// --- 类结构体定义 ---
+typedef struct _php_thrift_bridge_transport_object {
+    // 存储 serviceName (当前调用的目标 Service 名称)
+    zend_string *serviceName; 
+
+    // 构造时解析好的服务条目，未注册时为 NULL
+    TC::ServiceEntry *service;
+    
+    // 存储 wBuf (写入缓冲区)，跨多次调用复用
+    // 注意：ZSTR_LEN(wBuf) 记录的是容量，已写入的长度在 wBufLen 中
+    zend_string *wBuf;
+    size_t wBufLen;
+
+    // 存储 rBuf (读取缓冲区)
+    zend_string *rBuf;
+    
+    // 存储 rBufPos (读取缓冲区当前位置)
+    zend_long rBufPos;
+
+    // 处理器两端使用的协议 (TC::Protocol)，构造时确定
+    int protocol;
+
+    // 异步模式 (setAsync)：flush() 改为提交到线程池，read() 时再等待响应
+    zend_bool async;
+
+    // 最近一次异步调用的 ThriftBridgeFuture (持有引用)，响应取回后清空
+    zend_object *pending;
+
+    // 分阶段计时 (thrift_bridge.profile)：本次调用第一次 write() 的时间点，
+    // 以及 flush() 返回的时间点 (响应尚未被 read() 取完时非 0)
+    uint64_t write_started;
+    uint64_t read_started;
+    TC::CallProfile profile;
+    
+    // Zend 引擎要求必须包含 zend_object
+    zend_object std; 
+} php_thrift_bridge_transport_object;
+
+zend_class_entry *thrift_bridge_transport_ce;
+zend_class_entry *thrift_transport_exception_ce;
+static zend_object_handlers thrift_bridge_handlers;
+
+// --- 辅助宏：用于从 zend_object 获取自定义结构体 ---
+static zend_always_inline php_thrift_bridge_transport_object *php_thrift_bridge_transport_fetch_object(zend_object *obj) {
+    // 通过结构体成员的偏移量计算自定义结构体的起始地址
+    return (php_thrift_bridge_transport_object *)((char *)(obj) - XtOffsetOf(php_thrift_bridge_transport_object, std));
+}
+
+static void php_thrift_bridge_transport_detach_pending(php_thrift_bridge_transport_object *intern);
+
+static void php_thrift_bridge_transport_dtor_object(zend_object *object)
+{
+    php_thrift_bridge_transport_object *intern = php_thrift_bridge_transport_fetch_object(object);
+    
+    if (intern->serviceName) {
+        zend_string_release(intern->serviceName);
+    }
+    if (intern->wBuf) {
+        zend_string_release(intern->wBuf);
+    }
+    if (intern->rBuf) {
+        zend_string_release(intern->rBuf);
+    }
+    php_thrift_bridge_transport_detach_pending(intern);
+    
+    // 调用父类的析构函数
+    zend_objects_destroy_object(object);
+}
+
+// 对象的创建函数：为 Zend 对象分配自定义结构体
 static zend_object *php_thrift_bridge_transport_create_object(zend_class_entry *ce)
 {
-    php_thrift_bridge_transport_object *intern;
+    php_thrift_bridge_transport_object *intern;
+
+    // 分配内存
+    intern = (php_thrift_bridge_transport_object *) 
+        emalloc(sizeof(php_thrift_bridge_transport_object) + zend_object_properties_size(ce));
+    zend_object_std_init(&intern->std, ce);
+
+    // 【删除原有的两行错误代码】
+    // intern->std.handlers 指向我们全局静态的、可写的 handlers
+    intern->std.handlers = &thrift_bridge_handlers; // <--- 关键修正
+    // 初始化属性
+    intern->serviceName = NULL;
+    intern->service = NULL;
+    intern->wBuf = NULL;
+    intern->wBufLen = 0;
+    intern->rBuf = NULL;
+    intern->rBufPos = 0;
+    intern->protocol = TC::PROTOCOL_BINARY;
+    intern->async = 0;
+    intern->pending = NULL;
+    intern->write_started = 0;
+    intern->read_started = 0;
+    intern->profile.id = 0;
+    
+    return &intern->std;
+}
+
+// 向 wBuf 追加数据：容量不足时按 2 倍扩容，摊还 O(1)。
+// PHP 端协议每个字段调用一次 write，逐次重新分配会让大列表的序列化退化成平方复杂度。
+static void php_thrift_bridge_transport_wbuf_append(php_thrift_bridge_transport_object *intern, const char *data, size_t len)
+{
+    size_t need = intern->wBufLen + len;
+
+    if (intern->wBuf == NULL || need > ZSTR_LEN(intern->wBuf)) {
+        size_t capacity = intern->wBuf ? ZSTR_LEN(intern->wBuf) * 2 : 256;
+        if (capacity < need) {
+            capacity = need;
+        }
+        intern->wBuf = intern->wBuf ? zend_string_extend(intern->wBuf, capacity, 0)
+                                    : zend_string_alloc(capacity, 0);
+    }
+
+    memcpy(ZSTR_VAL(intern->wBuf) + intern->wBufLen, data, len);
+    intern->wBufLen = need;
+}
+
+// --- ThriftBridgeClient：按 IDL 描述在 C 层编解码的原生客户端 ---
+typedef struct _php_thrift_bridge_client_object {
+    zend_string *serviceName;
+
+    // 构造时解析好的服务条目，未注册时为 NULL
+    TC::ServiceEntry *service;
+
+    zend_object std;
+} php_thrift_bridge_client_object;
+
+zend_class_entry *thrift_bridge_client_ce;
+zend_class_entry *thrift_bridge_exception_ce;
+static zend_object_handlers thrift_bridge_client_handlers;
+
+static zend_always_inline php_thrift_bridge_client_object *php_thrift_bridge_client_fetch_object(zend_object *obj) {
+    return (php_thrift_bridge_client_object *)((char *)(obj) - XtOffsetOf(php_thrift_bridge_client_object, std));
+}
+
+static void php_thrift_bridge_client_free_object(zend_object *object)
+{
+    php_thrift_bridge_client_object *intern = php_thrift_bridge_client_fetch_object(object);
+
+    if (intern->serviceName) {
+        zend_string_release(intern->serviceName);
+    }
+    zend_object_std_dtor(object);
+}
+
+static zend_object *php_thrift_bridge_client_create_object(zend_class_entry *ce)
+{
+    php_thrift_bridge_client_object *intern = (php_thrift_bridge_client_object *)
+        emalloc(sizeof(php_thrift_bridge_client_object) + zend_object_properties_size(ce));
+    zend_object_std_init(&intern->std, ce);
+    object_properties_init(&intern->std, ce);
+
+    intern->std.handlers = &thrift_bridge_client_handlers;
+    intern->serviceName = NULL;
+    intern->service = NULL;
+
+    return &intern->std;
+}
+
+// --- ThriftBridgeFuture：flushAsync 返回的异步调用句柄 ---
+typedef struct _php_thrift_bridge_future_object {
+    // 与线程池共享的调用状态 (对象内存由 emalloc 分配，这里用 placement new 构造)
+    std::shared_ptr<TC::AsyncCall> call;
+
+    // 发起调用的 ThriftBridgeTransport，wait() 成功后把响应装入其 rBuf。
+    // 不持有引用 (transport 持有 future)，transport 析构或发起新调用时清空
+    zend_object *transport;
+
+    // wait() 取回并拷贝到请求内存后的响应
+    zend_string *result;
+
+    zend_object std;
+} php_thrift_bridge_future_object;
+
+zend_class_entry *thrift_bridge_future_ce;
+static zend_object_handlers thrift_bridge_future_handlers;
+
+static zend_always_inline php_thrift_bridge_future_object *php_thrift_bridge_future_fetch_object(zend_object *obj) {
+    return (php_thrift_bridge_future_object *)((char *)(obj) - XtOffsetOf(php_thrift_bridge_future_object, std));
+}
+
+// wait()/waitAll()/waitAny() 的截止时间，取 $timeout (秒，null 不限) 与请求剩余时间中较早的一个。
+// Linux 上 max_execution_time 按 CPU 时间计，阻塞等待期间不会触发，这里按请求开始后的墙钟时间补上。
+// 没有任何限制时返回 false
+static bool php_thrift_bridge_future_deadline(double timeout, bool has_timeout,
+                                              std::chrono::steady_clock::time_point *deadline)
+{
+    double wait_for = has_timeout ? (timeout > 0 ? timeout : 0) : -1;
+    zend_long limit = EG(timeout_seconds);
+    if (limit > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        double remaining = sapi_get_request_time() + (double)limit - (now.tv_sec + now.tv_nsec / 1e9);
+        remaining = remaining > 0 ? remaining : 0;
+        if (wait_for < 0 || remaining < wait_for) {
+            wait_for = remaining;
+        }
+    }
+    if (wait_for < 0) {
+        return false;
+    }
+    *deadline = std::chrono::steady_clock::now()
+        + std::chrono::microseconds((int64_t)(wait_for > 1e9 ? 1e15 : wait_for * 1e6));
+    return true;
+}
 
-    // 分配内存
-    intern = (php_thrift_bridge_transport_object *) 
-        emalloc(sizeof(php_thrift_bridge_transport_object) + zend_object_properties_size(ce));
+// 在 async_monitor 下调用：等到 ready() 为真，超过截止时间时抛出异常并返回 false
+template <class Ready>
+static bool php_thrift_bridge_future_wait_until(bool has_deadline, std::chrono::steady_clock::time_point deadline,
+                                                Ready ready)
+{
+    while (!ready()) {
+        if (!has_deadline) {
+            TC::async_monitor.waitForever();
+        } else if (std::chrono::steady_clock::now() >= deadline) {
+            zend_throw_exception_ex(NULL, 0, "Timed out waiting for ThriftBridgeFuture.");
+            return false;
+        } else {
+            TC::async_monitor.waitForTime(deadline);
+        }
+    }
+    return true;
+}
+
+static void php_thrift_bridge_future_free_object(zend_object *object)
+{
+    php_thrift_bridge_future_object *intern = php_thrift_bridge_future_fetch_object(object);
+
+    if (intern->call) {
+        // 不等待未完成的调用 (wait() 可能刚因超时放弃)：工作线程只用自己的请求副本，
+        // 标记为放弃后由它在完成时丢弃响应
+        apache::thrift::concurrency::Synchronized guard(TC::async_monitor);
+        if (intern->call->done) {
+            if (intern->call->response) {
+                zend_string_free(intern->call->response);
+                intern->call->response = NULL;
+            }
+        } else {
+            intern->call->abandoned = true;
+        }
+    }
+    intern->call.~shared_ptr();
+
+    if (intern->result) {
+        zend_string_release(intern->result);
+    }
+    zend_object_std_dtor(object);
+}
+
+static zend_object *php_thrift_bridge_future_create_object(zend_class_entry *ce)
+{
+    php_thrift_bridge_future_object *intern = (php_thrift_bridge_future_object *)
+        emalloc(sizeof(php_thrift_bridge_future_object) + zend_object_properties_size(ce));
     zend_object_std_init(&intern->std, ce);
+    object_properties_init(&intern->std, ce);
 
-    // 【删除原有的两行错误代码】
-    // intern->std.handlers 指向我们全局静态的、可写的 handlers
-    intern->std.handlers = &thrift_bridge_handlers; // <--- 关键修正
-    // 初始化属性
-    intern->serviceName = NULL;
-    intern->wBuf = NULL;
-    intern->rBuf = NULL;
-    intern->rBufPos = 0;
+    intern->std.handlers = &thrift_bridge_future_handlers;
+    new (&intern->call) std::shared_ptr<TC::AsyncCall>();
+    intern->transport = NULL;
+    intern->result = NULL;
 
-    
     return &intern->std;
 }
 
+// 从 $futures 数组中取出 future 对象，遇到其他类型时抛出异常并返回 NULL
+static php_thrift_bridge_future_object *php_thrift_bridge_future_from_zval(zval *entry)
+{
+    ZVAL_DEREF(entry);
+    if (Z_TYPE_P(entry) != IS_OBJECT || Z_OBJCE_P(entry) != thrift_bridge_future_ce) {
+        zend_throw_exception_ex(NULL, 0, "Expected an array of ThriftBridgeFuture objects.");
+        return NULL;
+    }
+    php_thrift_bridge_future_object *intern = php_thrift_bridge_future_fetch_object(Z_OBJ_P(entry));
+    if (!intern->call) {
+        zend_throw_exception_ex(NULL, 0, "ThriftBridgeFuture was not created by flushAsync().");
+        return NULL;
+    }
+    return intern;
+}
+
+// 取回响应：阻塞直到调用完成 (最多到截止时间)，把响应拷贝到请求内存并装入发起调用的 transport。
+// 失败或超时时抛出异常并返回 false；可重复调用，超时后调用仍在进行，可以再次等待。
+static bool php_thrift_bridge_future_resolve(php_thrift_bridge_future_object *intern,
+                                             double timeout = 0, bool has_timeout = false)
+{
+    if (intern->result) {
+        return true;
+    }
+
+    {
+        std::chrono::steady_clock::time_point deadline;
+        bool has_deadline = php_thrift_bridge_future_deadline(timeout, has_timeout, &deadline);
+        apache::thrift::concurrency::Synchronized guard(TC::async_monitor);
+        if (!php_thrift_bridge_future_wait_until(has_deadline, deadline, [intern]() { return intern->call->done; })) {
+            return false;
+        }
+    }
+
+    TC::AsyncCall *call = intern->call.get();
+    if (call->response == NULL) {
+        zend_throw_exception_ex(NULL, 0, "%s", call->error.c_str());
+        return false;
+    }
+
+    // 持久分配的字符串不能交给 PHP 层 (原地修改时会按请求内存重新分配)，在这里拷贝一次
+    intern->result = zend_string_init(ZSTR_VAL(call->response), ZSTR_LEN(call->response), 0);
+    zend_string_free(call->response);
+    call->response = NULL;
+    THRIFT_BRIDGE_PROBE3(copy, call->service->name.c_str(), ZSTR_LEN(intern->result),
+        THRIFT_BRIDGE_PROBE_ENABLED(copy) ? TC::probe_seqid(call->input.data(), call->input.size(), call->protocol) : -1);
+
+    if (intern->transport) {
+        php_thrift_bridge_transport_object *transport = php_thrift_bridge_transport_fetch_object(intern->transport);
+        if (transport->rBuf) {
+            zend_string_release(transport->rBuf);
+        }
+        transport->rBuf = zend_string_copy(intern->result);
+        transport->rBufPos = 0;
+    }
+    return true;
+}
+
+// 解除 transport 与其未决 future 的关联 (future 对象本身可能仍被 PHP 代码持有)
+static void php_thrift_bridge_transport_detach_pending(php_thrift_bridge_transport_object *intern)
+{
+    if (intern->pending) {
+        php_thrift_bridge_future_fetch_object(intern->pending)->transport = NULL;
+        OBJ_RELEASE(intern->pending);
+        intern->pending = NULL;
+    }
+}
+
+// 把写入缓冲区中的请求提交到线程池，future 写入 return_value 并登记为 transport 的未决调用。
+// 失败时抛出异常并返回 false。
+static bool php_thrift_bridge_transport_dispatch_async(php_thrift_bridge_transport_object *intern, zval *return_value)
+{
+    if (intern->wBufLen > UINT32_MAX) {
+        intern->wBufLen = 0;
+        zend_throw_exception_ex(NULL, 0, "Payload exceeds 4GB.");
+        return false;
+    }
+
+    object_init_ex(return_value, thrift_bridge_future_ce);
+    php_thrift_bridge_future_object *future = php_thrift_bridge_future_fetch_object(Z_OBJ_P(return_value));
+
+    // 请求复制给工作线程，写入缓冲区留给本 transport 的下一次调用
+    future->call = std::make_shared<TC::AsyncCall>();
+    future->call->service = intern->service;
+    if (intern->wBuf) {
+        future->call->input.assign(ZSTR_VAL(intern->wBuf), intern->wBufLen);
+    }
+    intern->wBufLen = 0;
+    future->call->protocol = intern->protocol;
+    future->call->deadline_ns = TC::request_deadline_ns();
+
+    try {
+        TC::async_thread_pool((size_t)THRIFT_BRIDGE_G(async_threads))->add(future->call);
+    } catch (const apache::thrift::TException& tx) {
+        future->call->done = true;
+        zval_ptr_dtor(return_value);
+        ZVAL_NULL(return_value);
+        zend_throw_exception_ex(NULL, 0, "Failed to schedule async call: %s", tx.what());
+        return false;
+    }
+
+    // 同一个 transport 上只跟踪最近一次调用，之前的 future 不再改写 rBuf
+    php_thrift_bridge_transport_detach_pending(intern);
+    future->transport = &intern->std;
+    intern->pending = Z_OBJ_P(return_value);
+    GC_ADDREF(intern->pending);
+    return true;
+}
+
 // -----------------------------------------------------
 // C 库导出函数
 // -----------------------------------------------------
 extern "C" {
 
+// public function __construct(string $serviceName, ?string $protocol = null)
+// $protocol 为 binary/compact/header/auto，省略时按 thrift_bridge.protocol 确定
 ZEND_METHOD(ThriftBridgeTransport, __construct)
 {
     zend_string *service_name_str;
+    zend_string *protocol_name = NULL;
     
     // 获取当前对象的 C 结构体
     php_thrift_bridge_transport_object *intern = php_thrift_bridge_transport_fetch_object(Z_OBJ_P(getThis()));
     
     // S 表示接收 zend_string
-    if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &service_name_str) == FAILURE) {
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "S|S!", &service_name_str, &protocol_name) == FAILURE) {
         return;
     }
 
+    if (protocol_name) {
+        intern->protocol = TC::parse_protocol(ZSTR_VAL(protocol_name), ZSTR_LEN(protocol_name));
+        if (intern->protocol < 0) {
+            intern->protocol = TC::PROTOCOL_BINARY;
+            zend_throw_exception_ex(NULL, 0, "Unknown protocol '%s', expected binary, compact, header or auto.",
+                ZSTR_VAL(protocol_name));
+            return;
+        }
+    } else {
+        intern->protocol = php_thrift_bridge_service_protocol(ZSTR_VAL(service_name_str), ZSTR_LEN(service_name_str));
+    }
+
     // 存储 serviceName，使用 zend_string_copy 拷贝字符串
     intern->serviceName = zend_string_copy(service_name_str); 
+
+    // 一次性解析处理器并缓存，flush 时直接使用
+    intern->service = core_initialized ? global_factory.findService(intern->serviceName) : NULL;
     
-    // 初始化 wBuf/rBuf 为空字符串 (使用常量，不需要释放)
-    intern->wBuf = ZSTR_EMPTY_ALLOC();
+    // wBuf 在第一次 write 时按需分配；rBuf 初始化为空字符串 (使用常量，不需要释放)
+    intern->wBuf = NULL;
+    intern->wBufLen = 0;
     intern->rBuf = ZSTR_EMPTY_ALLOC();
     intern->rBufPos = 0;
 }
@@ -303,112 +4902,572 @@ ZEND_METHOD(ThriftBridgeTransport, write)
     
     php_thrift_bridge_transport_object *intern = php_thrift_bridge_transport_fetch_object(Z_OBJ_P(getThis()));
 
-    // 获取当前 wBuf 的长度和新数据的长度
-    size_t old_len = ZSTR_LEN(intern->wBuf);
-    size_t write_len = ZSTR_LEN(buf);
-    size_t new_len = old_len + write_len;
+    if (TC::profile_enabled && intern->write_started == 0) {
+        intern->write_started = TC::monotonic_ns();
+    }
+    php_thrift_bridge_transport_wbuf_append(intern, ZSTR_VAL(buf), ZSTR_LEN(buf));
+}
+
+
+// public function read($len)
+ZEND_METHOD(ThriftBridgeTransport, read)
+{
+    zend_long len;
+    php_thrift_bridge_transport_object *intern;
+    
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "l", &len) == FAILURE) {
+        return;
+    }
+    
+    intern = php_thrift_bridge_transport_fetch_object(Z_OBJ_P(getThis()));
+
+    // 异步调用的响应尚未取回时先等待它完成
+    if (intern->pending) {
+        bool resolved = php_thrift_bridge_future_resolve(php_thrift_bridge_future_fetch_object(intern->pending));
+        php_thrift_bridge_transport_detach_pending(intern);
+        if (!resolved) {
+            return;
+        }
+    }
+    
+    // 检查 rBuf 是否已关闭或未flush (PHP 版本中是 rBuf === null)
+    if (intern->rBuf == NULL) {
+        zend_throw_exception_ex(NULL, 0, "Transport is closed or not flushed.");
+        return;
+    }
+    
+    size_t total_len = ZSTR_LEN(intern->rBuf);
+    
+    // 可读取的长度
+    size_t read_len = (size_t)len;
+    size_t remaining_len = total_len - intern->rBufPos;
     
-    // 1. 分配新的 zend_string 空间
-    // 使用 zend_string_safe_alloc(len_factor, size, extra, persistent)
-    zend_string *new_wBuf = zend_string_safe_alloc(1, new_len, 1, 0); 
+    if (read_len > remaining_len) {
+        read_len = remaining_len;
+    }
     
-    // 2. 拷贝旧数据 (intern->wBuf)
-    memcpy(ZSTR_VAL(new_wBuf), ZSTR_VAL(intern->wBuf), old_len);
+    // 检查是否需要抛出 "No more data to read" 异常
+    if (read_len == 0 && len > 0) {
+        // 这是 Thrift 抛出 "No more data to read" 异常的条件
+        zend_throw_exception_ex(NULL, 0, "Cannot read %ld bytes from transport.", len);
+        return;
+    }
+
+    // 截取并返回读取的数据
+    RETVAL_STRINGL(ZSTR_VAL(intern->rBuf) + intern->rBufPos, read_len);
     
-    // 3. 拷贝新数据 (buf)
-    memcpy(ZSTR_VAL(new_wBuf) + old_len, ZSTR_VAL(buf), write_len);
+    // 更新读取位置
+    intern->rBufPos += read_len;
+
+    // 响应取完即 PHP 侧解码结束
+    if (intern->read_started && (size_t)intern->rBufPos == total_len) {
+        TC::profile_decoded(intern->profile, TC::monotonic_ns() - intern->read_started);
+        intern->read_started = 0;
+    }
+}
+
+// 旁车模式下的 flush()：请求交给守护进程执行 (总是同步)，响应装入 rBuf
+static void php_thrift_bridge_transport_sidecar_flush(php_thrift_bridge_transport_object *intern)
+{
+    php_thrift_bridge_transport_detach_pending(intern);
+    intern->write_started = 0;
+    intern->read_started = 0;
+
+    std::string error;
+    zend_string *response = TC::sidecar_call(ZSTR_VAL(intern->serviceName), ZSTR_LEN(intern->serviceName),
+        intern->wBuf ? ZSTR_VAL(intern->wBuf) : "", intern->wBufLen, intern->protocol, error);
+    intern->wBufLen = 0;
+    if (response == NULL) {
+        zend_throw_exception_ex(NULL, 0, "%s", error.c_str());
+        return;
+    }
+
+    zend_string_release(intern->rBuf);
+    intern->rBuf = response;
+    intern->rBufPos = 0;
+}
+
+// public function flush()
+ZEND_METHOD(ThriftBridgeTransport, flush)
+{
+    php_thrift_bridge_transport_object *intern = php_thrift_bridge_transport_fetch_object(Z_OBJ_P(getThis()));
+
+    if (TC::sidecar_enabled) {
+        php_thrift_bridge_transport_sidecar_flush(intern);
+        return;
+    }
+
+    if (intern->service == NULL) {
+        intern->wBufLen = 0;
+        zend_throw_exception_ex(NULL, 0, "Service '%s' is not registered.",
+            intern->serviceName ? ZSTR_VAL(intern->serviceName) : "");
+        return;
+    }
+
+    int32_t probe_seqid = -1;
+    if (THRIFT_BRIDGE_PROBE_ENABLED(flush__entry) || THRIFT_BRIDGE_PROBE_ENABLED(copy)) {
+        probe_seqid = TC::probe_seqid(intern->wBuf ? ZSTR_VAL(intern->wBuf) : "", intern->wBufLen, intern->protocol);
+    }
+    THRIFT_BRIDGE_PROBE3(flush__entry, intern->service->name.c_str(), intern->wBufLen, probe_seqid);
+
+    if (intern->async) {
+        zval future;
+        if (php_thrift_bridge_transport_dispatch_async(intern, &future)) {
+            zval_ptr_dtor(&future);
+        }
+        return;
+    }
+    // 同步调用的响应会覆盖 rBuf，之前的异步调用不再装入
+    php_thrift_bridge_transport_detach_pending(intern);
+
+    TC::CallProfile *profile = NULL;
+    if (TC::profile_enabled) {
+        profile = &intern->profile;
+        TC::profile_begin(*profile, intern->service, intern->write_started);
+    }
+    intern->write_started = 0;
+    intern->read_started = 0;
     
-    // 4. 设置新字符串的长度和终止符
-    ZSTR_LEN(new_wBuf) = new_len;
-    ZSTR_VAL(new_wBuf)[new_len] = '\0'; // 必须手动添加终止符
+    // --- 1. 获取请求数据 (intern->wBuf) ---
+    const char *requestBinary = intern->wBuf ? ZSTR_VAL(intern->wBuf) : "";
+    size_t requestBinaryLen = intern->wBufLen;
+
+    // --- 2. 调用 C++ CoreLib 函数 ---
+    zend_string *responseBinary = process_thrift_data_generic(
+        intern->service,
+        requestBinary, requestBinaryLen,
+        intern->protocol,
+        profile
+    );
+
+    // 无论成功与否本次请求都已消费，清空写入缓冲区但保留容量供下次复用
+    intern->wBufLen = 0;
+
+    // --- 3. 检查 CoreLib 返回结果 ---
+    if (responseBinary == NULL) {
+        if (profile) {
+            TC::profile_finish(*profile);
+        }
+        // 抛出 TTransportException
+        zend_throw_exception_ex(NULL, 0, "CoreLib RPC failed or returned null.");
+        return;
+    }
+
+    // --- 4. 将响应数据存入读取缓冲区 ---
+    // 释放旧的 rBuf
+    zend_string_release(intern->rBuf); 
     
-    // 5. 释放旧的 wBuf，更新指针
-    zend_string_release(intern->wBuf); 
-    intern->wBuf = new_wBuf;
+    // 响应本身就是 Zend 分配的 zend_string，直接接管，无需再拷贝
+    intern->rBuf = responseBinary;
+    intern->rBufPos = 0;
+
+    if (profile) {
+        intern->read_started = TC::profile_finish(*profile);
+    }
+    THRIFT_BRIDGE_PROBE3(copy, intern->service->name.c_str(), ZSTR_LEN(responseBinary), probe_seqid);
+}
+
+// public function flushAsync(): ThriftBridgeFuture
+// 请求在后台线程池中执行，立即返回 future；之后调用 $future->wait() 取得响应，
+// 或直接 read() (生成的 Client 的 recv_xxx)，会先等待该调用完成。
+ZEND_METHOD(ThriftBridgeTransport, flushAsync)
+{
+    php_thrift_bridge_transport_object *intern = php_thrift_bridge_transport_fetch_object(Z_OBJ_P(getThis()));
+
+    if (TC::sidecar_enabled) {
+        intern->wBufLen = 0;
+        zend_throw_exception_ex(NULL, 0, "Async calls are not supported in sidecar mode.");
+        return;
+    }
+
+    if (intern->service == NULL) {
+        intern->wBufLen = 0;
+        zend_throw_exception_ex(NULL, 0, "Service '%s' is not registered.",
+            intern->serviceName ? ZSTR_VAL(intern->serviceName) : "");
+        return;
+    }
+
+    THRIFT_BRIDGE_PROBE3(flush__entry, intern->service->name.c_str(), intern->wBufLen,
+        THRIFT_BRIDGE_PROBE_ENABLED(flush__entry)
+            ? TC::probe_seqid(intern->wBuf ? ZSTR_VAL(intern->wBuf) : "", intern->wBufLen, intern->protocol) : -1);
+    php_thrift_bridge_transport_dispatch_async(intern, return_value);
+}
+
+// public function setAsync(bool $async): void
+// 打开后 flush() 等同于 flushAsync()，生成的 Client 拆成 send_xxx/recv_xxx 调用即可并行
+ZEND_METHOD(ThriftBridgeTransport, setAsync)
+{
+    zend_bool async;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "b", &async) == FAILURE) {
+        return;
+    }
+
+    php_thrift_bridge_transport_fetch_object(Z_OBJ_P(getThis()))->async = async;
+}
+
+// public function getFuture(): ?ThriftBridgeFuture
+// 最近一次尚未被 read() 取走的异步调用
+ZEND_METHOD(ThriftBridgeTransport, getFuture)
+{
+    php_thrift_bridge_transport_object *intern = php_thrift_bridge_transport_fetch_object(Z_OBJ_P(getThis()));
+
+    if (intern->pending == NULL) {
+        RETURN_NULL();
+    }
+    GC_ADDREF(intern->pending);
+    RETURN_OBJ(intern->pending);
+}
+
+static void php_thrift_bridge_stats_to_array(const TC::StatsCounters &c, zval *out)
+{
+    array_init_size(out, 6);
+    add_assoc_long(out, "calls", (zend_long)c.calls);
+    add_assoc_long(out, "errors", (zend_long)c.errors);
+    add_assoc_long(out, "request_bytes", (zend_long)c.request_bytes);
+    add_assoc_long(out, "response_bytes", (zend_long)c.response_bytes);
+    if (c.coalesced) {
+        // 其中直接拿到相同调用响应、没有执行处理器的调用数
+        add_assoc_long(out, "coalesced", (zend_long)c.coalesced);
+    }
+    if (c.cached) {
+        // 其中由共享响应缓存应答的调用数
+        add_assoc_long(out, "cached", (zend_long)c.cached);
+    }
+
+    zval latency;
+    array_init_size(&latency, 6);
+    add_assoc_long(&latency, "mean", c.calls ? (zend_long)(c.latency_sum_ns / c.calls) : 0);
+    add_assoc_long(&latency, "p50", (zend_long)TC::stats_percentile(c, 0.5));
+    add_assoc_long(&latency, "p90", (zend_long)TC::stats_percentile(c, 0.9));
+    add_assoc_long(&latency, "p99", (zend_long)TC::stats_percentile(c, 0.99));
+    add_assoc_long(&latency, "p999", (zend_long)TC::stats_percentile(c, 0.999));
+    add_assoc_long(&latency, "max", (zend_long)TC::stats_percentile(c, 1.0));
+    add_assoc_zval(out, "latency_ns", &latency);
+
+    // 分阶段耗时的平均值，只统计打开 thrift_bridge.profile 后的同步调用
+    if (c.profiled) {
+        zval phases, mean;
+        array_init_size(&phases, 2);
+        add_assoc_long(&phases, "calls", (zend_long)c.profiled);
+        array_init_size(&mean, TC::PHASE_COUNT);
+        for (int i = 0; i < TC::PHASE_COUNT; i++) {
+            add_assoc_long(&mean, TC::kPhaseNames[i], (zend_long)(c.phase_sum_ns[i] / c.profiled));
+        }
+        add_assoc_zval(&phases, "mean_ns", &mean);
+        add_assoc_zval(out, "phases", &phases);
+    }
+}
+
+// function thrift_bridge_stats(bool $allWorkers = false): array
+// 各服务及其方法的调用次数、失败次数、请求/响应字节数和延迟分位数 (纳秒)：
+// ['DynamicServiceA' => ['calls' => .., ..., 'latency_ns' => [...], 'methods' => ['name' => [...]]]]
+// 默认只汇总本进程认领的槽位 (含接管的已退出进程的计数)，$allWorkers 为 true 时汇总所有工作进程。
+PHP_FUNCTION(thrift_bridge_stats)
+{
+    zend_bool all_workers = 0;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "|b", &all_workers) == FAILURE) {
+        return;
+    }
+
+    std::map<std::string, TC::StatsSummary> summaries;
+    if (TC::metrics_region) {
+        TC::stats_collect_region(TC::metrics_region, all_workers ? 0 : (int32_t)getpid(), summaries,
+                                 TC::metrics_self_start());
+    }
+
+    array_init_size(return_value, (uint32_t)summaries.size());
+    for (const auto &item : summaries) {
+        zval service;
+        php_thrift_bridge_stats_to_array(item.second.counters, &service);
+
+        zval methods;
+        array_init_size(&methods, (uint32_t)item.second.methods.size());
+        for (const auto &method : item.second.methods) {
+            zval stats;
+            php_thrift_bridge_stats_to_array(method.second, &stats);
+            add_assoc_zval_ex(&methods, method.first.data(), method.first.size(), &stats);
+        }
+        add_assoc_zval(&service, "methods", &methods);
+
+        add_assoc_zval_ex(return_value, item.first.data(), item.first.size(), &service);
+    }
+}
+
+// function thrift_bridge_last_call_profile(): ?array
+// 本请求中最近一次同步调用的分阶段耗时 (纳秒)，需要打开 thrift_bridge.profile：
+// ['service' => .., 'method' => .., 'total_ns' => .., 'phases_ns' => ['php_encode' => .., ..., 'php_decode' => ..]]
+// 响应尚未被 read() 取完时 php_decode 为 0。
+PHP_FUNCTION(thrift_bridge_last_call_profile)
+{
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
+
+    const TC::CallProfile &profile = TC::last_call_profile;
+    if (profile.id == 0) {
+        RETURN_NULL();
+    }
+
+    zval phases;
+    uint64_t total = 0;
+    array_init_size(&phases, TC::PHASE_COUNT);
+    for (int i = 0; i < TC::PHASE_COUNT; i++) {
+        add_assoc_long(&phases, TC::kPhaseNames[i], (zend_long)profile.phase_ns[i]);
+        total += profile.phase_ns[i];
+    }
+
+    array_init_size(return_value, 4);
+    if (profile.service) {
+        add_assoc_stringl(return_value, "service", profile.service->name.data(), profile.service->name.size());
+    } else {
+        add_assoc_null(return_value, "service");
+    }
+    if (profile.method_len) {
+        add_assoc_stringl(return_value, "method", profile.method, profile.method_len);
+    } else {
+        add_assoc_null(return_value, "method");
+    }
+    add_assoc_long(return_value, "total_ns", (zend_long)total);
+    add_assoc_zval(return_value, "phases_ns", &phases);
+}
+
+// function thrift_bridge_sampling_dump(?string $directory = null, bool $reset = false): array
+// 把本进程累计的处理器调用栈样本按服务写成 pprof 文件 (<目录>/thrift_bridge.<pid>.<服务>.prof)，
+// 返回 服务名 => 文件路径；$reset 为 true 时写出后清空样本。未打开采样时返回空数组。
+PHP_FUNCTION(thrift_bridge_sampling_dump)
+{
+    zend_string *directory = NULL;
+    zend_bool reset = 0;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "|S!b", &directory, &reset) == FAILURE) {
+        return;
+    }
+
+    array_init(return_value);
+    if (!TC::sampling_enabled) {
+        return;
+    }
+
+    std::string dir = directory ? std::string(ZSTR_VAL(directory), ZSTR_LEN(directory)) : TC::sampling_dir;
+    for (const auto &item : TC::sampling_dump(dir, reset)) {
+        add_assoc_stringl_ex(return_value, item.first.data(), item.first.size(),
+            item.second.data(), item.second.size());
+    }
+}
+
+// function thrift_bridge_reload(): array
+// 立即重新扫描插件目录，加载新插件、切换到被替换插件的新版本 (只作用于当前进程)。
+// 返回有变化的插件: [路径 => 'loaded' | 'reloaded' | 'failed', ...]
+PHP_FUNCTION(thrift_bridge_reload)
+{
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
+
+    std::vector<std::pair<std::string, const char*>> results;
+    reload_plugins(&results);
+    // 本请求之后的调用使用新版本插件，不能再返回旧版本的记忆
+    if (!results.empty()) {
+        TC::memo_clear();
+    }
+    array_init(return_value);
+    for (const auto &item : results) {
+        add_assoc_string_ex(return_value, item.first.data(), item.first.size(), (char *)item.second);
+    }
 }
 
+// function thrift_bridge_metrics_prometheus(): string
+// 汇总所有工作进程的统计，输出 Prometheus 文本格式 (text/plain; version=0.0.4)
+PHP_FUNCTION(thrift_bridge_metrics_prometheus)
+{
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
 
-// public function read($len)
-ZEND_METHOD(ThriftBridgeTransport, read)
+    std::map<std::string, TC::StatsSummary> summaries;
+    if (TC::metrics_region) {
+        TC::stats_collect_region(TC::metrics_region, 0, summaries);
+    }
+    std::string text;
+    TC::stats_prometheus(summaries, text);
+    RETURN_STRINGL(text.data(), text.size());
+}
+
+// function thrift_bridge_call_raw(string $service, string $payload): string
+// 调用方已持有序列化好的请求 (缓存的请求、队列转发的消息等) 时直接调用处理器，
+// 省去构造 ThriftBridgeTransport 以及 write/flush/read 多次方法分发的开销。
+PHP_FUNCTION(thrift_bridge_call_raw)
 {
-    zend_long len;
-    php_thrift_bridge_transport_object *intern;
-    
-    if (zend_parse_parameters(ZEND_NUM_ARGS(), "l", &len) == FAILURE) {
+    zend_string *service_name;
+    zend_string *payload;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "SS", &service_name, &payload) == FAILURE) {
         return;
     }
-    
-    intern = php_thrift_bridge_transport_fetch_object(Z_OBJ_P(getThis()));
-    
-    // 检查 rBuf 是否已关闭或未flush (PHP 版本中是 rBuf === null)
-    if (intern->rBuf == NULL) {
-        zend_throw_exception_ex(NULL, 0, "Transport is closed or not flushed.");
+
+    if (TC::sidecar_enabled) {
+        std::string error;
+        zend_string *response = TC::sidecar_call(ZSTR_VAL(service_name), ZSTR_LEN(service_name),
+            ZSTR_VAL(payload), ZSTR_LEN(payload),
+            php_thrift_bridge_service_protocol(ZSTR_VAL(service_name), ZSTR_LEN(service_name)), error);
+        if (response == NULL) {
+            zend_throw_exception_ex(NULL, 0, "%s", error.c_str());
+            return;
+        }
+        RETURN_STR(response);
+    }
+
+    TC::ServiceEntry *service = core_initialized ? global_factory.findService(service_name) : NULL;
+    if (service == NULL) {
+        zend_throw_exception_ex(NULL, 0, "Service '%s' is not registered.", ZSTR_VAL(service_name));
         return;
     }
-    
-    size_t total_len = ZSTR_LEN(intern->rBuf);
-    
-    // 可读取的长度
-    size_t read_len = (size_t)len;
-    size_t remaining_len = total_len - intern->rBufPos;
-    
-    if (read_len > remaining_len) {
-        read_len = remaining_len;
+
+    TC::CallProfile profile, *profile_ptr = NULL;
+    if (TC::profile_enabled) {
+        profile_ptr = &profile;
+        TC::profile_begin(profile, service, 0);
     }
-    
-    // 检查是否需要抛出 "No more data to read" 异常
-    if (read_len == 0 && len > 0) {
-        // 这是 Thrift 抛出 "No more data to read" 异常的条件
-        zend_throw_exception_ex(NULL, 0, "Cannot read %ld bytes from transport.", len);
+
+    zend_string *response = process_thrift_data_generic(service, ZSTR_VAL(payload), ZSTR_LEN(payload),
+        php_thrift_bridge_service_protocol(ZSTR_VAL(service_name), ZSTR_LEN(service_name)), profile_ptr);
+    if (profile_ptr) {
+        TC::profile_finish(profile);
+    }
+    if (response == NULL) {
+        zend_throw_exception_ex(NULL, 0, "CoreLib RPC failed or returned null.");
         return;
     }
 
-    // 截取并返回读取的数据
-    RETVAL_STRINGL(ZSTR_VAL(intern->rBuf) + intern->rBufPos, read_len);
-    
-    // 更新读取位置
-    intern->rBufPos += read_len;
+    RETURN_STR(response);
 }
 
-// public function flush()
-ZEND_METHOD(ThriftBridgeTransport, flush)
+// function thrift_bridge_multi_call(array $calls): array
+// $calls 的每一项为 [$service, $payload] 或 ['service' => ..., 'payload' => ...]。
+// 整批调用一次进入核心库执行，固定开销按批摊销；返回数组与 $calls 键一一对应，
+// 每项为 ['ok' => bool, 'response' => ?string, 'error' => ?string]。
+PHP_FUNCTION(thrift_bridge_multi_call)
 {
-    php_thrift_bridge_transport_object *intern = php_thrift_bridge_transport_fetch_object(Z_OBJ_P(getThis()));
-    
-    // --- 1. 获取请求数据 (intern->wBuf) ---
-    const char *requestBinary = ZSTR_VAL(intern->wBuf);
-    size_t requestBinaryLen = ZSTR_LEN(intern->wBuf);
-
-    // --- 2. 调用 C++ CoreLib 函数 ---
-    size_t responseLen = 0;
-    char* responseBinary = process_thrift_data_generic(
-        ZSTR_VAL(intern->serviceName), ZSTR_LEN(intern->serviceName),
-        requestBinary, requestBinaryLen,
-        &responseLen
-    );
+    HashTable *calls;
+    zval *entry;
+    zend_string *last_name = NULL;
+    TC::ServiceEntry *last_service = NULL;
+    int last_protocol = TC::PROTOCOL_BINARY;
 
-    // --- 3. 检查 CoreLib 返回结果 ---
-    if (responseBinary == NULL) {
-        // 抛出 TTransportException
-        zend_throw_exception_ex(NULL, 0, "CoreLib RPC failed or returned null.");
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "h", &calls) == FAILURE) {
         return;
     }
 
-    // --- 4. 将响应数据存入读取缓冲区 ---
-    // 释放旧的 rBuf
-    zend_string_release(intern->rBuf); 
-    
-    // 将 C/C++ 返回的 char* 转换为 zend_string (会进行拷贝)
-    intern->rBuf = zend_string_init(responseBinary, responseLen, 0); 
-    free(responseBinary); // 释放 C++ 层分配的内存 (重要!)
-    
-    intern->rBufPos = 0;
-    
-    // --- 5. 清空写入缓冲区 ---
-    zend_string_release(intern->wBuf);
-    intern->wBuf = ZSTR_EMPTY_ALLOC();
+    std::vector<TC::BatchCall> batch(zend_hash_num_elements(calls));
+    size_t i = 0;
+    ZEND_HASH_FOREACH_VAL(calls, entry) {
+        TC::BatchCall &call = batch[i++];
+        call.service = NULL;
+        call.input = NULL;
+        call.input_len = 0;
+        call.protocol = TC::PROTOCOL_BINARY;
+        call.response = NULL;
+
+        ZVAL_DEREF(entry);
+        zval *name = NULL, *payload = NULL;
+        if (Z_TYPE_P(entry) == IS_ARRAY) {
+            name = zend_hash_index_find(Z_ARRVAL_P(entry), 0);
+            if (name == NULL) name = zend_hash_str_find(Z_ARRVAL_P(entry), "service", sizeof("service") - 1);
+            payload = zend_hash_index_find(Z_ARRVAL_P(entry), 1);
+            if (payload == NULL) payload = zend_hash_str_find(Z_ARRVAL_P(entry), "payload", sizeof("payload") - 1);
+        }
+        if (name) ZVAL_DEREF(name);
+        if (payload) ZVAL_DEREF(payload);
+        if (name == NULL || payload == NULL || Z_TYPE_P(name) != IS_STRING || Z_TYPE_P(payload) != IS_STRING) {
+            call.error = "Invalid call entry, expected [service, payload].";
+            continue;
+        }
+
+        // 同一批里通常反复调用少数几个服务，相同名字时直接复用上一次的解析结果
+        if (last_name == NULL || !zend_string_equals(last_name, Z_STR_P(name))) {
+            last_name = Z_STR_P(name);
+            last_service = core_initialized ? global_factory.findService(last_name) : NULL;
+            last_protocol = php_thrift_bridge_service_protocol(ZSTR_VAL(last_name), ZSTR_LEN(last_name));
+        }
+        call.service = last_service;
+        call.protocol = last_protocol;
+        call.input = Z_STRVAL_P(payload);
+        call.input_len = Z_STRLEN_P(payload);
+
+        // 旁车模式：逐项交给守护进程
+        if (TC::sidecar_enabled) {
+            call.response = TC::sidecar_call(Z_STRVAL_P(name), Z_STRLEN_P(name), call.input, call.input_len,
+                                             call.protocol, call.error);
+        }
+    } ZEND_HASH_FOREACH_END();
+
+    if (!TC::sidecar_enabled) {
+        process_thrift_batch(batch);
+    }
+
+    zend_ulong num_key;
+    zend_string *str_key;
+    array_init_size(return_value, zend_hash_num_elements(calls));
+    i = 0;
+    ZEND_HASH_FOREACH_KEY_VAL(calls, num_key, str_key, entry) {
+        TC::BatchCall &call = batch[i++];
+        zval result;
+        array_init_size(&result, 3);
+        add_assoc_bool(&result, "ok", call.response != NULL);
+        if (call.response) {
+            add_assoc_str(&result, "response", call.response);
+            add_assoc_null(&result, "error");
+        } else {
+            add_assoc_null(&result, "response");
+            add_assoc_stringl(&result, "error", call.error.data(), call.error.size());
+        }
+        if (str_key) {
+            zend_hash_update(Z_ARRVAL_P(return_value), str_key, &result);
+        } else {
+            zend_hash_index_update(Z_ARRVAL_P(return_value), num_key, &result);
+        }
+    } ZEND_HASH_FOREACH_END();
 }
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_thrift_bridge_multi_call, 0, 0, 1)
+    ZEND_ARG_INFO(0, calls)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_thrift_bridge_call_raw, 0, 0, 2)
+    ZEND_ARG_INFO(0, service)
+    ZEND_ARG_INFO(0, payload)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_thrift_bridge_stats, 0, 0, 0)
+    ZEND_ARG_INFO(0, allWorkers)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_thrift_bridge_metrics_prometheus, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_thrift_bridge_last_call_profile, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_thrift_bridge_sampling_dump, 0, 0, 0)
+    ZEND_ARG_INFO(0, directory)
+    ZEND_ARG_INFO(0, reset)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_thrift_bridge_reload, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+const zend_function_entry thrift_bridge_functions[] = {
+    PHP_FE(thrift_bridge_call_raw, arginfo_thrift_bridge_call_raw)
+    PHP_FE(thrift_bridge_multi_call, arginfo_thrift_bridge_multi_call)
+    PHP_FE(thrift_bridge_stats, arginfo_thrift_bridge_stats)
+    PHP_FE(thrift_bridge_metrics_prometheus, arginfo_thrift_bridge_metrics_prometheus)
+    PHP_FE(thrift_bridge_last_call_profile, arginfo_thrift_bridge_last_call_profile)
+    PHP_FE(thrift_bridge_sampling_dump, arginfo_thrift_bridge_sampling_dump)
+    PHP_FE(thrift_bridge_reload, arginfo_thrift_bridge_reload)
+    PHP_FE_END
+};
 
 const zend_function_entry thrift_bridge_transport_methods[] = {
     ZEND_ME(ThriftBridgeTransport, __construct, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_CTOR)
@@ -418,6 +5477,9 @@ const zend_function_entry thrift_bridge_transport_methods[] = {
     ZEND_ME(ThriftBridgeTransport, read,        NULL, ZEND_ACC_PUBLIC)
     ZEND_ME(ThriftBridgeTransport, write,       NULL, ZEND_ACC_PUBLIC)
     ZEND_ME(ThriftBridgeTransport, flush,       NULL, ZEND_ACC_PUBLIC)
+    ZEND_ME(ThriftBridgeTransport, flushAsync,  NULL, ZEND_ACC_PUBLIC)
+    ZEND_ME(ThriftBridgeTransport, setAsync,    NULL, ZEND_ACC_PUBLIC)
+    ZEND_ME(ThriftBridgeTransport, getFuture,   NULL, ZEND_ACC_PUBLIC)
     PHP_FE_END
 };
 
@@ -440,22 +5502,342 @@ static void php_thrift_bridge_transport_init(INIT_FUNC_ARGS)
 }
 
 
-ZEND_BEGIN_MODULE_GLOBALS(thrift_bridge)
-    char *plugin_dir;
-ZEND_END_MODULE_GLOBALS(thrift_bridge)
-ZEND_DECLARE_MODULE_GLOBALS(thrift_bridge)
-PHP_INI_BEGIN()
-    STD_PHP_INI_ENTRY("thrift_bridge.plugin_dir", "./plugins", PHP_INI_ALL, OnUpdateString, plugin_dir, zend_thrift_bridge_globals, thrift_bridge_globals)
-PHP_INI_END()
-#define THRIFT_BRIDGE_G(v) (thrift_bridge_globals.v)
-static void php_thrift_bridge_init_globals(zend_thrift_bridge_globals *globals)
+
+// public function __construct(string $serviceName)
+ZEND_METHOD(ThriftBridgeClient, __construct)
 {
-    // globals->plugin_dir = NULL;
+    zend_string *service_name_str;
+    php_thrift_bridge_client_object *intern = php_thrift_bridge_client_fetch_object(Z_OBJ_P(getThis()));
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &service_name_str) == FAILURE) {
+        return;
+    }
+
+    if (intern->serviceName) {
+        zend_string_release(intern->serviceName);
+    }
+    intern->serviceName = zend_string_copy(service_name_str);
+    // IDL 描述由守护进程中的插件导出，本进程拿不到
+    if (TC::sidecar_enabled) {
+        zend_throw_exception_ex(NULL, 0, "ThriftBridgeClient is not supported in sidecar mode.");
+        return;
+    }
+    intern->service = core_initialized ? global_factory.findService(intern->serviceName) : NULL;
+
+    if (intern->service == NULL) {
+        zend_throw_exception_ex(NULL, 0, "Service '%s' is not registered.", ZSTR_VAL(service_name_str));
+        return;
+    }
+    if (!intern->service->current()->spec) {
+        zend_throw_exception_ex(NULL, 0, "Service '%s' does not export a type spec.", ZSTR_VAL(service_name_str));
+        return;
+    }
+}
+
+// public function __call(string $name, array $arguments)
+// 参数按位置对应 IDL 中的方法参数，结构体参数可以是数组或对象；返回值解码为数组。
+// 方法声明的异常以 ThriftBridgeException 抛出，解码后的异常结构体放在其 data 属性中。
+ZEND_METHOD(ThriftBridgeClient, __call)
+{
+    zend_string *method_name;
+    HashTable *arguments;
+    php_thrift_bridge_client_object *intern = php_thrift_bridge_client_fetch_object(Z_OBJ_P(getThis()));
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "Sh", &method_name, &arguments) == FAILURE) {
+        return;
+    }
+
+    // 编解码期间使用的 IDL 描述属于插件，热更新时要等本次调用结束才能释放
+    TC::ReaderSection reader;
+    const TC::CompiledService *spec = intern->service ? intern->service->current()->spec : NULL;
+    if (spec == NULL) {
+        zend_throw_exception_ex(NULL, 0, "ThriftBridgeClient is not bound to a service with a type spec.");
+        return;
+    }
+
+    TC::CompiledMethod *method = spec->findMethod(method_name);
+    if (method == NULL) {
+        zend_throw_exception_ex(thrift_bridge_exception_ce, 0, "Method '%s' is not exported by service '%s'.",
+            ZSTR_VAL(method_name), intern->service->name.c_str());
+        return;
+    }
+
+    // 原生客户端的 php_encode/php_decode 阶段即 C 层的编码与解码
+    TC::CallProfile profile, *profile_ptr = NULL;
+    uint64_t encode_started = TC::profile_enabled ? TC::monotonic_ns() : 0;
+
+    zend_string *request;
+    try {
+        request = TC::encode_call(method, arguments);
+    } catch (const apache::thrift::TException& tx) {
+        zend_throw_exception_ex(NULL, 0, "Failed to encode %s arguments: %s", method->name.c_str(), tx.what());
+        return;
+    }
+
+    if (TC::profile_enabled) {
+        profile_ptr = &profile;
+        TC::profile_begin(profile, intern->service, encode_started);
+    }
+    zend_string *response = process_thrift_data_generic(intern->service, ZSTR_VAL(request), ZSTR_LEN(request),
+        TC::PROTOCOL_BINARY, profile_ptr);
+    zend_string_release(request);
+    uint64_t decode_started = profile_ptr ? TC::profile_finish(profile) : 0;
+    if (response == NULL) {
+        zend_throw_exception_ex(NULL, 0, "CoreLib RPC failed or returned null.");
+        return;
+    }
+
+    // oneway 方法没有响应
+    if (method->result == NULL) {
+        zend_string_release(response);
+        RETURN_NULL();
+    }
+
+    zval result;
+    ZVAL_NULL(&result);
+    try {
+        TC::decode_reply(method, response, &result);
+    } catch (const apache::thrift::TApplicationException& tx) {
+        zend_string_release(response);
+        zval_ptr_dtor(&result);
+        zend_throw_exception_ex(NULL, tx.getType(), "%s", tx.what());
+        return;
+    } catch (const apache::thrift::TException& tx) {
+        zend_string_release(response);
+        zval_ptr_dtor(&result);
+        zend_throw_exception_ex(NULL, 0, "Failed to decode %s result: %s", method->name.c_str(), tx.what());
+        return;
+    }
+    zend_string_release(response);
+    if (profile_ptr) {
+        TC::profile_decoded(profile, TC::monotonic_ns() - decode_started);
+    }
+
+    // xxx_result：字段 0 为返回值，其余字段为声明的异常
+    for (const TC::CompiledField &field : method->result->fields) {
+        zval *value = zend_hash_find(Z_ARRVAL(result), field.name);
+        if (value == NULL) {
+            continue;
+        }
+        if (field.id == 0) {
+            RETVAL_COPY(value);
+            zval_ptr_dtor(&result);
+            return;
+        }
+
+        const char *type_name = field.type->struct_type ? field.type->struct_type->name.c_str() : ZSTR_VAL(field.name);
+        zval *message = Z_TYPE_P(value) == IS_ARRAY ? zend_hash_str_find(Z_ARRVAL_P(value), "message", sizeof("message") - 1) : NULL;
+        zend_object *ex = zend_throw_exception_ex(thrift_bridge_exception_ce, 0, "%s threw %s%s%s",
+            method->name.c_str(), type_name,
+            (message && Z_TYPE_P(message) == IS_STRING) ? ": " : "",
+            (message && Z_TYPE_P(message) == IS_STRING) ? Z_STRVAL_P(message) : "");
+        zend_update_property(thrift_bridge_exception_ce, ex, "data", sizeof("data") - 1, value);
+        zval_ptr_dtor(&result);
+        return;
+    }
+    zval_ptr_dtor(&result);
+
+    // void 方法的 result 结构体没有字段 0
+    if (method->result->fields.empty() || method->result->fields[0].id != 0) {
+        RETURN_NULL();
+    }
+    zend_throw_exception_ex(NULL, 0, "%s failed: unknown result", method->name.c_str());
+}
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_thrift_bridge_client_call, 0, 0, 2)
+    ZEND_ARG_INFO(0, name)
+    ZEND_ARG_INFO(0, arguments)
+ZEND_END_ARG_INFO()
+
+const zend_function_entry thrift_bridge_client_methods[] = {
+    ZEND_ME(ThriftBridgeClient, __construct, NULL, ZEND_ACC_PUBLIC|ZEND_ACC_CTOR)
+    ZEND_ME(ThriftBridgeClient, __call,      arginfo_thrift_bridge_client_call, ZEND_ACC_PUBLIC)
+    PHP_FE_END
+};
+
+static void php_thrift_bridge_client_init(INIT_FUNC_ARGS)
+{
+    zend_class_entry ce;
+
+    INIT_CLASS_ENTRY(ce, "ThriftBridgeClient", thrift_bridge_client_methods);
+    thrift_bridge_client_ce = zend_register_internal_class_ex(&ce, NULL);
+    thrift_bridge_client_ce->create_object = php_thrift_bridge_client_create_object;
+
+    memcpy(&thrift_bridge_client_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+    thrift_bridge_client_handlers.offset = XtOffsetOf(php_thrift_bridge_client_object, std);
+    thrift_bridge_client_handlers.free_obj = php_thrift_bridge_client_free_object;
+    thrift_bridge_client_handlers.clone_obj = NULL;
+
+    // 方法声明的 Thrift 异常，解码后的异常结构体保存在 $data 中
+    zend_class_entry exception_ce;
+    INIT_CLASS_ENTRY(exception_ce, "ThriftBridgeException", NULL);
+    thrift_bridge_exception_ce = zend_register_internal_class_ex(&exception_ce, zend_ce_exception);
+    zend_declare_property_null(thrift_bridge_exception_ce, "data", sizeof("data") - 1, ZEND_ACC_PUBLIC);
+}
+
+// public function wait(?float $timeout = null): string
+// 阻塞直到调用完成并返回响应；失败时抛出异常。可重复调用，完成后立即返回。
+// 最多等待 $timeout 秒，且不超过 max_execution_time 剩余的时间，超时抛出异常 (调用仍在进行)
+ZEND_METHOD(ThriftBridgeFuture, wait)
+{
+    php_thrift_bridge_future_object *intern = php_thrift_bridge_future_fetch_object(Z_OBJ_P(getThis()));
+    double timeout = 0;
+    zend_bool timeout_is_null = 1;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "|d!", &timeout, &timeout_is_null) == FAILURE) {
+        return;
+    }
+    if (!intern->call) {
+        zend_throw_exception_ex(NULL, 0, "ThriftBridgeFuture was not created by flushAsync().");
+        return;
+    }
+    if (!php_thrift_bridge_future_resolve(intern, timeout, !timeout_is_null)) {
+        return;
+    }
+
+    RETURN_STR_COPY(intern->result);
+}
+
+// public function isDone(): bool
+ZEND_METHOD(ThriftBridgeFuture, isDone)
+{
+    php_thrift_bridge_future_object *intern = php_thrift_bridge_future_fetch_object(Z_OBJ_P(getThis()));
+
+    if (!intern->call) {
+        RETURN_FALSE;
+    }
+    apache::thrift::concurrency::Synchronized guard(TC::async_monitor);
+    RETURN_BOOL(intern->call->done);
+}
+
+// public static function waitAll(array $futures, ?float $timeout = null): void
+// 等待全部调用完成，之后各 future 的 wait() 立即返回；截止时间同 wait()
+ZEND_METHOD(ThriftBridgeFuture, waitAll)
+{
+    HashTable *futures;
+    zval *entry;
+    double timeout = 0;
+    zend_bool timeout_is_null = 1;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "h|d!", &futures, &timeout, &timeout_is_null) == FAILURE) {
+        return;
+    }
+
+    std::vector<php_thrift_bridge_future_object *> pending;
+    pending.reserve(zend_hash_num_elements(futures));
+    ZEND_HASH_FOREACH_VAL(futures, entry) {
+        php_thrift_bridge_future_object *intern = php_thrift_bridge_future_from_zval(entry);
+        if (intern == NULL) {
+            return;
+        }
+        pending.push_back(intern);
+    } ZEND_HASH_FOREACH_END();
+
+    std::chrono::steady_clock::time_point deadline;
+    bool has_deadline = php_thrift_bridge_future_deadline(timeout, !timeout_is_null, &deadline);
+    apache::thrift::concurrency::Synchronized guard(TC::async_monitor);
+    for (php_thrift_bridge_future_object *intern : pending) {
+        if (!php_thrift_bridge_future_wait_until(has_deadline, deadline, [intern]() { return intern->call->done; })) {
+            return;
+        }
+    }
+}
+
+// public static function waitAny(array $futures, ?float $timeout = null): int|string|null
+// 等待任意一个调用完成，返回其在 $futures 中的键；数组为空时返回 NULL，截止时间同 wait()
+ZEND_METHOD(ThriftBridgeFuture, waitAny)
+{
+    HashTable *futures;
+    zend_string *key;
+    zend_ulong index;
+    zval *entry;
+    double timeout = 0;
+    zend_bool timeout_is_null = 1;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "h|d!", &futures, &timeout, &timeout_is_null) == FAILURE) {
+        return;
+    }
+
+    ZEND_HASH_FOREACH_VAL(futures, entry) {
+        if (php_thrift_bridge_future_from_zval(entry) == NULL) {
+            return;
+        }
+    } ZEND_HASH_FOREACH_END();
+
+    if (zend_hash_num_elements(futures) == 0) {
+        RETURN_NULL();
+    }
+
+    std::chrono::steady_clock::time_point deadline;
+    bool has_deadline = php_thrift_bridge_future_deadline(timeout, !timeout_is_null, &deadline);
+    apache::thrift::concurrency::Synchronized guard(TC::async_monitor);
+    zval *done = NULL;
+    php_thrift_bridge_future_wait_until(has_deadline, deadline, [futures, &done, &entry]() {
+        ZEND_HASH_FOREACH_VAL(futures, entry) {
+            ZVAL_DEREF(entry);
+            if (php_thrift_bridge_future_fetch_object(Z_OBJ_P(entry))->call->done) {
+                done = entry;
+                return true;
+            }
+        } ZEND_HASH_FOREACH_END();
+        return false;
+    });
+    if (done == NULL) {
+        return;
+    }
+    ZEND_HASH_FOREACH_KEY_VAL(futures, index, key, entry) {
+        ZVAL_DEREF(entry);
+        if (entry == done) {
+            if (key) {
+                RETURN_STR_COPY(key);
+            }
+            RETURN_LONG((zend_long)index);
+        }
+    } ZEND_HASH_FOREACH_END();
+}
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_thrift_bridge_future_wait, 0, 0, 0)
+    ZEND_ARG_INFO(0, timeout)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_thrift_bridge_future_wait_many, 0, 0, 1)
+    ZEND_ARG_INFO(0, futures)
+    ZEND_ARG_INFO(0, timeout)
+ZEND_END_ARG_INFO()
+
+const zend_function_entry thrift_bridge_future_methods[] = {
+    ZEND_ME(ThriftBridgeFuture, wait,    arginfo_thrift_bridge_future_wait, ZEND_ACC_PUBLIC)
+    ZEND_ME(ThriftBridgeFuture, isDone,  NULL, ZEND_ACC_PUBLIC)
+    ZEND_ME(ThriftBridgeFuture, waitAll, arginfo_thrift_bridge_future_wait_many, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
+    ZEND_ME(ThriftBridgeFuture, waitAny, arginfo_thrift_bridge_future_wait_many, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
+    PHP_FE_END
+};
+
+static void php_thrift_bridge_future_init(INIT_FUNC_ARGS)
+{
+    zend_class_entry ce;
+
+    INIT_CLASS_ENTRY(ce, "ThriftBridgeFuture", thrift_bridge_future_methods);
+    thrift_bridge_future_ce = zend_register_internal_class_ex(&ce, NULL);
+    thrift_bridge_future_ce->ce_flags |= ZEND_ACC_FINAL;
+    thrift_bridge_future_ce->create_object = php_thrift_bridge_future_create_object;
+
+    memcpy(&thrift_bridge_future_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+    thrift_bridge_future_handlers.offset = XtOffsetOf(php_thrift_bridge_future_object, std);
+    thrift_bridge_future_handlers.free_obj = php_thrift_bridge_future_free_object;
+    thrift_bridge_future_handlers.clone_obj = NULL;
 }
 
 // --- PHP 函数声明 ---
-PHP_FUNCTION(call_thrift_processor_generic);
+PHP_FUNCTION(thrift_bridge_call_raw);
+PHP_FUNCTION(thrift_bridge_multi_call);
+PHP_FUNCTION(thrift_bridge_stats);
+PHP_FUNCTION(thrift_bridge_metrics_prometheus);
+PHP_FUNCTION(thrift_bridge_last_call_profile);
+PHP_FUNCTION(thrift_bridge_sampling_dump);
+PHP_FUNCTION(thrift_bridge_reload);
 PHP_RINIT_FUNCTION(thrift_bridge);
+PHP_RSHUTDOWN_FUNCTION(thrift_bridge);
 PHP_MINIT_FUNCTION(thrift_bridge);
 PHP_MINFO_FUNCTION(thrift_bridge);
 PHP_MSHUTDOWN_FUNCTION(thrift_bridge);
@@ -464,10 +5846,96 @@ PHP_MSHUTDOWN_FUNCTION(thrift_bridge);
 PHP_MINIT_FUNCTION(thrift_bridge)
 {
     memcpy(&thrift_bridge_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+    // zend_object 不在结构体开头，释放对象内存时需要知道偏移
+    thrift_bridge_handlers.offset = XtOffsetOf(php_thrift_bridge_transport_object, std);
     thrift_bridge_handlers.dtor_obj = php_thrift_bridge_transport_dtor_object;
     php_thrift_bridge_transport_init(type, module_number);
+    php_thrift_bridge_client_init(type, module_number);
+    php_thrift_bridge_future_init(type, module_number);
     ZEND_INIT_MODULE_GLOBALS(thrift_bridge, php_thrift_bridge_init_globals, NULL);
     REGISTER_INI_ENTRIES();
+    TC::stats_enabled = THRIFT_BRIDGE_G(stats);
+    if (TC::stats_enabled) {
+        // 在 fork 之前创建，FPM 的所有工作进程共享同一块统计区域
+        zend_long slots = THRIFT_BRIDGE_G(metrics_slots);
+        if (slots < 1) {
+            // 自动：每个写入线程一个槽位 (线程退出后释放，新线程接管)。MINIT 时还不知道 FPM 的
+            // pm.max_children，按 kMetricsDefaultWorkers 个工作进程、每个带满异步线程池估计；
+            // 未写入的槽位只占地址空间，不占内存
+            zend_long threads = THRIFT_BRIDGE_G(async_threads);
+            slots = TC::kMetricsDefaultWorkers * (1 + (threads > 0 ? threads : 1));
+        }
+        if (slots > TC::kMetricsMaxSlots) {
+            slots = TC::kMetricsMaxSlots;
+        }
+        TC::stats_enabled = TC::metrics_open(THRIFT_BRIDGE_G(metrics_file), (uint32_t)slots);
+        pthread_atfork(NULL, NULL, TC::metrics_atfork_child);
+    }
+    pthread_atfork(NULL, NULL, TC::reader_atfork_child);
+    TC::method_rules_parse(THRIFT_BRIDGE_G(coalesce), TC::coalesce_rules);
+    TC::coalesce_enabled = !TC::coalesce_rules.empty();
+    TC::method_rules_parse(THRIFT_BRIDGE_G(memoize), TC::memo_rules);
+    TC::memo_enabled = !TC::memo_rules.empty();
+    const char *sidecar = THRIFT_BRIDGE_G(sidecar);
+    if (sidecar && *sidecar) {
+        zend_long timeout = THRIFT_BRIDGE_G(sidecar_timeout);
+        TC::sidecar_enabled = true;
+        TC::sidecar_path = sidecar;
+        TC::sidecar_timeout_ms = (int)(timeout < 1 ? 1 : timeout > 3600000 ? 3600000 : timeout);
+        zend_long ring = THRIFT_BRIDGE_G(sidecar_ring);
+        if (ring > 0) {
+            // 至少放得下一条常见的小请求，最多 1 GB
+            TC::sidecar_ring_size = TC::ring_size_align((size_t)(ring < 4096 ? 4096 : ring > (1L << 30) ? (1L << 30) : ring));
+        }
+        pthread_atfork(NULL, NULL, TC::sidecar_atfork_child);
+    }
+    if (THRIFT_BRIDGE_G(cache_size) > 0) {
+        // 与统计区域一样在 fork 之前创建，FPM 的所有工作进程共用同一份缓存
+        zend_long entry_max = THRIFT_BRIDGE_G(cache_entry_max);
+        TC::cache_enabled = TC::cache_open((size_t)THRIFT_BRIDGE_G(cache_size), entry_max < 256 ? 256 : (size_t)entry_max);
+    }
+    // 事件回调要在插件注册处理器之前创建 (见 ProcessorFactory::registerProcessor)
+    TC::profile_enabled = THRIFT_BRIDGE_G(profile);
+    if (TC::profile_enabled) {
+        TC::phase_event_handler = std::make_shared<TC::PhaseEventHandler>();
+    }
+#ifdef THRIFT_BRIDGE_HAVE_PROBES
+    else {
+        TC::phase_event_handler = std::make_shared<TC::ProbeEventHandler>();
+    }
+#endif
+    const char *slow_log = THRIFT_BRIDGE_G(slow_log);
+    if (slow_log && *slow_log) {
+        double threshold_ms = THRIFT_BRIDGE_G(slow_log_threshold);
+        zend_long dump_bytes = THRIFT_BRIDGE_G(slow_log_dump_bytes);
+        TC::slow_log_enabled = true;
+        TC::slow_log_path = slow_log;
+        TC::slow_log_threshold_ns = threshold_ms > 0 ? (uint64_t)(threshold_ms * 1e6) : 0;
+        TC::slow_log_dump_bytes = (uint32_t)(dump_bytes < 0 ? 0 : dump_bytes > TC::kSlowLogDumpMax ? TC::kSlowLogDumpMax : dump_bytes);
+    }
+    double sampling_rate = THRIFT_BRIDGE_G(sampling_rate);
+    if (sampling_rate > 0) {
+        zend_long interval = THRIFT_BRIDGE_G(sampling_interval);
+        const char *dir = THRIFT_BRIDGE_G(sampling_dir);
+        TC::sampling_enabled = true;
+        TC::slow_log_sampling = true;
+        TC::sampling_threshold = sampling_rate >= 1 ? UINT32_MAX : (uint32_t)(sampling_rate * 4294967296.0);
+        TC::sampling_interval_us = (uint32_t)(interval < 100 ? 100 : interval > 1000000 ? 1000000 : interval);
+        TC::sampling_dir = (dir && *dir) ? dir : "/tmp";
+        TC::sampling_signal = SIGRTMAX - 2;
+        TC::sampling_dump_signal = SIGRTMAX - 1;
+        TC::sampling_mutex = new std::mutex();
+        TC::sampling_profiles = new std::map<std::string, TC::SampleMap>();
+        TC::sampling_install_handlers();
+        pthread_atfork(NULL, NULL, TC::sampling_atfork_child);
+    }
+
+    // 预加载：插件代码、注册表和编译好的 IDL 描述在 fork 前就绪，
+    // 各工作进程不再重复扫描目录和 dlopen，第一个请求也没有初始化开销
+    if (THRIFT_BRIDGE_G(preload) && !TC::sidecar_enabled) {
+        const char *plugin_path = THRIFT_BRIDGE_G(plugin_dir);
+        initialize_core_lib(plugin_path ? plugin_path : "./plugins");
+    }
     return SUCCESS;
 }
 
@@ -475,48 +5943,154 @@ PHP_MINIT_FUNCTION(thrift_bridge)
 PHP_MSHUTDOWN_FUNCTION(thrift_bridge)
 {
     UNREGISTER_INI_ENTRIES(); 
+    // 先停线程池，工作线程不再引用服务条目后才能清理
+    TC::stop_async_thread_pool();
+    TC::slow_log_stop();
     global_factory.clean();   
+    TC::phase_event_handler.reset();
+    TC::metrics_close();
+    TC::cache_close();
+    TC::sidecar_disconnect();
     // 释放所有插件句柄 (防止内存泄漏，虽然在 MSHUTDOWN 时 PHP 进程可能即将退出)
-    for (void* handle : plugin_handles) {
-        dlclose(handle);
+    for (auto* list : { &plugins, &retired_plugins }) {
+        for (const auto& plugin : *list) {
+            dlclose(plugin->handle);
+        }
+        list->clear();
+    }
+    if (watch_fd >= 0) {
+        close(watch_fd);
+        watch_fd = -1;
     }
-    plugin_handles.clear();
     // 注销 INI 配置
     return SUCCESS;
 }
 
 PHP_RINIT_FUNCTION(thrift_bridge)
 {
-    const char *plugin_path = THRIFT_BRIDGE_G(plugin_dir);
-    fprintf(stderr, "[DEBUG] RINIT Plugin Directory: %s\n", plugin_path ? plugin_path : "NULL");
-    if (plugin_path == NULL) {
-        plugin_path = "./plugins";
+    // 旁车模式：插件由守护进程加载，本进程不加载
+    if (TC::sidecar_enabled) {
+        TC::last_call_profile.id = 0;
+        return SUCCESS;
+    }
+    TC::reset_thread_call_state();
+    if (!core_initialized) {
+        const char *plugin_path = THRIFT_BRIDGE_G(plugin_dir);
+        if (plugin_path == NULL) {
+            plugin_path = "./plugins";
+        }
+        // 传递配置值给 C++ 核心库进行初始化
+        initialize_core_lib(plugin_path);
+    } else if (core_pid != getpid()) {
+        // 插件在父进程中加载：本进程 fork 后的第一个请求，重建不能跨 fork 的资源
+        core_pid = getpid();
+        TC::abandon_async_thread_pool();
+        for (const auto& plugin : plugins) {
+            if (plugin->child_init) {
+                plugin->child_init();
+            }
+        }
     }
-    // 传递配置值给 C++ 核心库进行初始化
-    initialize_core_lib(plugin_path);
+    if (THRIFT_BRIDGE_G(watch_plugins)) {
+        watch_plugins_poll();
+    }
+    collect_retired_plugins();
+    TC::reset_class_slots();
+    TC::last_call_profile.id = 0;
+    TC::slow_log_start();
     
     return SUCCESS;
 }
 
+// --- 请求关闭函数 (RSHUTDOWN) ---
+PHP_RSHUTDOWN_FUNCTION(thrift_bridge)
+{
+    // 记忆的响应在请求内存中，必须在请求结束前释放
+    TC::memo_clear();
+    return SUCCESS;
+}
+
 // --- PHP MINFO (模块信息) 函数 ---
 PHP_MINFO_FUNCTION(thrift_bridge)
 {
     php_info_print_table_start();
     php_info_print_table_header(2, "Thrift Dynamic RPC Bridge", "enabled");
     php_info_print_table_row(2, "Version", "1.0");
-    php_info_print_table_row(2, "CoreLib Status", "Initialized via RINIT");
+    php_info_print_table_row(2, "CoreLib Status", !core_initialized ? "Not initialized"
+        : THRIFT_BRIDGE_G(preload) ? "Preloaded in MINIT" : "Initialized via RINIT");
+    php_info_print_table_row(2, "Plugin API Version", ZEND_TOSTR(THRIFT_BRIDGE_PLUGIN_API_VERSION));
+    php_info_print_table_row(2, "Phase Profiling", TC::profile_enabled ? "enabled" : "disabled");
+    php_info_print_table_row(2, "Slow Call Log", TC::slow_log_enabled ? TC::slow_log_path.c_str() : "disabled");
+    php_info_print_table_row(2, "Handler Sampling", TC::sampling_enabled ? "enabled" : "disabled");
+    php_info_print_table_row(2, "Plugin Watch", THRIFT_BRIDGE_G(watch_plugins) ? "enabled" : "disabled");
+    php_info_print_table_row(2, "Call Coalescing", TC::coalesce_enabled ? THRIFT_BRIDGE_G(coalesce) : "disabled");
+    php_info_print_table_row(2, "Sidecar", TC::sidecar_enabled ? TC::sidecar_path.c_str() : "disabled (plugins loaded in-process)");
+    char ring_info[64] = "disabled";
+    if (TC::sidecar_enabled && TC::sidecar_ring_size > 0) {
+        snprintf(ring_info, sizeof(ring_info), "%zu bytes per direction", TC::sidecar_ring_size);
+    }
+    php_info_print_table_row(2, "Sidecar Ring", ring_info);
+    php_info_print_table_row(2, "Request Memoization", TC::memo_enabled ? THRIFT_BRIDGE_G(memoize) : "disabled");
+    char cache_info[96] = "disabled";
+    if (TC::cache_enabled) {
+        snprintf(cache_info, sizeof(cache_info), "%u slots of %u bytes",
+                 TC::cache_region->set_count * TC::kCacheWays, TC::cache_region->slot_size);
+    }
+    php_info_print_table_row(2, "Response Cache", cache_info);
     php_info_print_table_end();
+
+    if (core_initialized) {
+        php_info_print_table_start();
+        php_info_print_table_header(3, "Service", "Processor", "Protocol");
+        global_factory.forEachService([](const TC::ServiceEntry& entry) {
+            php_info_print_table_row(3, entry.name.c_str(),
+                entry.current()->flavor == THRIFT_BRIDGE_PROCESSOR_BINARY_MEMBUF ? "templated (TBinaryProtocolT<TMemoryBuffer>)" : "virtual",
+                TC::protocol_name(php_thrift_bridge_service_protocol(entry.name.data(), entry.name.size())));
+        });
+        php_info_print_table_end();
+    }
+
+    if (TC::stats_enabled) {
+        std::map<std::string, TC::StatsSummary> summaries;
+        TC::stats_collect_region(TC::metrics_region, (int32_t)getpid(), summaries, TC::metrics_self_start());
+
+        char slots[32];
+        snprintf(slots, sizeof(slots), "%u", TC::metrics_region->slot_count);
+        php_info_print_table_start();
+        php_info_print_table_row(2, "Metrics Region", TC::metrics_path.empty() ? "anonymous shared memory" : TC::metrics_path.c_str());
+        php_info_print_table_row(2, "Metrics Slots", slots);
+        php_info_print_table_end();
+
+        php_info_print_table_start();
+        php_info_print_table_header(6, "Service / Method (this process)", "Calls", "Errors", "p50 (us)", "p99 (us)", "Max (us)");
+        auto row = [](const std::string &name, const TC::StatsCounters &c) {
+            char calls[32], errors[32], p50[32], p99[32], max[32];
+            snprintf(calls, sizeof(calls), "%llu", (unsigned long long)c.calls);
+            snprintf(errors, sizeof(errors), "%llu", (unsigned long long)c.errors);
+            snprintf(p50, sizeof(p50), "%.1f", TC::stats_percentile(c, 0.5) / 1000.0);
+            snprintf(p99, sizeof(p99), "%.1f", TC::stats_percentile(c, 0.99) / 1000.0);
+            snprintf(max, sizeof(max), "%.1f", TC::stats_percentile(c, 1.0) / 1000.0);
+            php_info_print_table_row(6, name.c_str(), calls, errors, p50, p99, max);
+        };
+        for (const auto &item : summaries) {
+            row(item.first, item.second.counters);
+            for (const auto &method : item.second.methods) {
+                row(item.first + "::" + method.first, method.second);
+            }
+        }
+        php_info_print_table_end();
+    }
 }
 
 // --- 扩展模块入口定义 ---
 zend_module_entry thrift_bridge_module_entry = {
     STANDARD_MODULE_HEADER,
     "thrift_bridge",        /* 扩展名称 */
-    NULL, 
+    thrift_bridge_functions, /* 导出的 PHP 函数 */
     PHP_MINIT(thrift_bridge),                   /* MINT (模块初始化) */
     PHP_MSHUTDOWN(thrift_bridge),                   /* MSHUTDOWN (模块关闭) */
     PHP_RINIT(thrift_bridge), /* RINIT (请求初始化) */
-    NULL,                   /* RSHUTDOWN (请求关闭) */
+    PHP_RSHUTDOWN(thrift_bridge), /* RSHUTDOWN (请求关闭) */
     PHP_MINFO(thrift_bridge), /* MINFO (模块信息) */
     "1.0",                  /* 扩展版本 */
     STANDARD_MODULE_PROPERTIES
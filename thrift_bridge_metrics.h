@@ -0,0 +1,444 @@
+// common/thrift_bridge_metrics.h
+// 调用统计的共享内存布局。扩展 (thrift_bridge.c) 写入，命令行工具 (tools/thrift_bridge_metrics.cc)
+// 只读映射同一个文件导出；两边必须使用同一份头文件编译。
+#ifndef THRIFT_BRIDGE_METRICS_H
+#define THRIFT_BRIDGE_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace TC {
+
+// --- 统计表 ---
+// 每个写入线程独占一张表 (单写者)，计数器用 relaxed 的读-加-写 (x86 上即普通 add)，
+// 没有锁和原子 RMW；读取端汇总所有表。表项自带名字，汇总时按名字合并。
+static const int kStatsMaxServices = 64;
+static const int kStatsMaxMethods = 256;
+static const int kStatsNameMax = 64;
+
+// HDR 风格的对数-线性直方图：每个 2 的幂区间再等分 2^kLatencySubBits 份，相对误差不超过 12.5%。
+// 单位纳秒，0..15 各占一个精确桶，不小于 2^kLatencyMaxExp ns (约 17 秒) 的计入最后一个桶。
+static const int kLatencySubBits = 3;
+static const int kLatencyMaxExp = 34;
+static const int kLatencyBuckets = ((kLatencyMaxExp - kLatencySubBits) << kLatencySubBits) + (1 << kLatencySubBits) + 1;
+
+static inline int latency_bucket(uint64_t ns) {
+    if (ns < (2u << kLatencySubBits)) {
+        return (int)ns;
+    }
+    if (ns >= (1ull << kLatencyMaxExp)) {
+        return kLatencyBuckets - 1;
+    }
+    int e = 63 - __builtin_clzll(ns);
+    return ((e - kLatencySubBits) << kLatencySubBits) + (int)(ns >> (e - kLatencySubBits));
+}
+
+static inline uint64_t latency_bucket_lower(int index) {
+    if (index < (2 << kLatencySubBits)) {
+        return (uint64_t)index;
+    }
+    int shift = (index >> kLatencySubBits) - 1;
+    uint64_t mantissa = (uint64_t)((index & ((1 << kLatencySubBits) - 1)) + (1 << kLatencySubBits));
+    return mantissa << shift;
+}
+
+static inline uint64_t latency_bucket_width(int index) {
+    if (index < (2 << kLatencySubBits)) {
+        return 1;
+    }
+    return 1ull << ((index >> kLatencySubBits) - 1);
+}
+
+// 桶所代表的值 (区间中点)
+static inline uint64_t latency_bucket_value(int index) {
+    return latency_bucket_lower(index) + (latency_bucket_width(index) >> 1);
+}
+
+// 一次调用的各个阶段 (thrift_bridge.profile 打开时记录)，顺序即调用中的先后顺序
+enum CallPhase {
+    PHASE_PHP_ENCODE = 0,  // PHP 侧序列化：本次调用的第一次 write() 到 flush()
+    PHASE_DISPATCH,        // flush() 进入核心库到处理器开始解码参数 (含读取消息头、查找方法)
+    PHASE_DECODE,          // 处理器解码参数
+    PHASE_HANDLER,         // 业务 handler
+    PHASE_ENCODE,          // 处理器编码响应
+    PHASE_COPY,            // 处理器返回到响应装入 rBuf、flush() 返回
+    PHASE_PHP_DECODE,      // PHP 侧反序列化：flush() 返回到 read() 取完响应
+    PHASE_COUNT
+};
+
+static const char* const kPhaseNames[PHASE_COUNT] = {
+    "php_encode", "dispatch", "decode", "handler", "encode", "copy", "php_decode"
+};
+
+struct StatsCounters {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t request_bytes;
+    uint64_t response_bytes;
+    uint64_t latency_sum_ns;
+    uint64_t latency[kLatencyBuckets];
+    // 记录了分阶段耗时的调用数与各阶段耗时之和
+    uint64_t profiled;
+    uint64_t phase_sum_ns[PHASE_COUNT];
+    // 没有执行处理器、直接拿到同时进行的相同调用的响应的调用数 (thrift_bridge.coalesce)
+    uint64_t coalesced;
+    // 没有执行处理器、直接由共享响应缓存应答的调用数 (THRIFT_BRIDGE_METHOD_CACHEABLE)
+    uint64_t cached;
+};
+
+struct StatsEntry {
+    uint32_t service;    // 方法项所属服务在 services 中的下标
+    uint32_t name_len;   // 0 表示未使用；写者先填名字再发布
+    char name[kStatsNameMax];
+    StatsCounters counters;
+};
+
+struct StatsTable {
+    uint32_t method_count;
+    // 写者私有：每个服务最近命中的方法项 (下标 + 1)，连续调用同一方法时不必比较名字
+    uint16_t last_method[kStatsMaxServices];
+    StatsEntry services[kStatsMaxServices];
+    StatsEntry methods[kStatsMaxMethods];
+};
+
+static inline uint64_t stat_load(const uint64_t& counter) {
+    return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+}
+
+static inline void stat_add(uint64_t& counter, uint64_t value) {
+    __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+// --- 共享内存区域 ---
+// [MetricsHeader，占一页][槽位 0][槽位 1]...，每个槽位按页对齐，互不共享缓存行。
+// 槽位由写入线程 (PHP 工作进程的主线程、异步线程池的线程) 认领；线程退出时释放，
+// 所属进程崩溃 (或 pid 已被别的进程复用) 时视同释放。释放的槽位由新线程接管并在原计数上
+// 继续累加，汇总出的计数器因此在进程回收后保持单调。
+static const uint32_t kMetricsMagic = 0x314d4254;  // "TBM1"
+static const uint32_t kMetricsVersion = 4;
+static const size_t kMetricsPageSize = 4096;
+
+enum MetricsSlotState {
+    METRICS_SLOT_FREE = 0,
+    METRICS_SLOT_USED = 1
+};
+
+struct MetricsHeader {
+    uint32_t magic;          // 初始化完成后最后写入
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    uint64_t table_size;     // sizeof(StatsTable)，两端布局不一致时拒绝读取
+};
+
+// MetricsSlot::pid 为此值表示所属线程已经退出，槽位可以接管
+static const int32_t kMetricsSlotReleased = -1;
+
+struct MetricsSlot {
+    uint32_t state;          // MetricsSlotState
+    int32_t pid;             // 认领槽位的进程，认领 (接管) 过程中短暂为 0，释放后为 kMetricsSlotReleased
+    uint64_t owner_start;    // 所属进程的启动时间 (/proc/<pid>/stat 的 starttime)，用于识别被复用的 pid
+    char padding[48];
+    StatsTable table;
+};
+
+static inline size_t metrics_slot_size() {
+    return (sizeof(MetricsSlot) + kMetricsPageSize - 1) & ~(kMetricsPageSize - 1);
+}
+
+static inline size_t metrics_region_size(uint32_t slot_count) {
+    return kMetricsPageSize + metrics_slot_size() * slot_count;
+}
+
+static inline MetricsSlot* metrics_slot(MetricsHeader* header, uint32_t index) {
+    return (MetricsSlot*)((char*)header + kMetricsPageSize + (size_t)header->slot_size * index);
+}
+
+// 检查映射的区域是否由同一布局初始化
+static inline bool metrics_region_valid(const MetricsHeader* header, size_t mapped_size) {
+    return mapped_size >= kMetricsPageSize &&
+           __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == kMetricsMagic &&
+           header->version == kMetricsVersion &&
+           header->slot_size == metrics_slot_size() &&
+           header->table_size == sizeof(StatsTable) &&
+           mapped_size >= metrics_region_size(header->slot_count);
+}
+
+// --- 汇总 ---
+struct StatsSummary {
+    StatsCounters counters;
+    std::map<std::string, StatsCounters> methods;
+};
+
+static inline void stats_merge(StatsCounters& into, const StatsCounters& from) {
+    into.calls += stat_load(from.calls);
+    into.errors += stat_load(from.errors);
+    into.request_bytes += stat_load(from.request_bytes);
+    into.response_bytes += stat_load(from.response_bytes);
+    into.latency_sum_ns += stat_load(from.latency_sum_ns);
+    for (int i = 0; i < kLatencyBuckets; i++) {
+        into.latency[i] += stat_load(from.latency[i]);
+    }
+    into.profiled += stat_load(from.profiled);
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        into.phase_sum_ns[i] += stat_load(from.phase_sum_ns[i]);
+    }
+    into.coalesced += stat_load(from.coalesced);
+    into.cached += stat_load(from.cached);
+}
+
+// 把一张统计表按服务名合并进 out。写者先加服务项再加方法项，这里反过来先读方法项、
+// 再读服务项，读到的服务计数不会少于其方法之和 (stats_residual 仍按 0 截断以防万一)
+static inline void stats_collect_table(const StatsTable* table, std::map<std::string, StatsSummary>& out) {
+    const StatsEntry* services[kStatsMaxServices] = { nullptr };
+    for (int i = 0; i < kStatsMaxServices; i++) {
+        const StatsEntry& entry = table->services[i];
+        if (__atomic_load_n(&entry.name_len, __ATOMIC_ACQUIRE) != 0) {
+            services[i] = &entry;
+        }
+    }
+    uint32_t method_count = __atomic_load_n(&table->method_count, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < method_count && i < (uint32_t)kStatsMaxMethods; i++) {
+        const StatsEntry& entry = table->methods[i];
+        if (entry.service >= (uint32_t)kStatsMaxServices || services[entry.service] == nullptr) {
+            continue;
+        }
+        const StatsEntry* service = services[entry.service];
+        StatsSummary& summary = out[std::string(service->name, service->name_len)];
+        stats_merge(summary.methods[std::string(entry.name, entry.name_len)], entry.counters);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    for (int i = 0; i < kStatsMaxServices; i++) {
+        if (services[i] != nullptr) {
+            stats_merge(out[std::string(services[i]->name, services[i]->name_len)].counters, services[i]->counters);
+        }
+    }
+}
+
+// 汇总区域内所有已认领的槽位；pid 非 0 时只汇总该进程认领的槽位 (start 非 0 时还要求启动时间一致，
+// 不把同一 pid 之前的进程留下的槽位算进来)
+static inline void stats_collect_region(MetricsHeader* header, int32_t pid, std::map<std::string, StatsSummary>& out,
+                                        uint64_t start = 0) {
+    for (uint32_t i = 0; i < header->slot_count; i++) {
+        MetricsSlot* slot = metrics_slot(header, i);
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != METRICS_SLOT_USED) {
+            continue;
+        }
+        if (pid != 0 && (__atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE) != pid
+                         || (start != 0 && __atomic_load_n(&slot->owner_start, __ATOMIC_RELAXED) != start))) {
+            continue;
+        }
+        stats_collect_table(&slot->table, out);
+    }
+}
+
+// 第 q 分位 (0 < q <= 1) 的延迟，单位纳秒
+static inline uint64_t stats_percentile(const StatsCounters& c, double q) {
+    uint64_t total = 0;
+    for (int i = 0; i < kLatencyBuckets; i++) {
+        total += c.latency[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)(q * (double)total + 0.999999);
+    if (target == 0) {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < kLatencyBuckets; i++) {
+        seen += c.latency[i];
+        if (seen >= target) {
+            return latency_bucket_value(i);
+        }
+    }
+    return latency_bucket_value(kLatencyBuckets - 1);
+}
+
+// --- Prometheus 文本格式 ---
+// 直方图按固定的 le 边界 (秒) 输出：HDR 桶整体落在边界以内才计入该边界，
+// 因此各边界上的累计值是保守的 (不会把超过边界的调用算进去)。
+static const uint64_t kPrometheusBoundsNs[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 500000000,
+    1000000000, 2500000000ull, 5000000000ull, 10000000000ull
+};
+
+static inline void prometheus_escape(std::string& out, const std::string& value) {
+    for (char ch : value) {
+        if (ch == '\\' || ch == '"') {
+            out += '\\';
+            out += ch;
+        } else if (ch == '\n') {
+            out += "\\n";
+        } else {
+            out += ch;
+        }
+    }
+}
+
+// {service="..",method=".."[,key=".."]}
+static inline void prometheus_labels(std::string& out, const std::string& service, const std::string& method,
+                                     const char* key = nullptr, const char* value = nullptr) {
+    out += "{service=\"";
+    prometheus_escape(out, service);
+    out += "\",method=\"";
+    prometheus_escape(out, method);
+    out += '"';
+    if (key) {
+        out += ',';
+        out += key;
+        out += "=\"";
+        out += value;
+        out += '"';
+    }
+    out += '}';
+}
+
+static inline void prometheus_value(std::string& out, uint64_t value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), " %llu\n", (unsigned long long)value);
+    out += buf;
+}
+
+static inline void prometheus_histogram(std::string& out, const std::string& service,
+                                        const std::string& method, const StatsCounters& c) {
+    char le[32];
+    const size_t bound_count = sizeof(kPrometheusBoundsNs) / sizeof(kPrometheusBoundsNs[0]);
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    for (size_t b = 0; b < bound_count; b++) {
+        while (bucket < kLatencyBuckets - 1 &&
+               latency_bucket_lower(bucket) + latency_bucket_width(bucket) - 1 <= kPrometheusBoundsNs[b]) {
+            cumulative += c.latency[bucket++];
+        }
+        snprintf(le, sizeof(le), "%g", kPrometheusBoundsNs[b] / 1e9);
+        out += "thrift_bridge_latency_seconds_bucket";
+        prometheus_labels(out, service, method, "le", le);
+        prometheus_value(out, cumulative);
+    }
+    out += "thrift_bridge_latency_seconds_bucket";
+    prometheus_labels(out, service, method, "le", "+Inf");
+    prometheus_value(out, c.calls);
+
+    char sum[48];
+    snprintf(sum, sizeof(sum), " %.9f\n", c.latency_sum_ns / 1e9);
+    out += "thrift_bridge_latency_seconds_sum";
+    prometheus_labels(out, service, method);
+    out += sum;
+
+    out += "thrift_bridge_latency_seconds_count";
+    prometheus_labels(out, service, method);
+    prometheus_value(out, c.calls);
+}
+
+// 无符号减法，不足时为 0 (并发读取时方法之和可能略多于服务总计)
+static inline void stat_sub(uint64_t& counter, uint64_t value) {
+    counter = counter > value ? counter - value : 0;
+}
+
+// 服务总计减去已识别方法之和，即无法区分方法的调用 (THeader 帧、方法表已满)
+static inline StatsCounters stats_residual(const StatsSummary& summary) {
+    StatsCounters rest = summary.counters;
+    for (const auto& method : summary.methods) {
+        const StatsCounters& m = method.second;
+        stat_sub(rest.calls, m.calls);
+        stat_sub(rest.errors, m.errors);
+        stat_sub(rest.request_bytes, m.request_bytes);
+        stat_sub(rest.response_bytes, m.response_bytes);
+        stat_sub(rest.latency_sum_ns, m.latency_sum_ns);
+        for (int i = 0; i < kLatencyBuckets; i++) {
+            stat_sub(rest.latency[i], m.latency[i]);
+        }
+        stat_sub(rest.profiled, m.profiled);
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            stat_sub(rest.phase_sum_ns[i], m.phase_sum_ns[i]);
+        }
+        stat_sub(rest.coalesced, m.coalesced);
+        stat_sub(rest.cached, m.cached);
+    }
+    return rest;
+}
+
+// 输出所有服务/方法的计数器与延迟直方图；无法区分方法的调用以 method="" 输出
+static inline void stats_prometheus(const std::map<std::string, StatsSummary>& summaries, std::string& out) {
+    struct Series {
+        const std::string* service;
+        std::string method;
+        StatsCounters counters;
+    };
+    std::vector<Series> series;
+    for (const auto& item : summaries) {
+        for (const auto& method : item.second.methods) {
+            series.push_back(Series{ &item.first, method.first, method.second });
+        }
+        StatsCounters rest = stats_residual(item.second);
+        if (rest.calls > 0 || item.second.methods.empty()) {
+            series.push_back(Series{ &item.first, std::string(), rest });
+        }
+    }
+
+    static const struct {
+        const char* name;
+        const char* help;
+        uint64_t StatsCounters::*field;
+    } counters[] = {
+        { "thrift_bridge_calls_total", "Calls dispatched to the processor.", &StatsCounters::calls },
+        { "thrift_bridge_errors_total", "Calls that failed in the processor.", &StatsCounters::errors },
+        { "thrift_bridge_request_bytes_total", "Request bytes passed to the processor.", &StatsCounters::request_bytes },
+        { "thrift_bridge_response_bytes_total", "Response bytes produced by the processor.", &StatsCounters::response_bytes },
+        { "thrift_bridge_profiled_calls_total", "Calls with a per-phase timing breakdown.", &StatsCounters::profiled },
+        { "thrift_bridge_coalesced_calls_total", "Calls answered with the response of an identical concurrent call.", &StatsCounters::coalesced },
+        { "thrift_bridge_cached_calls_total", "Calls answered from the shared response cache.", &StatsCounters::cached },
+    };
+    for (const auto& counter : counters) {
+        out += "# HELP ";
+        out += counter.name;
+        out += ' ';
+        out += counter.help;
+        out += "\n# TYPE ";
+        out += counter.name;
+        out += " counter\n";
+        for (const Series& s : series) {
+            out += counter.name;
+            prometheus_labels(out, *s.service, s.method);
+            prometheus_value(out, s.counters.*counter.field);
+        }
+    }
+
+    bool profiled = false;
+    for (const Series& s : series) {
+        profiled = profiled || s.counters.profiled > 0;
+    }
+    if (profiled) {
+        out += "# HELP thrift_bridge_phase_seconds_total Time spent in each phase of profiled calls.\n";
+        out += "# TYPE thrift_bridge_phase_seconds_total counter\n";
+        for (const Series& s : series) {
+            if (s.counters.profiled == 0) {
+                continue;
+            }
+            for (int i = 0; i < PHASE_COUNT; i++) {
+                char sum[48];
+                snprintf(sum, sizeof(sum), " %.9f\n", s.counters.phase_sum_ns[i] / 1e9);
+                out += "thrift_bridge_phase_seconds_total";
+                prometheus_labels(out, *s.service, s.method, "phase", kPhaseNames[i]);
+                out += sum;
+            }
+        }
+    }
+
+    out += "# HELP thrift_bridge_latency_seconds Processor latency.\n";
+    out += "# TYPE thrift_bridge_latency_seconds histogram\n";
+    for (const Series& s : series) {
+        prometheus_histogram(out, *s.service, s.method, s.counters);
+    }
+}
+
+}
+
+#endif // THRIFT_BRIDGE_METRICS_H
@@ -0,0 +1,357 @@
+// common/thrift_bridge_ring.h
+// 旁车模式的共享内存通道。PHP 工作线程创建一块 memfd，经 Unix socket (SCM_RIGHTS) 交给旁车守护进程，
+// 两边映射同一块内存：请求环由扩展 (thrift_bridge.c) 写、守护进程 (tools/thrift_bridge_sidecar.cc) 读，
+// 响应环反之。两边必须使用同一份头文件编译。
+#ifndef THRIFT_BRIDGE_RING_H
+#define THRIFT_BRIDGE_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+namespace TC {
+
+// --- 单生产者单消费者环形缓冲区 ---
+// head/tail 是单调递增的字节位置，各占一个缓存行，只由各自一方写入。消息为 [长度 4B][内容]，
+// 按 4 字节对齐，长度字段不会跨越环尾；长度为 kRingWrap 表示从这里到环尾的空间跳过。
+// 等待的一方先自旋 (次数自适应)，仍没有进展才在共享的 futex 字上睡眠；
+// 另一方只在对方声明睡眠时才 futex_wake，忙碌时两边都没有系统调用。
+static const uint32_t kRingMagic = 0x31524254;  // "TBR1"
+static const uint32_t kRingVersion = 1;
+static const uint32_t kRingWrap = 0xffffffffu;
+static const size_t kRingLine = 64;
+static const uint32_t kRingSpinMin = 64;
+static const uint32_t kRingSpinMax = 16384;
+
+struct RingHeader {
+    uint64_t head;
+    uint8_t head_padding[kRingLine - 8];
+    uint64_t tail;
+    uint8_t tail_padding[kRingLine - 8];
+    // 生产者发布数据后加一，消费者在其上睡眠
+    uint32_t data_signal;
+    uint32_t consumer_waiting;
+    uint8_t data_padding[kRingLine - 8];
+    // 消费者释放空间后加一，生产者在其上睡眠
+    uint32_t space_signal;
+    uint32_t producer_waiting;
+    uint8_t space_padding[kRingLine - 8];
+    uint64_t capacity;
+    uint8_t capacity_padding[kRingLine - 8];
+    // 随后是 capacity 字节的数据
+};
+
+// [ChannelHeader][请求环][响应环]
+struct ChannelHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t ring_size;
+    uint8_t padding[kRingLine - 16];
+};
+
+enum RingIndex {
+    RING_REQUEST = 0,
+    RING_RESPONSE = 1
+};
+
+// 响应消息的第一个字节
+enum RingStatus {
+    RING_STATUS_OK = 0,     // 随后是响应消息 (oneway 调用为空)
+    RING_STATUS_ERROR = 1   // 随后是错误信息
+};
+
+// 每一方自己的自旋次数：上一次在自旋中等到了就加倍，最终睡眠了就减半
+struct RingSpin {
+    uint32_t limit = 1024;
+};
+
+static inline size_t ring_size_align(size_t size) {
+    return (size + kRingLine - 1) / kRingLine * kRingLine;
+}
+
+static inline size_t ring_channel_size(size_t ring_size) {
+    return sizeof(ChannelHeader) + 2 * (sizeof(RingHeader) + ring_size);
+}
+
+static inline RingHeader* ring_at(void* channel, int index) {
+    ChannelHeader* header = (ChannelHeader*)channel;
+    return (RingHeader*)((char*)(header + 1) + (size_t)index * (sizeof(RingHeader) + header->ring_size));
+}
+
+static inline char* ring_data(RingHeader* ring) {
+    return (char*)(ring + 1);
+}
+
+static inline void ring_channel_init(void* channel, size_t ring_size) {
+    memset(channel, 0, ring_channel_size(ring_size));
+    ChannelHeader* header = (ChannelHeader*)channel;
+    header->ring_size = ring_size;
+    header->version = kRingVersion;
+    ring_at(channel, RING_REQUEST)->capacity = ring_size;
+    ring_at(channel, RING_RESPONSE)->capacity = ring_size;
+    __atomic_store_n(&header->magic, kRingMagic, __ATOMIC_RELEASE);
+}
+
+static inline bool ring_channel_valid(const void* channel, size_t mapped) {
+    const ChannelHeader* header = (const ChannelHeader*)channel;
+    return mapped >= sizeof(ChannelHeader) && header->magic == kRingMagic && header->version == kRingVersion
+        && header->ring_size >= kRingLine && header->ring_size % kRingLine == 0
+        && ring_channel_size(header->ring_size) == mapped;
+}
+
+static inline uint64_t ring_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void ring_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// 跨进程共享的 futex (不能用 FUTEX_PRIVATE_FLAG)
+static inline void ring_futex_wait(uint32_t* word, uint32_t expected, uint64_t timeout_ns) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(timeout_ns / 1000000000ull);
+    ts.tv_nsec = (long)(timeout_ns % 1000000000ull);
+    syscall(SYS_futex, word, FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+static inline void ring_futex_wake(uint32_t* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+// 等到 ready() 为真；timeout_ns 内没有等到返回 false
+template <typename Ready>
+static inline bool ring_wait(uint32_t* signal, uint32_t* waiting, RingSpin& spin, uint64_t timeout_ns, Ready ready) {
+    for (uint32_t i = 0; i < spin.limit; i++) {
+        if (ready()) {
+            if (i > 0) {
+                spin.limit = spin.limit < kRingSpinMax ? spin.limit * 2 : kRingSpinMax;
+            }
+            return true;
+        }
+        ring_cpu_relax();
+    }
+    spin.limit = spin.limit > kRingSpinMin ? spin.limit / 2 : kRingSpinMin;
+    uint64_t deadline = ring_now_ns() + timeout_ns;
+    for (;;) {
+        // 先声明睡眠再检查一次：与对方 "先发布、再看是否有人睡眠" 的顺序配合，不会丢失唤醒
+        __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        uint32_t seen = __atomic_load_n(signal, __ATOMIC_ACQUIRE);
+        if (ready()) {
+            __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+            return true;
+        }
+        uint64_t now = ring_now_ns();
+        if (now >= deadline) {
+            __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+            return false;
+        }
+        ring_futex_wait(signal, seen, deadline - now);
+        __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void ring_notify(uint32_t* signal, uint32_t* waiting) {
+    __atomic_fetch_add(signal, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+        ring_futex_wake(signal);
+    }
+}
+
+static inline size_t ring_align(size_t len) {
+    return (len + 3) & ~(size_t)3;
+}
+
+// --- 生产者 ---
+
+static inline void ring_publish(RingHeader* ring, uint64_t tail) {
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    ring_notify(&ring->data_signal, &ring->consumer_waiting);
+}
+
+static inline bool ring_wait_space(RingHeader* ring, uint64_t tail, size_t need, RingSpin& spin, uint64_t timeout_ns) {
+    return ring_wait(&ring->space_signal, &ring->producer_waiting, spin, timeout_ns, [ring, tail, need]() {
+        return ring->capacity - (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) >= need;
+    });
+}
+
+// 把 parts 拼成一条连续存放的消息写入，消费者可以原地读取。消息 (含长度字段) 必须放得进整个环
+static inline bool ring_write_contiguous(RingHeader* ring, const void* const* parts, const size_t* lens, int count,
+                                         RingSpin& spin, uint64_t timeout_ns) {
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        len += lens[i];
+    }
+    size_t record = 4 + ring_align(len);
+    if (record > ring->capacity || len >= kRingWrap) {
+        return false;
+    }
+    uint64_t tail = ring->tail;
+    size_t pos = (size_t)(tail % ring->capacity);
+    char* data = ring_data(ring);
+    if (ring->capacity - pos < record) {
+        // 环尾放不下：先发布跳过标记，消费者越过它之后消息从环首开始
+        size_t skip = ring->capacity - pos;
+        if (!ring_wait_space(ring, tail, skip, spin, timeout_ns)) {
+            return false;
+        }
+        uint32_t wrap = kRingWrap;
+        memcpy(data + pos, &wrap, 4);
+        tail += skip;
+        ring_publish(ring, tail);
+        pos = 0;
+    }
+    if (!ring_wait_space(ring, tail, record, spin, timeout_ns)) {
+        return false;
+    }
+    uint32_t len32 = (uint32_t)len;
+    memcpy(data + pos, &len32, 4);
+    char* w = data + pos + 4;
+    for (int i = 0; i < count; i++) {
+        memcpy(w, parts[i], lens[i]);
+        w += lens[i];
+    }
+    ring_publish(ring, tail + record);
+    return true;
+}
+
+// 按空间分段写入，消息可以比环大 (消费者边读边释放)
+static inline bool ring_write_stream(RingHeader* ring, const void* const* parts, const size_t* lens, int count,
+                                     RingSpin& spin, uint64_t timeout_ns) {
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        len += lens[i];
+    }
+    if (len >= kRingWrap) {
+        return false;
+    }
+    uint64_t tail = ring->tail;
+    if (!ring_wait_space(ring, tail, 4, spin, timeout_ns)) {
+        return false;
+    }
+    uint32_t len32 = (uint32_t)len;
+    memcpy(ring_data(ring) + tail % ring->capacity, &len32, 4);
+    tail += 4;
+    for (int i = 0; i < count; i++) {
+        const char* p = (const char*)parts[i];
+        size_t left = lens[i];
+        while (left > 0) {
+            uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            if (tail - head == ring->capacity) {
+                ring_publish(ring, tail);
+                if (!ring_wait_space(ring, tail, 1, spin, timeout_ns)) {
+                    return false;
+                }
+                head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            }
+            size_t pos = (size_t)(tail % ring->capacity);
+            size_t n = ring->capacity - (size_t)(tail - head);
+            n = n < ring->capacity - pos ? n : ring->capacity - pos;
+            n = n < left ? n : left;
+            memcpy(ring_data(ring) + pos, p, n);
+            p += n;
+            left -= n;
+            tail += n;
+        }
+    }
+    size_t padding = ring_align(len) - len;
+    if (padding && !ring_wait_space(ring, tail, padding, spin, timeout_ns)) {
+        return false;
+    }
+    ring_publish(ring, tail + padding);
+    return true;
+}
+
+// --- 消费者 ---
+
+static inline void ring_release(RingHeader* ring, uint64_t head) {
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    ring_notify(&ring->space_signal, &ring->producer_waiting);
+}
+
+static inline bool ring_wait_data(RingHeader* ring, uint64_t head, size_t need, RingSpin& spin, uint64_t timeout_ns) {
+    return ring_wait(&ring->data_signal, &ring->consumer_waiting, spin, timeout_ns, [ring, head, need]() {
+        return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - head >= need;
+    });
+}
+
+// 读取下一条消息的长度，跳过环尾的空白
+static inline bool ring_read_length(RingHeader* ring, uint32_t* len, RingSpin& spin, uint64_t timeout_ns) {
+    for (;;) {
+        uint64_t head = ring->head;
+        if (!ring_wait_data(ring, head, 4, spin, timeout_ns)) {
+            return false;
+        }
+        memcpy(len, ring_data(ring) + head % ring->capacity, 4);
+        if (*len != kRingWrap) {
+            return true;
+        }
+        ring_release(ring, head + (ring->capacity - head % ring->capacity));
+    }
+}
+
+// 等到整条连续存放的消息 (ring_write_contiguous) 可读，返回指向环内的指针；用完后 ring_consume。
+// 返回 nullptr 时 *len 为 0 表示超时；非 0 表示长度字段放不进环 (对端违反协议)，这条消息永远读不完，
+// 调用方应当放弃整个通道
+static inline const char* ring_peek(RingHeader* ring, uint32_t* len, RingSpin& spin, uint64_t timeout_ns) {
+    if (!ring_read_length(ring, len, spin, timeout_ns)) {
+        *len = 0;
+        return nullptr;
+    }
+    uint64_t head = ring->head;
+    if (4 + ring_align(*len) > ring->capacity) {
+        return nullptr;
+    }
+    if (!ring_wait_data(ring, head, 4 + ring_align(*len), spin, timeout_ns)) {
+        *len = 0;
+        return nullptr;
+    }
+    return ring_data(ring) + head % ring->capacity + 4;
+}
+
+static inline void ring_consume(RingHeader* ring, uint32_t len) {
+    ring_release(ring, ring->head + 4 + ring_align(len));
+}
+
+// 边等边复制出 len 字节 (ring_write_stream 写入的消息内容)，随时释放已复制的空间
+static inline bool ring_read_stream(RingHeader* ring, char* out, uint32_t len, RingSpin& spin, uint64_t timeout_ns) {
+    uint64_t head = ring->head + 4;
+    size_t left = len;
+    while (left > 0) {
+        if (!ring_wait_data(ring, head, 1, spin, timeout_ns)) {
+            return false;
+        }
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        size_t pos = (size_t)(head % ring->capacity);
+        size_t n = (size_t)(tail - head);
+        n = n < ring->capacity - pos ? n : ring->capacity - pos;
+        n = n < left ? n : left;
+        memcpy(out, ring_data(ring) + pos, n);
+        out += n;
+        left -= n;
+        head += n;
+        ring_release(ring, head);
+    }
+    size_t padding = ring_align(len) - len;
+    if (padding && !ring_wait_data(ring, head, padding, spin, timeout_ns)) {
+        return false;
+    }
+    ring_release(ring, head + padding);
+    return true;
+}
+
+}
+
+#endif // THRIFT_BRIDGE_RING_H
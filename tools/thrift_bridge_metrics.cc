@@ -0,0 +1,55 @@
+// tools/thrift_bridge_metrics.cc
+// 读取 thrift_bridge.metrics_file 指向的共享统计区域，汇总所有工作进程后以
+// Prometheus 文本格式输出到 stdout，可直接用作 node_exporter 的 textfile collector。
+//
+// 用法: thrift_bridge_metrics /dev/shm/thrift_bridge.metrics [> /var/lib/node_exporter/thrift_bridge.prom]
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../thrift_bridge_metrics.h"
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <metrics_file>\n", argv[0]);
+        return 2;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < TC::kMetricsPageSize) {
+        fprintf(stderr, "%s is not a thrift_bridge metrics file\n", argv[1]);
+        close(fd);
+        return 1;
+    }
+    void* addr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "cannot map %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    TC::MetricsHeader* header = (TC::MetricsHeader*)addr;
+    if (!TC::metrics_region_valid(header, (size_t)st.st_size)) {
+        fprintf(stderr, "%s has an incompatible layout (rebuild this tool with the extension's header)\n", argv[1]);
+        munmap(addr, (size_t)st.st_size);
+        return 1;
+    }
+
+    std::map<std::string, TC::StatsSummary> summaries;
+    TC::stats_collect_region(header, 0, summaries);
+    std::string text;
+    TC::stats_prometheus(summaries, text);
+    fwrite(text.data(), 1, text.size(), stdout);
+
+    munmap(addr, (size_t)st.st_size);
+    return 0;
+}
@@ -0,0 +1,380 @@
+// tools/thrift_bridge_sidecar.cc
+// 旁车守护进程：加载插件目录中的 .so (与扩展相同的插件，不需要重新编译)，在 Unix socket 上
+// 以 TNonblockingServer 提供服务。php.ini 中设置 thrift_bridge.sidecar 为同一路径后，
+// FPM 工作进程不再各自加载插件，ThriftBridgeTransport 的调用都交给本进程执行：
+// 插件在内存中的状态 (模型、查找表) 每台主机只有一份。
+//
+// 线路格式：TFramedTransport ([长度 4B][消息])，方法名形如 "服务名:方法名"
+// (TMultiplexedProcessor)；binary 与 compact 按每条消息的首字节区分。
+// 另在 <socket_path>.ring 上接受共享内存通道 (thrift_bridge.sidecar_ring，布局见 thrift_bridge_ring.h)：
+// 每个通道由一个线程服务，请求在环内原地解码，收发都不经过内核。
+//
+// 用法: thrift_bridge_sidecar <plugin_dir> <socket_path> [worker_threads]
+#include <dirent.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <thrift/concurrency/ThreadFactory.h>
+#include <thrift/concurrency/ThreadManager.h>
+#include <thrift/processor/TMultiplexedProcessor.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/protocol/TCompactProtocol.h>
+#include <thrift/server/TNonblockingServer.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TNonblockingServerSocket.h>
+
+#include "../plugin_api.h"
+#include "../thrift_bridge_ring.h"
+
+using namespace apache::thrift;
+using namespace apache::thrift::concurrency;
+using namespace apache::thrift::protocol;
+using namespace apache::thrift::server;
+using namespace apache::thrift::transport;
+
+static const char* PLUGIN_SUFFIX = ".so";
+
+// 见 plugin_api.h 的 thrift_bridge_context_api_version()；可执行文件需以 -rdynamic 链接，插件才能找到它
+extern "C" __attribute__((visibility("default"))) int thrift_bridge_host_api_version(void) {
+    return THRIFT_BRIDGE_PLUGIN_API_VERSION;
+}
+
+static TMultiplexedProcessor* multiplexed = nullptr;
+// 共享内存通道按服务名直接找处理器 (不经过 TMultiplexedProcessor)；加载完插件后只读
+static std::map<std::string, std::shared_ptr<TProcessor>> processors;
+
+static void register_processor(void* factory_instance, const char* service_name, void* t_processor_ptr) {
+    std::shared_ptr<TProcessor> processor((TProcessor*)t_processor_ptr);
+    static_cast<TMultiplexedProcessor*>(factory_instance)->registerProcessor(service_name, processor);
+    processors[service_name] = processor;
+    std::cout << "[Sidecar] Registered Service: " << service_name << std::endl;
+}
+
+// 处理器类型只影响扩展内的快速路径，模板化处理器遇到其他协议时自动退回虚函数调用
+static void register_processor_ex(void* factory_instance, const char* service_name, void* t_processor_ptr, int) {
+    register_processor(factory_instance, service_name, t_processor_ptr);
+}
+
+// IDL 描述与方法选项只在扩展内使用 (ThriftBridgeClient、共享响应缓存)
+static void register_spec(void*, const ThriftBridgeServiceSpec*) {}
+static void register_method_flags(void*, const char*, const char*, unsigned int, unsigned int) {}
+
+static int load_plugins(const char* dir_path) {
+    DIR* dir = opendir(dir_path);
+    if (dir == nullptr) {
+        std::cerr << "[Sidecar Error]: Cannot open plugin directory " << dir_path << ": " << strerror(errno) << std::endl;
+        return -1;
+    }
+    int loaded = 0;
+    size_t suffix_len = strlen(PLUGIN_SUFFIX);
+    while (struct dirent* entry = readdir(dir)) {
+        size_t name_len = strlen(entry->d_name);
+        if (name_len <= suffix_len || strcmp(entry->d_name + name_len - suffix_len, PLUGIN_SUFFIX) != 0) {
+            continue;
+        }
+        std::string path = std::string(dir_path) + "/" + entry->d_name;
+        void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (handle == nullptr) {
+            std::cerr << "[Sidecar Error]: Cannot open library " << path << ": " << dlerror() << std::endl;
+            continue;
+        }
+        RegisterProcessorFunc register_func = (RegisterProcessorFunc)dlsym(handle, PLUGIN_REGISTER_FUNC_NAME);
+        if (register_func == nullptr) {
+            std::cerr << "[Sidecar Error]: Cannot find function " << PLUGIN_REGISTER_FUNC_NAME << " in " << path << std::endl;
+            continue;
+        }
+        ProcessorFactoryContext context;
+        context.factory_instance = multiplexed;
+        context.register_func_ptr = register_processor;
+        context.api_version = THRIFT_BRIDGE_PLUGIN_API_VERSION;
+        context.register_func_ex_ptr = register_processor_ex;
+        context.register_spec_ptr = register_spec;
+        context.register_method_flags_ptr = register_method_flags;
+        register_func(&context);
+        // 守护进程不 fork，插件在扩展里推迟到 fork 后才建立的资源 (线程、连接池等) 在注册后立即建立
+        PluginChildInitFunc child_init = (PluginChildInitFunc)dlsym(handle, PLUGIN_CHILD_INIT_FUNC_NAME);
+        if (child_init) {
+            child_init();
+        }
+        loaded++;
+    }
+    closedir(dir);
+    return loaded;
+}
+
+// 服务端的协议工厂固定为 binary；compact 消息 (首字节 0x82) 在这里换成 compact 协议，
+// 两端仍是同一连接的读写缓冲区
+class DetectingProcessor : public TProcessor {
+public:
+    explicit DetectingProcessor(std::shared_ptr<TProcessor> inner) : inner_(inner) {}
+
+    bool process(std::shared_ptr<TProtocol> in, std::shared_ptr<TProtocol> out, void* connectionContext) override {
+        TMemoryBuffer* buffer = dynamic_cast<TMemoryBuffer*>(in->getTransport().get());
+        uint32_t len = 1;
+        const uint8_t* peek = buffer ? buffer->borrow(nullptr, &len) : nullptr;
+        if (peek && len >= 1 && peek[0] == 0x82) {
+            std::shared_ptr<TProtocol> compact_in = std::make_shared<TCompactProtocol>(in->getTransport());
+            std::shared_ptr<TProtocol> compact_out = std::make_shared<TCompactProtocol>(out->getTransport());
+            return inner_->process(compact_in, compact_out, connectionContext);
+        }
+        return inner_->process(in, out, connectionContext);
+    }
+
+private:
+    std::shared_ptr<TProcessor> inner_;
+};
+
+// --- 共享内存通道 ---
+// 请求消息为 [服务名长度 2B][服务名][Thrift 消息]，响应消息为 [Thrift 消息或错误信息][RingStatus 1B]
+// (状态放在末尾，PHP 侧可以整条读进 zend_string 后截掉)。
+// 通道的 Unix 连接只用来传递 memfd 并感知对端退出：连接断开后线程退出、解除映射。
+
+// 对端 (PHP 工作进程) 是否已经断开
+static bool channel_peer_gone(int socket) {
+    struct pollfd pfd = { socket, POLLIN, 0 };
+    char byte;
+    return poll(&pfd, 1, 0) > 0 && recv(socket, &byte, 1, MSG_DONTWAIT) <= 0;
+}
+
+// 消息类型 (TMessageType)：binary 为版本字的最低字节，compact 为第二个字节的高 3 位
+static bool is_oneway_message(const char* body, uint32_t len) {
+    if (len >= 2 && (uint8_t)body[0] == 0x82) {
+        return ((uint8_t)body[1] >> 5) == T_ONEWAY;
+    }
+    return len >= 4 && (uint8_t)body[0] == 0x80 && (uint8_t)body[3] == T_ONEWAY;
+}
+
+// 写入一条响应。响应比环大时等 PHP 侧边读边释放；等不到且对端已断开时返回 false
+static bool write_reply(int socket, TC::RingHeader* responses, uint8_t status, const void* data, size_t len,
+                        TC::RingSpin& spin, uint64_t poll_ns) {
+    const void* parts[] = { data, &status };
+    size_t lens[] = { len, 1 };
+    while (!TC::ring_write_stream(responses, parts, lens, 2, spin, poll_ns)) {
+        if (channel_peer_gone(socket)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void serve_channel(int socket, void* channel, size_t mapped) {
+    TC::RingHeader* requests = TC::ring_at(channel, TC::RING_REQUEST);
+    TC::RingHeader* responses = TC::ring_at(channel, TC::RING_RESPONSE);
+    TC::RingSpin spin;
+    // 输入观察环内的请求，不复制
+    std::shared_ptr<TMemoryBuffer> input = std::make_shared<TMemoryBuffer>();
+    std::shared_ptr<TMemoryBuffer> output = std::make_shared<TMemoryBuffer>();
+    std::shared_ptr<TProtocol> binary_in = std::make_shared<TBinaryProtocol>(input);
+    std::shared_ptr<TProtocol> binary_out = std::make_shared<TBinaryProtocol>(output);
+    std::shared_ptr<TProtocol> compact_in = std::make_shared<TCompactProtocol>(input);
+    std::shared_ptr<TProtocol> compact_out = std::make_shared<TCompactProtocol>(output);
+    const uint64_t poll_ns = 1000000000ull;
+
+    for (;;) {
+        uint32_t len;
+        const char* message = TC::ring_peek(requests, &len, spin, poll_ns);
+        if (message == nullptr) {
+            if (len != 0) {
+                // 再等多久也读不完：丢弃通道，PHP 侧感知到挂断后改走 socket 或重建通道
+                std::cerr << "[Sidecar Error]: Ring request of " << len << " bytes exceeds the ring, dropping the channel." << std::endl;
+                break;
+            }
+            if (channel_peer_gone(socket)) {
+                break;
+            }
+            continue;
+        }
+
+        uint8_t status = TC::RING_STATUS_OK;
+        std::string error;
+        uint16_t name_len = 0;
+        if (len >= 2) {
+            memcpy(&name_len, message, 2);
+        }
+        auto it = len >= 2u + name_len ? processors.find(std::string(message + 2, name_len)) : processors.end();
+        output->resetBuffer();
+        bool replied = false;
+        if (it == processors.end()) {
+            status = TC::RING_STATUS_ERROR;
+            error = "Service is not registered in the sidecar.";
+        } else {
+            const char* body = message + 2 + name_len;
+            uint32_t body_len = len - 2 - name_len;
+            input->resetBuffer((uint8_t*)body, body_len, TMemoryBuffer::OBSERVE);
+            bool compact = body_len > 0 && (uint8_t)body[0] == 0x82;
+            // oneway 调用的 PHP 侧只等这条空回复 (保持两个环一一对应)，不必等处理器执行完；
+            // 之后处理器的失败与 socket 路径一样无从告知
+            if (is_oneway_message(body, body_len)) {
+                if (!write_reply(socket, responses, TC::RING_STATUS_OK, nullptr, 0, spin, poll_ns)) {
+                    break;
+                }
+                replied = true;
+            }
+            try {
+                if (!it->second->process(compact ? compact_in : binary_in, compact ? compact_out : binary_out, nullptr)) {
+                    status = TC::RING_STATUS_ERROR;
+                    error = "Processor failed.";
+                }
+            } catch (const std::exception& ex) {
+                status = TC::RING_STATUS_ERROR;
+                error = ex.what();
+            }
+        }
+        // 请求读完才释放 (处理器原地读取)
+        TC::ring_consume(requests, len);
+        if (replied) {
+            continue;
+        }
+
+        uint8_t* out = nullptr;
+        uint32_t out_len = 0;
+        if (status == TC::RING_STATUS_OK) {
+            output->getBuffer(&out, &out_len);
+        }
+        bool delivered = status == TC::RING_STATUS_OK
+            ? write_reply(socket, responses, status, out, out_len, spin, poll_ns)
+            : write_reply(socket, responses, status, error.data(), error.size(), spin, poll_ns);
+        if (!delivered) {
+            break;
+        }
+    }
+    munmap(channel, mapped);
+    close(socket);
+}
+
+// 接受一个通道：收下 memfd 并映射，回复一个字节表示就绪
+static void accept_channel(int socket) {
+    char byte;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg;
+    int fd = -1;
+    if (recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) == 1 && (cmsg = CMSG_FIRSTHDR(&msg)) != nullptr
+        && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    struct stat st;
+    void* channel = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        channel = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (channel == MAP_FAILED || !TC::ring_channel_valid(channel, (size_t)st.st_size)) {
+        std::cerr << "[Sidecar Error]: Rejected an invalid ring channel." << std::endl;
+        if (channel != MAP_FAILED) {
+            munmap(channel, (size_t)st.st_size);
+        }
+        close(socket);
+        return;
+    }
+    byte = 1;
+    if (send(socket, &byte, 1, MSG_NOSIGNAL) != 1) {
+        munmap(channel, (size_t)st.st_size);
+        close(socket);
+        return;
+    }
+    std::thread(serve_channel, socket, channel, (size_t)st.st_size).detach();
+}
+
+static bool listen_channels(const std::string& path) {
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (listener < 0 || path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 128) != 0) {
+        std::cerr << "[Sidecar Error]: Cannot listen on " << path << ": " << strerror(errno) << std::endl;
+        close(listener);
+        return false;
+    }
+    std::thread([listener]() {
+        for (;;) {
+            int socket = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (socket >= 0) {
+                accept_channel(socket);
+            } else if (errno != EINTR && errno != ECONNABORTED) {
+                break;
+            }
+        }
+    }).detach();
+    return true;
+}
+
+static TNonblockingServer* running_server = nullptr;
+
+static void handle_stop(int) {
+    if (running_server) {
+        running_server->stop();
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " <plugin_dir> <socket_path> [worker_threads]" << std::endl;
+        return 2;
+    }
+    const char* plugin_dir = argv[1];
+    const char* socket_path = argv[2];
+    int threads = argc > 3 ? atoi(argv[3]) : 8;
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    std::shared_ptr<TMultiplexedProcessor> processor = std::make_shared<TMultiplexedProcessor>();
+    multiplexed = processor.get();
+    if (load_plugins(plugin_dir) <= 0) {
+        std::cerr << "[Sidecar Error]: No plugin loaded from " << plugin_dir << std::endl;
+        return 1;
+    }
+
+    // 处理器在工作线程中执行 (插件必须是线程安全的)，I/O 线程只负责收发帧
+    std::shared_ptr<ThreadManager> workers = ThreadManager::newSimpleThreadManager((size_t)threads);
+    workers->threadFactory(std::make_shared<ThreadFactory>());
+    workers->start();
+
+    // 上一次运行留下的 socket 文件
+    unlink(socket_path);
+    std::shared_ptr<TNonblockingServerSocket> socket = std::make_shared<TNonblockingServerSocket>(std::string(socket_path));
+    TNonblockingServer server(std::make_shared<DetectingProcessor>(processor),
+                              std::make_shared<TBinaryProtocolFactory>(), socket, workers);
+    running_server = &server;
+    std::string ring_path = std::string(socket_path) + ".ring";
+    listen_channels(ring_path);
+    signal(SIGTERM, handle_stop);
+    signal(SIGINT, handle_stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::cout << "listening " << socket_path << std::endl;
+    server.serve();
+    running_server = nullptr;
+    unlink(socket_path);
+    unlink(ring_path.c_str());
+    return 0;
+}